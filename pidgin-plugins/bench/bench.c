@@ -0,0 +1,587 @@
+/*
+ * Headless benchmark for colornicks_logger.c.
+ *
+ *   make bench
+ *   bench/colornicks-bench --messages 200000 --logs 50 --workload mixed
+ *
+ * The plugin is built into this program against the libpurple stand-in in
+ * stub/, loaded as Pidgin loads it, and given conversations with a log
+ * each. A message stream is then written to the logs in turn through the
+ * logger's write function, with the main loop run between batches so the
+ * plugin's timers and idle callbacks fire, and the conversations are closed
+ * and the plugin unloaded, which waits for everything queued to be written.
+ *
+ * Streams are generated (plain text, heavy markup, inline images, or a mix
+ * with joins and parts) or replayed from a file of
+ *   flags<TAB>from<TAB>message
+ * lines, flags being PurpleMessageFlags, from "-" for none, and images
+ * referring to the generated ones by id, 1 to --images.
+ *
+ * Messages are generated before the clock starts. Reported are messages per
+ * second, bytes returned by write (what libpurple counts) and on disk, the
+ * read and write syscalls of the whole process from /proc/self/io, and the
+ * malloc, calloc and realloc calls per message. Allocations are counted by
+ * interposing on glibc's allocator, and GSlice is set to use malloc so its
+ * allocations are counted too.
+ */
+
+#include "../colornicks_logger.c"
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define COUNT_ALLOCATIONS
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static guint64 allocations = 0;
+
+void *
+malloc(size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+#define ALLOCATIONS() __atomic_load_n(&allocations, __ATOMIC_RELAXED)
+#else
+#define ALLOCATIONS() G_GUINT64_CONSTANT(0)
+#endif
+
+#define MAIN_LOOP_BATCH 64
+
+typedef struct {
+	PurpleMessageFlags flags;
+	char *from;
+	char *text;
+} BenchMessage;
+
+typedef struct {
+	guint64 rchar;
+	guint64 wchar;
+	guint64 syscr;
+	guint64 syscw;
+} IoCounters;
+
+static int opt_messages = 100000;
+static int opt_logs = 1;
+static int opt_nicks = 20;
+static int opt_images = 16;
+static int opt_image_size = 8192;
+static char *opt_workload = NULL;
+static char *opt_replay = NULL;
+static char *opt_format = NULL;
+static char *opt_type = NULL;
+static char *opt_dir = NULL;
+static char **opt_set = NULL;
+static gboolean opt_keep = FALSE;
+static gboolean opt_debug = FALSE;
+
+static GOptionEntry entries[] = {
+	{ "messages", 'n', 0, G_OPTION_ARG_INT, &opt_messages,
+	  "Messages to write (default 100000)", "N" },
+	{ "logs", 'l', 0, G_OPTION_ARG_INT, &opt_logs,
+	  "Conversations written to in turn (default 1)", "N" },
+	{ "workload", 'w', 0, G_OPTION_ARG_STRING, &opt_workload,
+	  "plain, markup, images or mixed (default plain)", "KIND" },
+	{ "replay", 'r', 0, G_OPTION_ARG_FILENAME, &opt_replay,
+	  "Replay the messages in FILE instead, repeated up to --messages", "FILE" },
+	{ "format", 'f', 0, G_OPTION_ARG_STRING, &opt_format,
+	  "colornicks, colornicks-gz, colornicks-bin or colornicks-db (default colornicks)", "ID" },
+	{ "type", 't', 0, G_OPTION_ARG_STRING, &opt_type,
+	  "chat or im (default chat)", "TYPE" },
+	{ "nicks", 0, 0, G_OPTION_ARG_INT, &opt_nicks,
+	  "Nicks talking in each conversation (default 20)", "N" },
+	{ "images", 0, 0, G_OPTION_ARG_INT, &opt_images,
+	  "Distinct inline images (default 16)", "N" },
+	{ "image-size", 0, 0, G_OPTION_ARG_INT, &opt_image_size,
+	  "Bytes per image (default 8192)", "BYTES" },
+	{ "set", 's', 0, G_OPTION_ARG_STRING_ARRAY, &opt_set,
+	  "Set a plugin pref first, e.g. async_write=1 or commit_policy=2", "PREF=VALUE" },
+	{ "dir", 'd', 0, G_OPTION_ARG_FILENAME, &opt_dir,
+	  "Write logs under DIR instead of a temporary directory", "DIR" },
+	{ "keep", 'k', 0, G_OPTION_ARG_NONE, &opt_keep,
+	  "Keep the temporary directory", NULL },
+	{ "debug", 0, 0, G_OPTION_ARG_NONE, &opt_debug,
+	  "Print the plugin's debug output", NULL },
+	{ NULL }
+};
+
+static const char *words[] = {
+	"the", "logger", "writes", "every", "line", "once", "and", "a", "nick", "color",
+	"is", "kept", "for", "each", "conversation", "so", "that", "reading", "it", "back",
+	"later", "shows", "who", "said", "what", "in", "which", "window", "with", "time",
+	"stamps", "lunch", "build", "broke", "again", "after", "merge", "ok", "thanks", "lol"
+};
+
+static void
+io_counters_get(IoCounters *io)
+{
+	char *contents, **lines, **line;
+
+	memset(io, 0, sizeof(*io));
+	if (!g_file_get_contents("/proc/self/io", &contents, NULL, NULL))
+		return;
+
+	lines = g_strsplit(contents, "\n", -1);
+	for (line = lines; *line; line++) {
+		guint64 value;
+		char name[16];
+
+		if (sscanf(*line, "%15[^:]: %" G_GUINT64_FORMAT, name, &value) != 2)
+			continue;
+		if (strcmp(name, "rchar") == 0)
+			io->rchar = value;
+		else if (strcmp(name, "wchar") == 0)
+			io->wchar = value;
+		else if (strcmp(name, "syscr") == 0)
+			io->syscr = value;
+		else if (strcmp(name, "syscw") == 0)
+			io->syscw = value;
+	}
+	g_strfreev(lines);
+	g_free(contents);
+}
+
+static guint64
+dir_size(const char *path)
+{
+	const char *name;
+	guint64 size = 0;
+	GDir *dir;
+
+	if ((dir = g_dir_open(path, 0, NULL)) == NULL)
+		return 0;
+
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		char *child = g_build_filename(path, name, NULL);
+		GStatBuf st;
+
+		if (g_lstat(child, &st) == 0)
+			size += S_ISDIR(st.st_mode) ? dir_size(child) : (guint64)st.st_size;
+		g_free(child);
+	}
+	g_dir_close(dir);
+
+	return size;
+}
+
+static void
+dir_remove(const char *path)
+{
+	const char *name;
+	GDir *dir;
+
+	if ((dir = g_dir_open(path, 0, NULL)) != NULL) {
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			char *child = g_build_filename(path, name, NULL);
+
+			if (g_file_test(child, G_FILE_TEST_IS_DIR) &&
+			    !g_file_test(child, G_FILE_TEST_IS_SYMLINK))
+				dir_remove(child);
+			else
+				g_unlink(child);
+			g_free(child);
+		}
+		g_dir_close(dir);
+	}
+	g_rmdir(path);
+}
+
+static void
+main_loop_drain(void)
+{
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+}
+
+static void
+append_words(GString *text, GRand *rand, int min, int max)
+{
+	int i, n = g_rand_int_range(rand, min, max + 1);
+
+	for (i = 0; i < n; i++) {
+		if (i > 0)
+			g_string_append_c(text, ' ');
+		g_string_append(text, words[g_rand_int_range(rand, 0, G_N_ELEMENTS(words))]);
+	}
+}
+
+static void
+append_markup(GString *text, GRand *rand)
+{
+	int i, n = g_rand_int_range(rand, 3, 8);
+
+	if (g_rand_int_range(rand, 0, 10) == 0)
+		g_string_append(text, "/me ");
+	for (i = 0; i < n; i++) {
+		switch (g_rand_int_range(rand, 0, 6)) {
+		case 0:
+			g_string_append(text, "<b>");
+			append_words(text, rand, 1, 3);
+			g_string_append(text, "</b> ");
+			break;
+		case 1:
+			g_string_append(text, "<i>");
+			append_words(text, rand, 1, 3);
+			g_string_append(text, "</i> ");
+			break;
+		case 2:
+			g_string_append_printf(text, "<font color=\"#%06x\">",
+			                       g_rand_int_range(rand, 0, 0x1000000));
+			append_words(text, rand, 2, 5);
+			g_string_append(text, "</font> ");
+			break;
+		case 3:
+			g_string_append_printf(text, "<a href=\"https://example.com/%u?a=1&amp;b=2\">"
+			                       "https://example.com/%u</a> ",
+			                       g_rand_int(rand), g_rand_int(rand));
+			break;
+		case 4:
+			append_words(text, rand, 1, 4);
+			g_string_append(text, " &amp; &lt;3 &quot;quoted&quot;<br>");
+			break;
+		default:
+			append_words(text, rand, 2, 6);
+			g_string_append_c(text, ' ');
+			break;
+		}
+	}
+}
+
+/* Adds message i of kind workload to messages. */
+static void
+generate_message(GArray *messages, const char *workload, gboolean chat, GRand *rand, int i)
+{
+	BenchMessage msg = { PURPLE_MESSAGE_RECV, NULL, NULL };
+	GString *text = g_string_sized_new(128);
+	char *nick = g_strdup_printf("nick%d", g_rand_int_range(rand, 0, MAX(opt_nicks, 1)));
+	int roll = g_rand_int_range(rand, 0, 100);
+	const char *kind = workload;
+
+	if (strcmp(workload, "mixed") == 0)
+		kind = roll < 75 ? "plain" : roll < 90 ? "markup" : roll < 93 ? "images" :
+		       chat ? "presence" : "plain";
+
+	if (i % 5 == 0)
+		msg.flags = PURPLE_MESSAGE_SEND;
+
+	if (strcmp(kind, "presence") == 0) {
+		msg.flags = PURPLE_MESSAGE_SYSTEM;
+		g_string_printf(text, roll % 2 ? "%s entered the room." : "%s left the room.", nick);
+		g_free(nick);
+		nick = g_strdup("");
+	} else if (strcmp(kind, "markup") == 0)
+		append_markup(text, rand);
+	else if (strcmp(kind, "images") == 0) {
+		append_words(text, rand, 0, 6);
+		g_string_append_printf(text, " <img id=\"%d\"> ",
+		                       g_rand_int_range(rand, 1, MAX(opt_images, 1) + 1));
+		append_words(text, rand, 0, 3);
+	} else
+		append_words(text, rand, 4, 25);
+
+	msg.from = nick;
+	msg.text = g_string_free(text, FALSE);
+	g_array_append_val(messages, msg);
+}
+
+/* Reads flags<TAB>from<TAB>message lines from path, repeated until there
+ * are opt_messages of them. */
+static gboolean
+replay_load(GArray *messages, const char *path)
+{
+	char *contents, **lines;
+	GError *error = NULL;
+	guint i, pass;
+
+	if (!g_file_get_contents(path, &contents, NULL, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	for (pass = 0; messages->len < (guint)opt_messages; pass++) {
+		guint before = messages->len;
+
+		for (i = 0; lines[i] && messages->len < (guint)opt_messages; i++) {
+			char **fields;
+			BenchMessage msg;
+
+			if (*lines[i] == '\0' || *lines[i] == '#')
+				continue;
+			fields = g_strsplit(lines[i], "\t", 3);
+			if (g_strv_length(fields) != 3) {
+				if (pass == 0)
+					fprintf(stderr, "%s:%u: expected flags<TAB>from<TAB>message\n", path, i + 1);
+				g_strfreev(fields);
+				continue;
+			}
+			msg.flags = strtoul(fields[0], NULL, 0);
+			msg.from = strcmp(fields[1], "-") == 0 ? NULL : g_strdup(fields[1]);
+			msg.text = g_strdup(fields[2]);
+			g_array_append_val(messages, msg);
+			g_strfreev(fields);
+		}
+		if (messages->len == before)
+			break;
+	}
+	g_strfreev(lines);
+
+	if (messages->len == 0) {
+		fprintf(stderr, "%s has no messages\n", path);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* PREF=VALUE, PREF relative to the plugin's prefs unless it starts
+ * with '/'. */
+static gboolean
+pref_apply(const char *setting)
+{
+	const char *eq = strchr(setting, '=');
+	char *name;
+	gboolean ok = TRUE;
+
+	if (eq == NULL) {
+		fprintf(stderr, "--set %s: expected PREF=VALUE\n", setting);
+		return FALSE;
+	}
+
+	name = *setting == '/' ? g_strndup(setting, eq - setting) :
+	       g_strdup_printf("/plugins/gtk/colornicks_logger/%.*s", (int)(eq - setting), setting);
+	switch (purple_prefs_get_type(name)) {
+	case PURPLE_PREF_BOOLEAN:
+		purple_prefs_set_bool(name, atoi(eq + 1) || g_ascii_strcasecmp(eq + 1, "true") == 0);
+		break;
+	case PURPLE_PREF_INT:
+		purple_prefs_set_int(name, atoi(eq + 1));
+		break;
+	case PURPLE_PREF_STRING:
+		purple_prefs_set_string(name, eq + 1);
+		break;
+	default:
+		fprintf(stderr, "--set: no such pref %s\n", name);
+		ok = FALSE;
+		break;
+	}
+	g_free(name);
+
+	return ok;
+}
+
+static void
+images_generate(GRand *rand)
+{
+	guchar *data = g_malloc(MAX(opt_image_size, 8));
+	int i, j;
+
+	for (i = 0; i < opt_images; i++) {
+		memcpy(data, "\x89PNG\r\n\x1a\n", 8);
+		for (j = 8; j < opt_image_size; j++)
+			data[j] = g_rand_int_range(rand, 0, 256);
+		purple_stub_imgstore_add(data, MAX(opt_image_size, 8));
+	}
+	g_free(data);
+}
+
+static double
+per(guint64 value, int messages)
+{
+	return messages > 0 ? (double)value / messages : 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	PurplePlugin plugin = { FALSE, NULL };
+	PurpleAccount *account;
+	PurpleConversation **convs;
+	PurpleLog **logs;
+	GArray *messages;
+	GRand *rand;
+	IoCounters io_start, io_end;
+	guint64 allocs_start, allocs_end, logged = 0, disk;
+	gint64 t_open, t_write, t_close, t_end;
+	time_t base;
+	char *dir;
+	gboolean chat;
+	int i;
+
+	/* Before GLib starts GSlice; see above. */
+	if (g_getenv("G_SLICE") == NULL)
+		g_setenv("G_SLICE", "always-malloc", TRUE);
+
+	context = g_option_context_new("- benchmark the colornicks logger");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return 2;
+	}
+	g_option_context_free(context);
+
+	if (opt_workload == NULL)
+		opt_workload = g_strdup("plain");
+	if (opt_format == NULL)
+		opt_format = g_strdup("colornicks");
+	if (opt_type == NULL)
+		opt_type = g_strdup("chat");
+	if (strcmp(opt_workload, "plain") != 0 && strcmp(opt_workload, "markup") != 0 &&
+	    strcmp(opt_workload, "images") != 0 && strcmp(opt_workload, "mixed") != 0) {
+		fprintf(stderr, "Unknown workload %s\n", opt_workload);
+		return 2;
+	}
+	if (strcmp(opt_type, "chat") != 0 && strcmp(opt_type, "im") != 0) {
+		fprintf(stderr, "Unknown conversation type %s\n", opt_type);
+		return 2;
+	}
+	chat = strcmp(opt_type, "chat") == 0;
+	opt_logs = MAX(opt_logs, 1);
+	opt_messages = MAX(opt_messages, 0);
+
+	if (opt_dir)
+		dir = g_strdup(opt_dir);
+	else if ((dir = g_dir_make_tmp("colornicks-bench-XXXXXX", &error)) == NULL) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+	purple_stub_set_user_dir(dir);
+	purple_stub_set_debug(opt_debug);
+
+	rand = g_rand_new_with_seed(1);
+	images_generate(rand);
+	messages = g_array_sized_new(FALSE, FALSE, sizeof(BenchMessage), opt_messages);
+	if (opt_replay) {
+		if (!replay_load(messages, opt_replay))
+			return 1;
+	} else {
+		for (i = 0; i < opt_messages; i++)
+			generate_message(messages, opt_workload, chat, rand, i);
+	}
+
+	purple_prefs_add_none("/purple");
+	purple_prefs_add_none("/purple/logging");
+	purple_prefs_add_string("/purple/logging/format", "html");
+	purple_init_plugin(&plugin);
+	for (i = 0; opt_set && opt_set[i]; i++)
+		if (!pref_apply(opt_set[i]))
+			return 2;
+
+	account = purple_stub_account_new("bench@example.com", "prpl-jabber");
+	if (!plugin.info->load(&plugin)) {
+		fprintf(stderr, "The plugin did not load\n");
+		return 1;
+	}
+	plugin.loaded = TRUE;
+	purple_prefs_set_string("/purple/logging/format", opt_format);
+	main_loop_drain();
+
+	/* Opening */
+	t_open = g_get_monotonic_time();
+	convs = g_new0(PurpleConversation *, opt_logs);
+	logs = g_new0(PurpleLog *, opt_logs);
+	for (i = 0; i < opt_logs; i++) {
+		char *name = chat ? g_strdup_printf("room%d", i) :
+		             g_strdup_printf("buddy%d@example.com", i);
+
+		convs[i] = purple_stub_conversation_new(chat ? PURPLE_CONV_TYPE_CHAT : PURPLE_CONV_TYPE_IM,
+		                                        account, name, 24);
+		logs[i] = convs[i]->logs->data;
+		g_free(name);
+		if (logs[i]->logger == NULL || logs[i]->logger->write == NULL) {
+			fprintf(stderr, "No logger %s; colornicks-db needs COLORNICKS_SQLITE\n", opt_format);
+			return 1;
+		}
+	}
+	main_loop_drain();
+
+	/* Writing */
+	io_counters_get(&io_start);
+	allocs_start = ALLOCATIONS();
+	t_write = g_get_monotonic_time();
+	base = time(NULL);
+	for (i = 0; i < (int)messages->len; i++) {
+		BenchMessage *msg = &g_array_index(messages, BenchMessage, i);
+		PurpleLog *log = logs[i % opt_logs];
+
+		logged += log->logger->write(log, msg->flags, msg->from, base + i / 20, msg->text);
+		if (i % MAIN_LOOP_BATCH == MAIN_LOOP_BATCH - 1)
+			main_loop_drain();
+	}
+	main_loop_drain();
+
+	/* Closing, which waits for the writer */
+	t_close = g_get_monotonic_time();
+	for (i = 0; i < opt_logs; i++)
+		purple_stub_conversation_destroy(convs[i]);
+	plugin.info->unload(&plugin);
+	plugin.loaded = FALSE;
+	main_loop_drain();
+	t_end = g_get_monotonic_time();
+	allocs_end = ALLOCATIONS();
+	io_counters_get(&io_end);
+
+	disk = dir_size(dir);
+
+	printf("workload        %s, %u messages over %d %s logs, format %s\n",
+	       opt_replay ? opt_replay : opt_workload, messages->len, opt_logs, opt_type, opt_format);
+	printf("open            %.1f ms\n", (t_write - t_open) / 1000.0);
+	printf("write           %.1f ms, %.0f messages/s\n", (t_close - t_write) / 1000.0,
+	       messages->len * 1e6 / MAX(t_close - t_write, 1));
+	printf("close           %.1f ms\n", (t_end - t_close) / 1000.0);
+	printf("write + close   %.1f ms, %.0f messages/s\n", (t_end - t_write) / 1000.0,
+	       messages->len * 1e6 / MAX(t_end - t_write, 1));
+	printf("logged bytes    %" G_GUINT64_FORMAT ", %.1f per message\n",
+	       logged, per(logged, messages->len));
+	printf("disk bytes      %" G_GUINT64_FORMAT ", %.1f per message\n",
+	       disk, per(disk, messages->len));
+	printf("write syscalls  %" G_GUINT64_FORMAT ", %.3f per message, %" G_GUINT64_FORMAT " bytes\n",
+	       io_end.syscw - io_start.syscw, per(io_end.syscw - io_start.syscw, messages->len),
+	       io_end.wchar - io_start.wchar);
+	printf("read syscalls   %" G_GUINT64_FORMAT ", %.3f per message, %" G_GUINT64_FORMAT " bytes\n",
+	       io_end.syscr - io_start.syscr, per(io_end.syscr - io_start.syscr, messages->len),
+	       io_end.rchar - io_start.rchar);
+#ifdef COUNT_ALLOCATIONS
+	printf("allocations     %" G_GUINT64_FORMAT ", %.2f per message\n",
+	       allocs_end - allocs_start, per(allocs_end - allocs_start, messages->len));
+#else
+	printf("allocations     not counted without glibc, or with ASan\n");
+#endif
+
+	if (!opt_dir && !opt_keep)
+		dir_remove(dir);
+	else
+		printf("logs            %s\n", dir);
+
+	for (i = 0; i < (int)messages->len; i++) {
+		BenchMessage *msg = &g_array_index(messages, BenchMessage, i);
+
+		g_free(msg->from);
+		g_free(msg->text);
+	}
+	g_array_free(messages, TRUE);
+	g_free(logs);
+	g_free(convs);
+	g_rand_free(rand);
+	g_free(dir);
+
+	return 0;
+}
@@ -0,0 +1,1448 @@
+/*
+ * The libpurple, Pidgin and GTK stand-in described in stub/purple-stub.h.
+ * Everything runs on the thread that calls it, like libpurple's main loop
+ * functions; those returning static buffers are not reentrant either.
+ */
+
+#include "purple-stub.h"
+
+static char *user_dir = NULL;
+static gboolean debug_enabled = FALSE;
+
+static GList *accounts = NULL;
+static GList *conversations = NULL;
+static GList *loggers = NULL;
+
+static int accounts_handle;
+static int connections_handle;
+static int conversations_handle;
+static int log_handle;
+
+void
+purple_stub_set_user_dir(const char *dir)
+{
+	g_free(user_dir);
+	user_dir = g_strdup(dir);
+}
+
+void
+purple_stub_set_debug(gboolean enabled)
+{
+	debug_enabled = enabled;
+}
+
+/**************************************************************************/
+/* Plugins                                                                */
+/**************************************************************************/
+
+struct _PurpleValue {
+	PurpleType type;
+};
+
+PurpleValue *
+purple_value_new(PurpleType type, ...)
+{
+	PurpleValue *value = g_new0(PurpleValue, 1);
+
+	value->type = type;
+	return value;
+}
+
+PurplePluginAction *
+purple_plugin_action_new(const char *label, void (*callback)(PurplePluginAction *))
+{
+	PurplePluginAction *action = g_new0(PurplePluginAction, 1);
+
+	action->label = g_strdup(label);
+	action->callback = callback;
+	return action;
+}
+
+/* Nothing calls into the plugin over IPC here. */
+gboolean
+purple_plugin_ipc_register(PurplePlugin *plugin, const char *command, PurpleCallback func,
+                           PurpleSignalMarshalFunc marshal, PurpleValue *ret_value,
+                           int num_params, ...)
+{
+	va_list args;
+	int i;
+
+	va_start(args, num_params);
+	for (i = 0; i < num_params; i++)
+		g_free(va_arg(args, PurpleValue *));
+	va_end(args);
+	g_free(ret_value);
+
+	return TRUE;
+}
+
+void
+purple_marshal_BOOLEAN__POINTER_POINTER(PurpleCallback cb, va_list args,
+                                        void *data, void **return_val)
+{
+}
+
+void
+purple_marshal_BOOLEAN__POINTER_POINTER_POINTER(PurpleCallback cb, va_list args,
+                                                void *data, void **return_val)
+{
+}
+
+void
+purple_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER(PurpleCallback cb, va_list args,
+                                                        void *data, void **return_val)
+{
+}
+
+void
+purple_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_POINTER(PurpleCallback cb, va_list args,
+                                                                void *data, void **return_val)
+{
+}
+
+/* The protocol is named by its id without "prpl-", as most prpls name
+ * their icon. */
+static const char *
+stub_list_icon(PurpleAccount *account, void *buddy)
+{
+	const char *id = purple_account_get_protocol_id(account);
+
+	return g_str_has_prefix(id, "prpl-") ? id + 5 : id;
+}
+
+PurplePlugin *
+purple_find_prpl(const char *id)
+{
+	static PurplePluginProtocolInfo prpl_info = { stub_list_icon };
+	static PurplePluginInfo info;
+	static PurplePlugin prpl;
+
+	if (prpl.info == NULL) {
+		info.type = PURPLE_PLUGIN_PROTOCOL;
+		info.extra_info = &prpl_info;
+		prpl.info = &info;
+		prpl.loaded = TRUE;
+	}
+
+	return &prpl;
+}
+
+/**************************************************************************/
+/* Signals, timeouts, debug, notify                                       */
+/**************************************************************************/
+
+typedef struct {
+	void *instance;
+	char *signal;
+	PurpleCallback func;
+	void *data;
+} SignalHandler;
+
+static GList *signal_handlers = NULL;
+
+gulong
+purple_signal_connect(void *instance, const char *signal, void *handle,
+                      PurpleCallback func, void *data)
+{
+	SignalHandler *handler = g_new0(SignalHandler, 1);
+
+	handler->instance = instance;
+	handler->signal = g_strdup(signal);
+	handler->func = func;
+	handler->data = data;
+	signal_handlers = g_list_append(signal_handlers, handler);
+
+	return g_list_length(signal_handlers);
+}
+
+/* Only signals with a single pointer argument, which is all the plugin
+ * connects to. */
+void
+purple_signal_emit(void *instance, const char *signal, ...)
+{
+	va_list args;
+	void *arg;
+	GList *l;
+
+	va_start(args, signal);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	for (l = signal_handlers; l; l = l->next) {
+		SignalHandler *handler = l->data;
+
+		if (handler->instance == instance && strcmp(handler->signal, signal) == 0)
+			((void (*)(void *, void *))handler->func)(arg, handler->data);
+	}
+}
+
+/* Nothing handles "log-timestamp", so logs get libpurple's own format. */
+void *
+purple_signal_emit_return_1(void *instance, const char *signal, ...)
+{
+	return NULL;
+}
+
+guint
+purple_timeout_add(guint interval, GSourceFunc function, gpointer data)
+{
+	return g_timeout_add(interval, function, data);
+}
+
+guint
+purple_timeout_add_seconds(guint interval, GSourceFunc function, gpointer data)
+{
+	return g_timeout_add_seconds(interval, function, data);
+}
+
+gboolean
+purple_timeout_remove(guint handle)
+{
+	return g_source_remove(handle);
+}
+
+static void
+debug_vargs(const char *level, const char *category, const char *format, va_list args)
+{
+	if (!debug_enabled)
+		return;
+
+	fprintf(stderr, "(%s) %s: ", level, category);
+	vfprintf(stderr, format, args);
+}
+
+void
+purple_debug_error(const char *category, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	debug_vargs("error", category, format, args);
+	va_end(args);
+}
+
+void
+purple_debug_info(const char *category, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	debug_vargs("info", category, format, args);
+	va_end(args);
+}
+
+void
+purple_debug_warning(const char *category, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	debug_vargs("warning", category, format, args);
+	va_end(args);
+}
+
+void *
+purple_notify_error(void *handle, const char *title, const char *primary, const char *secondary)
+{
+	fprintf(stderr, "%s: %s %s\n", title, primary, secondary ? secondary : "");
+	return NULL;
+}
+
+void *
+purple_notify_info(void *handle, const char *title, const char *primary, const char *secondary)
+{
+	fprintf(stderr, "%s: %s %s\n", title, primary, secondary ? secondary : "");
+	return NULL;
+}
+
+/**************************************************************************/
+/* Prefs                                                                  */
+/**************************************************************************/
+
+typedef struct {
+	PurplePrefType type;
+	int integer;
+	char *string;
+} Pref;
+
+typedef struct {
+	char *name;
+	PurplePrefCallback cb;
+	gpointer data;
+} PrefCallback;
+
+static GHashTable *prefs = NULL;
+static GList *pref_callbacks = NULL;
+
+static void
+pref_free(Pref *pref)
+{
+	g_free(pref->string);
+	g_free(pref);
+}
+
+static Pref *
+pref_get(const char *name)
+{
+	return prefs ? g_hash_table_lookup(prefs, name) : NULL;
+}
+
+static Pref *
+pref_add(const char *name, PurplePrefType type)
+{
+	Pref *pref = pref_get(name);
+
+	if (pref)
+		return NULL;
+
+	if (prefs == NULL)
+		prefs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)pref_free);
+
+	pref = g_new0(Pref, 1);
+	pref->type = type;
+	g_hash_table_insert(prefs, g_strdup(name), pref);
+	return pref;
+}
+
+static void
+pref_changed(const char *name, Pref *pref)
+{
+	gconstpointer val = pref->type == PURPLE_PREF_STRING ? (gconstpointer)pref->string :
+	                    GINT_TO_POINTER(pref->integer);
+	GList *l;
+
+	for (l = pref_callbacks; l; l = l->next) {
+		PrefCallback *callback = l->data;
+
+		if (strcmp(callback->name, name) == 0)
+			callback->cb(name, pref->type, val, callback->data);
+	}
+}
+
+void
+purple_prefs_add_none(const char *name)
+{
+	pref_add(name, PURPLE_PREF_NONE);
+}
+
+void
+purple_prefs_add_bool(const char *name, gboolean value)
+{
+	Pref *pref = pref_add(name, PURPLE_PREF_BOOLEAN);
+
+	if (pref)
+		pref->integer = value;
+}
+
+void
+purple_prefs_add_int(const char *name, int value)
+{
+	Pref *pref = pref_add(name, PURPLE_PREF_INT);
+
+	if (pref)
+		pref->integer = value;
+}
+
+void
+purple_prefs_add_string(const char *name, const char *value)
+{
+	Pref *pref = pref_add(name, PURPLE_PREF_STRING);
+
+	if (pref)
+		pref->string = g_strdup(value);
+}
+
+void
+purple_prefs_set_bool(const char *name, gboolean value)
+{
+	Pref *pref = pref_get(name);
+
+	if (pref == NULL || pref->type != PURPLE_PREF_BOOLEAN) {
+		purple_debug_error("prefs", "%s is not a bool pref\n", name);
+		return;
+	}
+	if (pref->integer != !!value) {
+		pref->integer = !!value;
+		pref_changed(name, pref);
+	}
+}
+
+void
+purple_prefs_set_int(const char *name, int value)
+{
+	Pref *pref = pref_get(name);
+
+	if (pref == NULL || pref->type != PURPLE_PREF_INT) {
+		purple_debug_error("prefs", "%s is not an int pref\n", name);
+		return;
+	}
+	if (pref->integer != value) {
+		pref->integer = value;
+		pref_changed(name, pref);
+	}
+}
+
+void
+purple_prefs_set_string(const char *name, const char *value)
+{
+	Pref *pref = pref_get(name);
+
+	if (pref == NULL || pref->type != PURPLE_PREF_STRING) {
+		purple_debug_error("prefs", "%s is not a string pref\n", name);
+		return;
+	}
+	if (g_strcmp0(pref->string, value) != 0) {
+		g_free(pref->string);
+		pref->string = g_strdup(value);
+		pref_changed(name, pref);
+	}
+}
+
+gboolean
+purple_prefs_get_bool(const char *name)
+{
+	Pref *pref = pref_get(name);
+
+	return pref && pref->type == PURPLE_PREF_BOOLEAN ? pref->integer : FALSE;
+}
+
+int
+purple_prefs_get_int(const char *name)
+{
+	Pref *pref = pref_get(name);
+
+	return pref && pref->type == PURPLE_PREF_INT ? pref->integer : 0;
+}
+
+const char *
+purple_prefs_get_string(const char *name)
+{
+	Pref *pref = pref_get(name);
+
+	return pref && pref->type == PURPLE_PREF_STRING ? pref->string : NULL;
+}
+
+PurplePrefType
+purple_prefs_get_type(const char *name)
+{
+	Pref *pref = pref_get(name);
+
+	return pref ? pref->type : PURPLE_PREF_NONE;
+}
+
+guint
+purple_prefs_connect_callback(void *handle, const char *name, PurplePrefCallback cb,
+                              gpointer data)
+{
+	PrefCallback *callback = g_new0(PrefCallback, 1);
+
+	callback->name = g_strdup(name);
+	callback->cb = cb;
+	callback->data = data;
+	pref_callbacks = g_list_append(pref_callbacks, callback);
+
+	return g_list_length(pref_callbacks);
+}
+
+/**************************************************************************/
+/* Accounts, connections, conversations                                   */
+/**************************************************************************/
+
+PurpleAccount *
+purple_stub_account_new(const char *username, const char *protocol_id)
+{
+	PurpleAccount *account = g_new0(PurpleAccount, 1);
+
+	account->username = g_strdup(username);
+	account->protocol_id = g_strdup(protocol_id);
+	accounts = g_list_append(accounts, account);
+
+	return account;
+}
+
+const char *
+purple_account_get_username(const PurpleAccount *account)
+{
+	return account->username;
+}
+
+const char *
+purple_account_get_protocol_id(const PurpleAccount *account)
+{
+	return account->protocol_id;
+}
+
+GList *
+purple_accounts_get_all(void)
+{
+	return accounts;
+}
+
+void *
+purple_accounts_get_handle(void)
+{
+	return &accounts_handle;
+}
+
+PurpleAccount *
+purple_connection_get_account(const PurpleConnection *gc)
+{
+	return gc->account;
+}
+
+void *
+purple_connections_get_handle(void)
+{
+	return &connections_handle;
+}
+
+/* Makes a conversation with a Pidgin window whose palette has palette_len
+ * colors, and the log libpurple would open for it, then emits
+ * "conversation-created". */
+PurpleConversation *
+purple_stub_conversation_new(PurpleConversationType type, PurpleAccount *account,
+                             const char *name, guint palette_len)
+{
+	PurpleConversation *conv = g_new0(PurpleConversation, 1);
+	PidginConversation *gtkconv = g_new0(PidginConversation, 1);
+	guint i;
+
+	conv->type = type;
+	conv->account = account;
+	conv->name = g_strdup(name);
+	conv->data = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	gtkconv->active_conv = conv;
+	gtkconv->webview = g_object_new(GTK_TYPE_WIDGET, NULL);
+	gtkconv->nick_colors = g_array_sized_new(FALSE, FALSE, sizeof(GdkColor), palette_len);
+	for (i = 0; i < palette_len; i++) {
+		GdkColor color = { 0, (i * 40503u) & 0x7fff, (i * 23311u) & 0x7fff,
+		                   (i * 9973u) & 0x7fff };
+		g_array_append_val(gtkconv->nick_colors, color);
+	}
+	conv->ui_data = gtkconv;
+
+	conv->logs = g_list_append(NULL,
+		purple_log_new(type == PURPLE_CONV_TYPE_CHAT ? PURPLE_LOG_CHAT : PURPLE_LOG_IM,
+		               name, account, conv, time(NULL), NULL));
+	conversations = g_list_prepend(conversations, conv);
+
+	purple_signal_emit(purple_conversations_get_handle(), "conversation-created", conv);
+	return conv;
+}
+
+/* Closes conv the way libpurple does, after "deleting-conversation". */
+void
+purple_stub_conversation_destroy(PurpleConversation *conv)
+{
+	PidginConversation *gtkconv = conv->ui_data;
+
+	purple_signal_emit(purple_conversations_get_handle(), "deleting-conversation", conv);
+	purple_conversation_close_logs(conv);
+	conversations = g_list_remove(conversations, conv);
+
+	g_object_unref(gtkconv->webview);
+	g_array_free(gtkconv->nick_colors, TRUE);
+	g_free(gtkconv);
+	g_hash_table_destroy(conv->data);
+	g_free(conv->name);
+	g_free(conv);
+}
+
+GList *
+purple_get_conversations(void)
+{
+	return conversations;
+}
+
+void *
+purple_conversations_get_handle(void)
+{
+	return &conversations_handle;
+}
+
+PurpleConversationType
+purple_conversation_get_type(const PurpleConversation *conv)
+{
+	return conv->type;
+}
+
+PurpleAccount *
+purple_conversation_get_account(const PurpleConversation *conv)
+{
+	return conv->account;
+}
+
+const char *
+purple_conversation_get_name(const PurpleConversation *conv)
+{
+	return conv->name;
+}
+
+void
+purple_conversation_set_data(PurpleConversation *conv, const char *key, gpointer data)
+{
+	g_hash_table_replace(conv->data, g_strdup(key), data);
+}
+
+gpointer
+purple_conversation_get_data(PurpleConversation *conv, const char *key)
+{
+	return g_hash_table_lookup(conv->data, key);
+}
+
+void
+purple_conversation_close_logs(PurpleConversation *conv)
+{
+	g_list_free_full(conv->logs, (GDestroyNotify)purple_log_free);
+	conv->logs = NULL;
+}
+
+/**************************************************************************/
+/* Logs                                                                   */
+/**************************************************************************/
+
+void *
+purple_log_get_handle(void)
+{
+	return &log_handle;
+}
+
+PurpleLogLogger *
+purple_log_logger_new(const char *id, const char *name, int functions, ...)
+{
+	PurpleLogLogger *logger = g_new0(PurpleLogLogger, 1);
+	va_list args;
+
+	logger->id = g_strdup(id);
+	logger->name = g_strdup(name);
+
+	va_start(args, functions);
+	if (functions >= 1)
+		logger->create = va_arg(args, void *);
+	if (functions >= 2)
+		logger->write = va_arg(args, void *);
+	if (functions >= 3)
+		logger->finalize = va_arg(args, void *);
+	if (functions >= 4)
+		logger->list = va_arg(args, void *);
+	if (functions >= 5)
+		logger->read = va_arg(args, void *);
+	if (functions >= 6)
+		logger->size = va_arg(args, void *);
+	if (functions >= 7)
+		logger->total_size = va_arg(args, void *);
+	if (functions >= 8)
+		logger->list_syslog = va_arg(args, void *);
+	if (functions >= 9)
+		logger->get_log_sets = va_arg(args, void *);
+	if (functions >= 10)
+		logger->remove = va_arg(args, void *);
+	if (functions >= 11)
+		logger->is_deletable = va_arg(args, void *);
+	va_end(args);
+
+	return logger;
+}
+
+void
+purple_log_logger_free(PurpleLogLogger *logger)
+{
+	g_free(logger->name);
+	g_free(logger->id);
+	g_free(logger);
+}
+
+void
+purple_log_logger_add(PurpleLogLogger *logger)
+{
+	if (!g_list_find(loggers, logger))
+		loggers = g_list_append(loggers, logger);
+}
+
+void
+purple_log_logger_remove(PurpleLogLogger *logger)
+{
+	loggers = g_list_remove(loggers, logger);
+}
+
+PurpleLogLogger *
+purple_log_logger_get(void)
+{
+	const char *id = purple_prefs_get_string("/purple/logging/format");
+	GList *l;
+
+	for (l = loggers; l; l = l->next) {
+		PurpleLogLogger *logger = l->data;
+
+		if (g_strcmp0(logger->id, id) == 0)
+			return logger;
+	}
+
+	return NULL;
+}
+
+PurpleLog *
+purple_log_new(PurpleLogType type, const char *name, PurpleAccount *account,
+               PurpleConversation *conv, time_t time, const struct tm *tm)
+{
+	PurpleLog *log = g_slice_new0(PurpleLog);
+
+	log->type = type;
+	log->name = g_strdup(purple_normalize(account, name));
+	log->account = account;
+	log->conv = conv;
+	log->time = time;
+	log->logger = purple_log_logger_get();
+	if (tm != NULL)
+		log->tm = g_slice_dup(struct tm, tm);
+
+	if (log->logger && log->logger->create)
+		log->logger->create(log);
+	return log;
+}
+
+void
+purple_log_free(PurpleLog *log)
+{
+	if (log->logger && log->logger->finalize)
+		log->logger->finalize(log);
+	g_free(log->name);
+	if (log->tm)
+		g_slice_free(struct tm, log->tm);
+	g_slice_free(PurpleLog, log);
+}
+
+char *
+purple_log_get_log_dir(PurpleLogType type, const char *name, PurpleAccount *account)
+{
+	PurplePlugin *prpl = purple_find_prpl(purple_account_get_protocol_id(account));
+	const char *prpl_name = PURPLE_PLUGIN_PROTOCOL_INFO(prpl)->list_icon(account, NULL);
+	char *acct_name, *target, *dir;
+
+	acct_name = g_strdup(purple_escape_filename(purple_normalize(account,
+	                     purple_account_get_username(account))));
+	if (type == PURPLE_LOG_CHAT) {
+		char *chat = g_strdup_printf("%s.chat", name);
+		target = g_strdup(purple_escape_filename(chat));
+		g_free(chat);
+	} else if (type == PURPLE_LOG_SYSTEM)
+		target = g_strdup(".system");
+	else
+		target = g_strdup(purple_escape_filename(purple_normalize(account, name)));
+
+	dir = g_build_filename(purple_user_dir(), "logs", prpl_name, acct_name, target, NULL);
+	g_free(target);
+	g_free(acct_name);
+
+	return dir;
+}
+
+void
+purple_log_common_writer(PurpleLog *log, const char *ext)
+{
+	PurpleLogCommonLoggerData *data;
+	const char *tz, *date;
+	char *dir, *filename, *path;
+	struct tm *tm;
+
+	if (log->logger_data != NULL)
+		return;
+
+	dir = purple_log_get_log_dir(log->type, log->name, log->account);
+	if (dir == NULL)
+		return;
+	purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+
+	tm = localtime(&log->time);
+	tz = purple_escape_filename(purple_utf8_strftime("%Z", tm));
+	date = purple_utf8_strftime("%Y-%m-%d.%H%M%S%z", tm);
+	filename = g_strdup_printf("%s%s%s", date, tz, ext ? ext : "");
+	path = g_build_filename(dir, filename, NULL);
+	g_free(dir);
+	g_free(filename);
+
+	log->logger_data = data = g_slice_new0(PurpleLogCommonLoggerData);
+	data->file = g_fopen(path, "a");
+	if (data->file == NULL)
+		purple_debug_error("log", "Could not create log file %s\n", path);
+	data->path = path;
+}
+
+GList *
+purple_log_common_lister(PurpleLogType type, const char *name, PurpleAccount *account,
+                         const char *ext, PurpleLogLogger *logger)
+{
+	char *dir = purple_log_get_log_dir(type, name, account);
+	const char *filename;
+	GList *list = NULL;
+	GDir *gdir;
+
+	if (dir == NULL || (gdir = g_dir_open(dir, 0, NULL)) == NULL) {
+		g_free(dir);
+		return NULL;
+	}
+
+	while ((filename = g_dir_read_name(gdir)) != NULL) {
+		PurpleLogCommonLoggerData *data;
+		PurpleLog *log;
+		struct tm tm;
+		long tz_off;
+		time_t stamp;
+
+		if (!g_str_has_suffix(filename, ext) || strlen(filename) < 17 + strlen(ext))
+			continue;
+
+		stamp = purple_str_to_time(filename, FALSE, &tm, &tz_off, NULL);
+		log = purple_log_new(type, name, account, NULL, stamp, &tm);
+		log->logger = logger;
+		log->logger_data = data = g_slice_new0(PurpleLogCommonLoggerData);
+		data->path = g_build_filename(dir, filename, NULL);
+		list = g_list_prepend(list, log);
+	}
+	g_dir_close(gdir);
+	g_free(dir);
+
+	return list;
+}
+
+int
+purple_log_common_total_sizer(PurpleLogType type, const char *name, PurpleAccount *account,
+                              const char *ext)
+{
+	char *dir = purple_log_get_log_dir(type, name, account);
+	const char *filename;
+	GDir *gdir;
+	int size = 0;
+
+	if (dir == NULL || (gdir = g_dir_open(dir, 0, NULL)) == NULL) {
+		g_free(dir);
+		return 0;
+	}
+
+	while ((filename = g_dir_read_name(gdir)) != NULL) {
+		if (g_str_has_suffix(filename, ext) && strlen(filename) >= 17 + strlen(ext)) {
+			char *path = g_build_filename(dir, filename, NULL);
+			GStatBuf st;
+
+			if (g_stat(path, &st) == 0)
+				size += st.st_size;
+			g_free(path);
+		}
+	}
+	g_dir_close(gdir);
+	g_free(dir);
+
+	return size;
+}
+
+int
+purple_log_common_sizer(PurpleLog *log)
+{
+	PurpleLogCommonLoggerData *data = log->logger_data;
+	GStatBuf st;
+
+	if (data == NULL || data->path == NULL || g_stat(data->path, &st) != 0)
+		return 0;
+	return st.st_size;
+}
+
+gboolean
+purple_log_common_deleter(PurpleLog *log)
+{
+	PurpleLogCommonLoggerData *data = log->logger_data;
+
+	return data && data->path && g_unlink(data->path) == 0;
+}
+
+gboolean
+purple_log_common_is_deletable(PurpleLog *log)
+{
+	PurpleLogCommonLoggerData *data = log->logger_data;
+
+	return data && data->path;
+}
+
+/**************************************************************************/
+/* Image store                                                            */
+/**************************************************************************/
+
+struct _PurpleStoredImage {
+	int id;
+	gpointer data;
+	size_t size;
+};
+
+static GPtrArray *images = NULL;
+
+/* Returns the id of a copy of data; ids start at 1. */
+int
+purple_stub_imgstore_add(gconstpointer data, size_t size)
+{
+	PurpleStoredImage *img = g_new0(PurpleStoredImage, 1);
+
+	if (images == NULL)
+		images = g_ptr_array_new();
+
+	img->data = g_memdup2(data, size);
+	img->size = size;
+	g_ptr_array_add(images, img);
+	img->id = images->len;
+
+	return img->id;
+}
+
+PurpleStoredImage *
+purple_imgstore_find_by_id(int id)
+{
+	if (images == NULL || id < 1 || (guint)id > images->len)
+		return NULL;
+	return g_ptr_array_index(images, id - 1);
+}
+
+gconstpointer
+purple_imgstore_get_data(PurpleStoredImage *img)
+{
+	return img->data;
+}
+
+size_t
+purple_imgstore_get_size(PurpleStoredImage *img)
+{
+	return img->size;
+}
+
+/**************************************************************************/
+/* Utilities                                                              */
+/**************************************************************************/
+
+const char *
+purple_user_dir(void)
+{
+	return user_dir;
+}
+
+int
+purple_build_dir(const char *path, int mode)
+{
+	return g_mkdir_with_parents(path, mode);
+}
+
+const char *
+purple_escape_filename(const char *str)
+{
+	static char buf[BUFSIZ];
+	const char *p;
+	gsize j = 0;
+
+	for (p = str; *p && j < sizeof(buf) - 4; p++) {
+		guchar c = *p;
+
+		if (g_ascii_isalnum(c) || c == '@' || c == '-' || c == '_' || c == '.' || c == '#' ||
+		    c >= 0x80)
+			buf[j++] = c;
+		else
+			j += g_snprintf(buf + j, 4, "%%%02x", c);
+	}
+	buf[j] = '\0';
+
+	return buf;
+}
+
+const char *
+purple_normalize(const PurpleAccount *account, const char *str)
+{
+	static char buf[BUFSIZ];
+	char *down = g_utf8_strdown(str, -1);
+
+	g_strlcpy(buf, down, sizeof(buf));
+	g_free(down);
+
+	return buf;
+}
+
+const char *
+purple_utf8_strftime(const char *format, const struct tm *tm)
+{
+	static char buf[128];
+	struct tm now;
+
+	if (tm == NULL) {
+		time_t t = time(NULL);
+		localtime_r(&t, &now);
+		tm = &now;
+	}
+	if (strftime(buf, sizeof(buf), format, tm) == 0)
+		buf[0] = '\0';
+
+	return buf;
+}
+
+const char *
+purple_date_format_full(const struct tm *tm)
+{
+	static char buf[128];
+
+	strftime(buf, sizeof(buf), "%c", tm);
+	return buf;
+}
+
+const char *
+purple_date_format_long(const struct tm *tm)
+{
+	static char buf[128];
+
+	strftime(buf, sizeof(buf), "%x %X", tm);
+	return buf;
+}
+
+const char *
+purple_time_format(const struct tm *tm)
+{
+	static char buf[64];
+
+	strftime(buf, sizeof(buf), "%X", tm);
+	return buf;
+}
+
+/* Only the "YYYY-MM-DD.HHMMSS" log file names start with, in local time. */
+time_t
+purple_str_to_time(const char *timestamp, gboolean utc, struct tm *tm, long *tz_off,
+                   const char **rest)
+{
+	struct tm t;
+	time_t ret;
+
+	memset(&t, 0, sizeof(t));
+	if (sscanf(timestamp, "%4d-%2d-%2d.%2d%2d%2d", &t.tm_year, &t.tm_mon, &t.tm_mday,
+	           &t.tm_hour, &t.tm_min, &t.tm_sec) != 6)
+		return 0;
+	t.tm_year -= 1900;
+	t.tm_mon -= 1;
+	t.tm_isdst = -1;
+
+	ret = mktime(&t);
+	if (tm)
+		*tm = t;
+	if (tz_off)
+		*tz_off = 0;
+	if (rest)
+		*rest = timestamp + 17;
+
+	return ret;
+}
+
+char *
+purple_str_size_to_units(goffset size)
+{
+	return g_format_size(size);
+}
+
+/* Names an image by its SHA-1 like libpurple, with the extension its magic
+ * gives. */
+char *
+purple_util_get_image_filename(gconstpointer image_data, size_t image_len)
+{
+	const guchar *data = image_data;
+	const char *ext = "icon";
+	char *checksum, *filename;
+
+	if (image_len >= 4 && memcmp(data, "\x89PNG", 4) == 0)
+		ext = "png";
+	else if (image_len >= 3 && memcmp(data, "\xff\xd8\xff", 3) == 0)
+		ext = "jpg";
+	else if (image_len >= 4 && memcmp(data, "GIF8", 4) == 0)
+		ext = "gif";
+
+	checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, data, image_len);
+	filename = g_strdup_printf("%s.%s", checksum, ext);
+	g_free(checksum);
+
+	return filename;
+}
+
+/* Finds <needle ...> and its name="value" attributes, keyed in lowercase. */
+gboolean
+purple_markup_find_tag(const char *needle, const char *haystack, const char **start,
+                       const char **end, GData **attributes)
+{
+	gsize needle_len = strlen(needle);
+	const char *cur;
+
+	for (cur = strchr(haystack, '<'); cur; cur = strchr(cur + 1, '<')) {
+		const char *p = cur + 1 + needle_len;
+
+		if (g_ascii_strncasecmp(cur + 1, needle, needle_len) != 0 ||
+		    (*p != '>' && *p != '/' && !g_ascii_isspace(*p)))
+			continue;
+
+		g_datalist_init(attributes);
+		while (*p && *p != '>') {
+			const char *name, *value;
+			char *key;
+			char quote = 0;
+
+			while (g_ascii_isspace(*p) || *p == '/')
+				p++;
+			name = p;
+			while (*p && *p != '=' && *p != '>' && !g_ascii_isspace(*p))
+				p++;
+			if (*p != '=')
+				continue;
+			if (p == name) {
+				p++;
+				continue;
+			}
+
+			key = g_ascii_strdown(name, p - name);
+			p++;
+			if (*p == '"' || *p == '\'')
+				quote = *p++;
+			value = p;
+			while (*p && (quote ? *p != quote : (*p != '>' && !g_ascii_isspace(*p))))
+				p++;
+			g_datalist_set_data_full(attributes, key, g_strndup(value, p - value), g_free);
+			g_free(key);
+			if (quote && *p)
+				p++;
+		}
+		if (*p != '>') {
+			g_datalist_clear(attributes);
+			return FALSE;
+		}
+
+		*start = cur;
+		*end = p;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Closes the void tags libpurple's parser would; everything else is
+ * copied. It is cheaper than libpurple's, so markup heavy workloads
+ * understate the time spent here. */
+void
+purple_markup_html_to_xhtml(const char *html, char **dest_xhtml, char **dest_plain)
+{
+	GString *xhtml = g_string_sized_new(strlen(html) + 16);
+	const char *p = html;
+
+	while (*p) {
+		if (g_ascii_strncasecmp(p, "<br>", 4) == 0) {
+			g_string_append(xhtml, "<br/>");
+			p += 4;
+		} else
+			g_string_append_c(xhtml, *p++);
+	}
+
+	if (dest_xhtml)
+		*dest_xhtml = g_string_free(xhtml, FALSE);
+	else
+		g_string_free(xhtml, TRUE);
+	if (dest_plain)
+		*dest_plain = purple_markup_strip_html(html);
+}
+
+char *
+purple_markup_strip_html(const char *str)
+{
+	GString *plain = g_string_sized_new(strlen(str));
+	char *unescaped;
+	const char *p;
+	gboolean in_tag = FALSE;
+
+	for (p = str; *p; p++) {
+		if (*p == '<')
+			in_tag = TRUE;
+		else if (*p == '>' && in_tag)
+			in_tag = FALSE;
+		else if (!in_tag)
+			g_string_append_c(plain, *p);
+	}
+
+	unescaped = purple_unescape_html(plain->str);
+	g_string_free(plain, TRUE);
+	return unescaped;
+}
+
+char *
+purple_unescape_html(const char *html)
+{
+	static const struct { const char *entity; char c; } entities[] = {
+		{ "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' },
+		{ "&apos;", '\'' }, { "&nbsp;", ' ' }
+	};
+	GString *ret = g_string_sized_new(strlen(html));
+	const char *p = html;
+
+	while (*p) {
+		guint i;
+
+		if (*p == '&') {
+			for (i = 0; i < G_N_ELEMENTS(entities); i++) {
+				gsize len = strlen(entities[i].entity);
+
+				if (strncmp(p, entities[i].entity, len) == 0) {
+					g_string_append_c(ret, entities[i].c);
+					p += len;
+					break;
+				}
+			}
+			if (i < G_N_ELEMENTS(entities))
+				continue;
+			if (p[1] == '#' && g_ascii_isdigit(p[2])) {
+				char *semi;
+				gunichar c = strtoul(p + 2, &semi, 10);
+
+				if (*semi == ';') {
+					g_string_append_unichar(ret, c);
+					p = semi + 1;
+					continue;
+				}
+			}
+		} else if (g_ascii_strncasecmp(p, "<br>", 4) == 0) {
+			g_string_append_c(ret, '\n');
+			p += 4;
+			continue;
+		}
+		g_string_append_c(ret, *p++);
+	}
+
+	return g_string_free(ret, FALSE);
+}
+
+/* Strips a leading "/me " (after any tags) and returns whether it did. */
+gboolean
+purple_message_meify(char *message, gssize len)
+{
+	char *c = message;
+	gboolean inside_html = FALSE;
+
+	if (len == -1)
+		len = strlen(message);
+
+	for (; len > 0; c++, len--) {
+		if (inside_html) {
+			if (*c == '>')
+				inside_html = FALSE;
+		} else if (*c == '<')
+			inside_html = TRUE;
+		else
+			break;
+	}
+
+	if (len >= 4 && g_ascii_strncasecmp(c, "/me ", 4) == 0) {
+		memmove(c, c + 4, len - 3);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**************************************************************************/
+/* Request                                                                */
+/**************************************************************************/
+
+struct _PurpleRequestFields {
+	GList *groups;
+};
+
+struct _PurpleRequestFieldGroup {
+	GList *fields;
+};
+
+struct _PurpleRequestField {
+	char *id;
+	char *value;
+};
+
+PurpleRequestFields *
+purple_request_fields_new(void)
+{
+	return g_new0(PurpleRequestFields, 1);
+}
+
+void
+purple_request_fields_add_group(PurpleRequestFields *fields, PurpleRequestFieldGroup *group)
+{
+	fields->groups = g_list_append(fields->groups, group);
+}
+
+const char *
+purple_request_fields_get_string(const PurpleRequestFields *fields, const char *id)
+{
+	GList *g, *f;
+
+	for (g = fields->groups; g; g = g->next) {
+		PurpleRequestFieldGroup *group = g->data;
+
+		for (f = group->fields; f; f = f->next) {
+			PurpleRequestField *field = f->data;
+
+			if (strcmp(field->id, id) == 0)
+				return field->value;
+		}
+	}
+
+	return NULL;
+}
+
+PurpleRequestFieldGroup *
+purple_request_field_group_new(const char *title)
+{
+	return g_new0(PurpleRequestFieldGroup, 1);
+}
+
+void
+purple_request_field_group_add_field(PurpleRequestFieldGroup *group, PurpleRequestField *field)
+{
+	group->fields = g_list_append(group->fields, field);
+}
+
+PurpleRequestField *
+purple_request_field_string_new(const char *id, const char *text, const char *default_value,
+                                gboolean multiline)
+{
+	PurpleRequestField *field = g_new0(PurpleRequestField, 1);
+
+	field->id = g_strdup(id);
+	field->value = g_strdup(default_value);
+	return field;
+}
+
+/* Accepts the defaults at once, as a user clicking OK would. */
+void *
+purple_request_fields(void *handle, const char *title, const char *primary,
+                      const char *secondary, PurpleRequestFields *fields,
+                      const char *ok_text, GCallback ok_cb,
+                      const char *cancel_text, GCallback cancel_cb,
+                      PurpleAccount *account, const char *who,
+                      PurpleConversation *conv, void *user_data)
+{
+	if (ok_cb)
+		((void (*)(void *, PurpleRequestFields *))ok_cb)(user_data, fields);
+	return NULL;
+}
+
+/**************************************************************************/
+/* GTK and Pidgin                                                         */
+/**************************************************************************/
+
+typedef struct {
+	GObjectClass parent_class;
+} GtkWidgetClass;
+
+G_DEFINE_TYPE(GtkWidget, gtk_widget, G_TYPE_OBJECT)
+
+static void
+gtk_widget_class_init(GtkWidgetClass *klass)
+{
+	g_signal_new("style-updated", G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_LAST, 0,
+	             NULL, NULL, NULL, G_TYPE_NONE, 0);
+	g_signal_new("toggled", G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_LAST, 0,
+	             NULL, NULL, NULL, G_TYPE_NONE, 0);
+}
+
+static void
+gtk_widget_init(GtkWidget *widget)
+{
+}
+
+static GtkWidget *
+widget_new(void)
+{
+	return g_object_new(GTK_TYPE_WIDGET, NULL);
+}
+
+GtkWidget *
+gtk_box_new(GtkOrientation orientation, gint spacing)
+{
+	return widget_new();
+}
+
+void
+gtk_box_pack_start(GtkBox *box, GtkWidget *child, gboolean expand, gboolean fill,
+                   guint padding)
+{
+}
+
+void
+gtk_container_add(GtkContainer *container, GtkWidget *widget)
+{
+}
+
+void
+gtk_container_set_border_width(GtkContainer *container, guint border_width)
+{
+}
+
+GtkWidget *
+gtk_check_button_new_with_mnemonic(const gchar *label)
+{
+	return widget_new();
+}
+
+GtkWidget *
+gtk_radio_button_new_with_mnemonic(GSList *group, const gchar *label)
+{
+	return widget_new();
+}
+
+GtkWidget *
+gtk_radio_button_new_with_mnemonic_from_widget(GtkRadioButton *radio_group_member,
+                                               const gchar *label)
+{
+	return widget_new();
+}
+
+gboolean
+gtk_toggle_button_get_active(GtkToggleButton *toggle_button)
+{
+	return toggle_button->active;
+}
+
+void
+gtk_toggle_button_set_active(GtkToggleButton *toggle_button, gboolean is_active)
+{
+	if (toggle_button->active != is_active) {
+		toggle_button->active = is_active;
+		g_signal_emit_by_name(toggle_button, "toggled");
+	}
+}
+
+/* A light theme: white base, as the palette is chosen for. */
+GtkStyle *
+gtk_widget_get_style(GtkWidget *widget)
+{
+	static GtkStyle style = {
+		{ { 0, 0xffff, 0xffff, 0xffff } },
+		{ 0, 0xffff, 0xffff, 0xffff }
+	};
+
+	return &style;
+}
+
+void
+gtk_widget_show_all(GtkWidget *widget)
+{
+}
+
+GtkWidget *
+pidgin_make_frame(GtkWidget *parent, const char *title)
+{
+	return widget_new();
+}
+
+GtkWidget *
+pidgin_prefs_checkbox(const char *title, const char *key, GtkWidget *page)
+{
+	return widget_new();
+}
+
+GtkWidget *
+pidgin_prefs_labeled_spin_button(GtkWidget *page, const gchar *title, const char *key,
+                                 int min, int max, GtkSizeGroup *sg)
+{
+	return widget_new();
+}
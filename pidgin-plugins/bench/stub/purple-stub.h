@@ -0,0 +1,519 @@
+/*
+ * A stand-in for the parts of libpurple, Pidgin and GTK that
+ * colornicks_logger.c uses, so the logger can be run by the benchmark in
+ * bench/ without either. Every header the plugin includes is a one-line
+ * header next to this one that includes it.
+ *
+ * Types carry only the fields the plugin touches, in libpurple's names.
+ * The log API writes files where and as libpurple would; markup, prefs,
+ * signals and the image store are simplified, and GTK is all no-ops except
+ * for the conversation widget, which is a GObject with the signals the
+ * plugin connects to.
+ */
+
+#ifndef PURPLE_STUB_H
+#define PURPLE_STUB_H
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define _(String) (String)
+#define N_(String) (String)
+#define ngettext(Singular, Plural, Number) ((Number) == 1 ? (Singular) : (Plural))
+
+/**************************************************************************/
+/* version.h, plugin.h                                                    */
+/**************************************************************************/
+
+#define PURPLE_MAJOR_VERSION 3
+#define PURPLE_MINOR_VERSION 0
+#define PURPLE_PLUGIN_MAGIC 13
+#define PURPLE_PRIORITY_DEFAULT 0
+
+typedef enum {
+	PURPLE_PLUGIN_UNKNOWN = -1,
+	PURPLE_PLUGIN_STANDARD = 0,
+	PURPLE_PLUGIN_LOADER,
+	PURPLE_PLUGIN_PROTOCOL
+} PurplePluginType;
+
+typedef void (*PurpleCallback)(void);
+#define PURPLE_CALLBACK(func) ((PurpleCallback)(func))
+
+typedef void (*PurpleSignalMarshalFunc)(PurpleCallback cb, va_list args,
+                                        void *data, void **return_val);
+
+typedef enum {
+	PURPLE_TYPE_UNKNOWN = 0,
+	PURPLE_TYPE_SUBTYPE,
+	PURPLE_TYPE_CHAR,
+	PURPLE_TYPE_UCHAR,
+	PURPLE_TYPE_BOOLEAN,
+	PURPLE_TYPE_SHORT,
+	PURPLE_TYPE_USHORT,
+	PURPLE_TYPE_INT,
+	PURPLE_TYPE_UINT,
+	PURPLE_TYPE_LONG,
+	PURPLE_TYPE_ULONG,
+	PURPLE_TYPE_INT64,
+	PURPLE_TYPE_UINT64,
+	PURPLE_TYPE_STRING,
+	PURPLE_TYPE_OBJECT,
+	PURPLE_TYPE_POINTER,
+	PURPLE_TYPE_ENUM,
+	PURPLE_TYPE_BOXED
+} PurpleType;
+
+typedef struct _PurpleValue PurpleValue;
+typedef struct _PurplePlugin PurplePlugin;
+typedef struct _PurplePluginInfo PurplePluginInfo;
+typedef struct _PurplePluginAction PurplePluginAction;
+typedef struct _PurplePluginProtocolInfo PurplePluginProtocolInfo;
+typedef struct _PurpleAccount PurpleAccount;
+typedef struct _PurpleConnection PurpleConnection;
+typedef struct _PurpleConversation PurpleConversation;
+
+struct _PurplePluginInfo {
+	unsigned int magic;
+	unsigned int major_version;
+	unsigned int minor_version;
+	PurplePluginType type;
+	char *ui_requirement;
+	unsigned long flags;
+	GList *dependencies;
+	int priority;
+
+	char *id;
+	char *name;
+	char *version;
+	char *summary;
+	char *description;
+	char *author;
+	char *homepage;
+
+	gboolean (*load)(PurplePlugin *plugin);
+	gboolean (*unload)(PurplePlugin *plugin);
+	void (*destroy)(PurplePlugin *plugin);
+
+	void *ui_info;
+	void *extra_info;
+	void *prefs_info;
+	GList *(*actions)(PurplePlugin *plugin, gpointer context);
+
+	void (*_purple_reserved1)(void);
+	void (*_purple_reserved2)(void);
+	void (*_purple_reserved3)(void);
+	void (*_purple_reserved4)(void);
+};
+
+struct _PurplePlugin {
+	gboolean loaded;
+	PurplePluginInfo *info;
+};
+
+struct _PurplePluginAction {
+	char *label;
+	void (*callback)(PurplePluginAction *action);
+	PurplePlugin *plugin;
+	gpointer context;
+	gpointer user_data;
+};
+
+/* Only list_icon, which log headers and log directories are named by. */
+struct _PurplePluginProtocolInfo {
+	const char *(*list_icon)(PurpleAccount *account, void *buddy);
+};
+
+#define PURPLE_PLUGIN_PROTOCOL_INFO(plugin) \
+	((PurplePluginProtocolInfo *)(plugin)->info->extra_info)
+
+#define PURPLE_INIT_PLUGIN(pluginname, initfunc, plugininfo) \
+	gboolean purple_init_plugin(PurplePlugin *plugin); \
+	gboolean purple_init_plugin(PurplePlugin *plugin) { \
+		plugin->info = &(plugininfo); \
+		initfunc((plugin)); \
+		return TRUE; \
+	}
+
+PurplePluginAction *purple_plugin_action_new(const char *label,
+                                             void (*callback)(PurplePluginAction *));
+gboolean purple_plugin_ipc_register(PurplePlugin *plugin, const char *command,
+                                    PurpleCallback func, PurpleSignalMarshalFunc marshal,
+                                    PurpleValue *ret_value, int num_params, ...);
+PurplePlugin *purple_find_prpl(const char *id);
+PurpleValue *purple_value_new(PurpleType type, ...);
+
+void purple_marshal_BOOLEAN__POINTER_POINTER(PurpleCallback cb, va_list args,
+                                             void *data, void **return_val);
+void purple_marshal_BOOLEAN__POINTER_POINTER_POINTER(PurpleCallback cb, va_list args,
+                                                     void *data, void **return_val);
+void purple_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER(PurpleCallback cb, va_list args,
+                                                             void *data, void **return_val);
+void purple_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_POINTER(PurpleCallback cb,
+                                                                     va_list args, void *data,
+                                                                     void **return_val);
+
+/**************************************************************************/
+/* signals.h, eventloop.h, debug.h, notify.h                              */
+/**************************************************************************/
+
+gulong purple_signal_connect(void *instance, const char *signal, void *handle,
+                             PurpleCallback func, void *data);
+void purple_signal_emit(void *instance, const char *signal, ...);
+void *purple_signal_emit_return_1(void *instance, const char *signal, ...);
+
+guint purple_timeout_add(guint interval, GSourceFunc function, gpointer data);
+guint purple_timeout_add_seconds(guint interval, GSourceFunc function, gpointer data);
+gboolean purple_timeout_remove(guint handle);
+
+void purple_debug_error(const char *category, const char *format, ...) G_GNUC_PRINTF(2, 3);
+void purple_debug_info(const char *category, const char *format, ...) G_GNUC_PRINTF(2, 3);
+void purple_debug_warning(const char *category, const char *format, ...) G_GNUC_PRINTF(2, 3);
+
+void *purple_notify_error(void *handle, const char *title, const char *primary,
+                          const char *secondary);
+void *purple_notify_info(void *handle, const char *title, const char *primary,
+                         const char *secondary);
+
+/**************************************************************************/
+/* prefs.h                                                                */
+/**************************************************************************/
+
+typedef enum {
+	PURPLE_PREF_NONE,
+	PURPLE_PREF_BOOLEAN,
+	PURPLE_PREF_INT,
+	PURPLE_PREF_STRING,
+	PURPLE_PREF_STRING_LIST,
+	PURPLE_PREF_PATH,
+	PURPLE_PREF_PATH_LIST
+} PurplePrefType;
+
+typedef void (*PurplePrefCallback)(const char *name, PurplePrefType type,
+                                   gconstpointer val, gpointer data);
+
+void purple_prefs_add_none(const char *name);
+void purple_prefs_add_bool(const char *name, gboolean value);
+void purple_prefs_add_int(const char *name, int value);
+void purple_prefs_add_string(const char *name, const char *value);
+void purple_prefs_set_bool(const char *name, gboolean value);
+void purple_prefs_set_int(const char *name, int value);
+void purple_prefs_set_string(const char *name, const char *value);
+gboolean purple_prefs_get_bool(const char *name);
+int purple_prefs_get_int(const char *name);
+const char *purple_prefs_get_string(const char *name);
+PurplePrefType purple_prefs_get_type(const char *name);
+guint purple_prefs_connect_callback(void *handle, const char *name,
+                                    PurplePrefCallback cb, gpointer data);
+
+/**************************************************************************/
+/* account.h, connection.h, conversation.h                                */
+/**************************************************************************/
+
+struct _PurpleAccount {
+	char *username;
+	char *protocol_id;
+};
+
+struct _PurpleConnection {
+	PurpleAccount *account;
+};
+
+typedef enum {
+	PURPLE_CONV_TYPE_UNKNOWN = 0,
+	PURPLE_CONV_TYPE_IM,
+	PURPLE_CONV_TYPE_CHAT,
+	PURPLE_CONV_TYPE_MISC,
+	PURPLE_CONV_TYPE_ANY
+} PurpleConversationType;
+
+typedef enum {
+	PURPLE_MESSAGE_SEND        = 0x0001,
+	PURPLE_MESSAGE_RECV        = 0x0002,
+	PURPLE_MESSAGE_SYSTEM      = 0x0004,
+	PURPLE_MESSAGE_AUTO_RESP   = 0x0008,
+	PURPLE_MESSAGE_ACTIVE_ONLY = 0x0010,
+	PURPLE_MESSAGE_NICK        = 0x0020,
+	PURPLE_MESSAGE_NO_LOG      = 0x0040,
+	PURPLE_MESSAGE_WHISPER     = 0x0080,
+	PURPLE_MESSAGE_ERROR       = 0x0200,
+	PURPLE_MESSAGE_DELAYED     = 0x0400,
+	PURPLE_MESSAGE_RAW         = 0x0800,
+	PURPLE_MESSAGE_IMAGES      = 0x1000,
+	PURPLE_MESSAGE_NOTIFY      = 0x2000,
+	PURPLE_MESSAGE_NO_LINKIFY  = 0x4000,
+	PURPLE_MESSAGE_INVISIBLE   = 0x8000
+} PurpleMessageFlags;
+
+struct _PurpleConversation {
+	PurpleConversationType type;
+	PurpleAccount *account;
+	char *name;
+	GList *logs;
+	void *ui_data;       /* the PidginConversation */
+	GHashTable *data;
+};
+
+const char *purple_account_get_username(const PurpleAccount *account);
+const char *purple_account_get_protocol_id(const PurpleAccount *account);
+GList *purple_accounts_get_all(void);
+void *purple_accounts_get_handle(void);
+
+PurpleAccount *purple_connection_get_account(const PurpleConnection *gc);
+void *purple_connections_get_handle(void);
+
+GList *purple_get_conversations(void);
+void *purple_conversations_get_handle(void);
+PurpleConversationType purple_conversation_get_type(const PurpleConversation *conv);
+PurpleAccount *purple_conversation_get_account(const PurpleConversation *conv);
+const char *purple_conversation_get_name(const PurpleConversation *conv);
+void purple_conversation_set_data(PurpleConversation *conv, const char *key, gpointer data);
+gpointer purple_conversation_get_data(PurpleConversation *conv, const char *key);
+void purple_conversation_close_logs(PurpleConversation *conv);
+
+/**************************************************************************/
+/* log.h                                                                  */
+/**************************************************************************/
+
+typedef enum {
+	PURPLE_LOG_IM,
+	PURPLE_LOG_CHAT,
+	PURPLE_LOG_SYSTEM
+} PurpleLogType;
+
+typedef enum {
+	PURPLE_LOG_READ_NO_NEWLINE = 1
+} PurpleLogReadFlags;
+
+typedef struct _PurpleLog PurpleLog;
+typedef struct _PurpleLogLogger PurpleLogLogger;
+typedef struct _PurpleLogCommonLoggerData PurpleLogCommonLoggerData;
+typedef void (*PurpleLogSetCallback)(GHashTable *sets, void *set);
+
+struct _PurpleLogLogger {
+	char *name;
+	char *id;
+
+	void (*create)(PurpleLog *log);
+	gsize (*write)(PurpleLog *log, PurpleMessageFlags type, const char *from,
+	               time_t time, const char *message);
+	void (*finalize)(PurpleLog *log);
+	GList *(*list)(PurpleLogType type, const char *name, PurpleAccount *account);
+	char *(*read)(PurpleLog *log, PurpleLogReadFlags *flags);
+	int (*size)(PurpleLog *log);
+	int (*total_size)(PurpleLogType type, const char *name, PurpleAccount *account);
+	GList *(*list_syslog)(PurpleAccount *account);
+	void (*get_log_sets)(PurpleLogSetCallback cb, GHashTable *sets);
+	gboolean (*remove)(PurpleLog *log);
+	gboolean (*is_deletable)(PurpleLog *log);
+};
+
+struct _PurpleLog {
+	PurpleLogType type;
+	char *name;
+	PurpleAccount *account;
+	PurpleConversation *conv;
+	time_t time;
+	PurpleLogLogger *logger;
+	void *logger_data;
+	struct tm *tm;
+};
+
+struct _PurpleLogCommonLoggerData {
+	char *path;
+	FILE *file;
+	void *extra;
+};
+
+PurpleLog *purple_log_new(PurpleLogType type, const char *name, PurpleAccount *account,
+                          PurpleConversation *conv, time_t time, const struct tm *tm);
+void purple_log_free(PurpleLog *log);
+void *purple_log_get_handle(void);
+char *purple_log_get_log_dir(PurpleLogType type, const char *name, PurpleAccount *account);
+
+PurpleLogLogger *purple_log_logger_new(const char *id, const char *name, int functions, ...);
+void purple_log_logger_free(PurpleLogLogger *logger);
+void purple_log_logger_add(PurpleLogLogger *logger);
+void purple_log_logger_remove(PurpleLogLogger *logger);
+PurpleLogLogger *purple_log_logger_get(void);
+
+void purple_log_common_writer(PurpleLog *log, const char *ext);
+GList *purple_log_common_lister(PurpleLogType type, const char *name, PurpleAccount *account,
+                                const char *ext, PurpleLogLogger *logger);
+int purple_log_common_total_sizer(PurpleLogType type, const char *name,
+                                  PurpleAccount *account, const char *ext);
+int purple_log_common_sizer(PurpleLog *log);
+gboolean purple_log_common_deleter(PurpleLog *log);
+gboolean purple_log_common_is_deletable(PurpleLog *log);
+
+/**************************************************************************/
+/* imgstore.h, util.h                                                     */
+/**************************************************************************/
+
+typedef struct _PurpleStoredImage PurpleStoredImage;
+
+PurpleStoredImage *purple_imgstore_find_by_id(int id);
+gconstpointer purple_imgstore_get_data(PurpleStoredImage *img);
+size_t purple_imgstore_get_size(PurpleStoredImage *img);
+
+const char *purple_user_dir(void);
+int purple_build_dir(const char *path, int mode);
+const char *purple_escape_filename(const char *str);
+const char *purple_normalize(const PurpleAccount *account, const char *str);
+const char *purple_utf8_strftime(const char *format, const struct tm *tm);
+const char *purple_date_format_full(const struct tm *tm);
+const char *purple_date_format_long(const struct tm *tm);
+const char *purple_time_format(const struct tm *tm);
+time_t purple_str_to_time(const char *timestamp, gboolean utc, struct tm *tm,
+                          long *tz_off, const char **rest);
+char *purple_str_size_to_units(goffset size);
+char *purple_util_get_image_filename(gconstpointer image_data, size_t image_len);
+
+gboolean purple_markup_find_tag(const char *needle, const char *haystack,
+                                const char **start, const char **end, GData **attributes);
+void purple_markup_html_to_xhtml(const char *html, char **dest_xhtml, char **dest_plain);
+char *purple_markup_strip_html(const char *str);
+char *purple_unescape_html(const char *html);
+gboolean purple_message_meify(char *message, gssize len);
+
+/**************************************************************************/
+/* request.h                                                              */
+/**************************************************************************/
+
+typedef struct _PurpleRequestFields PurpleRequestFields;
+typedef struct _PurpleRequestFieldGroup PurpleRequestFieldGroup;
+typedef struct _PurpleRequestField PurpleRequestField;
+
+PurpleRequestFields *purple_request_fields_new(void);
+void purple_request_fields_add_group(PurpleRequestFields *fields, PurpleRequestFieldGroup *group);
+const char *purple_request_fields_get_string(const PurpleRequestFields *fields, const char *id);
+PurpleRequestFieldGroup *purple_request_field_group_new(const char *title);
+void purple_request_field_group_add_field(PurpleRequestFieldGroup *group,
+                                          PurpleRequestField *field);
+PurpleRequestField *purple_request_field_string_new(const char *id, const char *text,
+                                                    const char *default_value,
+                                                    gboolean multiline);
+void *purple_request_fields(void *handle, const char *title, const char *primary,
+                            const char *secondary, PurpleRequestFields *fields,
+                            const char *ok_text, GCallback ok_cb,
+                            const char *cancel_text, GCallback cancel_cb,
+                            PurpleAccount *account, const char *who,
+                            PurpleConversation *conv, void *user_data);
+
+/**************************************************************************/
+/* GTK, gtkconv.h, gtkplugin.h, gtkprefs.h, gtkutils.h                    */
+/**************************************************************************/
+
+typedef struct _GtkWidget GtkWidget;
+typedef GtkWidget GtkBox;
+typedef GtkWidget GtkContainer;
+typedef GtkWidget GtkRadioButton;
+typedef GtkWidget GtkToggleButton;
+typedef struct _GtkSizeGroup GtkSizeGroup;
+
+/* Emits "style-updated" and "toggled", which the plugin connects to. */
+struct _GtkWidget {
+	GObject parent;
+	gboolean active;
+};
+
+GType gtk_widget_get_type(void);
+#define GTK_TYPE_WIDGET (gtk_widget_get_type())
+
+#define GTK_BOX(obj) ((GtkBox *)(obj))
+#define GTK_CONTAINER(obj) ((GtkContainer *)(obj))
+#define GTK_RADIO_BUTTON(obj) ((GtkRadioButton *)(obj))
+#define GTK_TOGGLE_BUTTON(obj) ((GtkToggleButton *)(obj))
+
+typedef enum {
+	GTK_ORIENTATION_HORIZONTAL,
+	GTK_ORIENTATION_VERTICAL
+} GtkOrientation;
+
+typedef enum {
+	GTK_STATE_NORMAL,
+	GTK_STATE_ACTIVE,
+	GTK_STATE_PRELIGHT,
+	GTK_STATE_SELECTED,
+	GTK_STATE_INSENSITIVE
+} GtkStateType;
+
+typedef struct {
+	guint32 pixel;
+	guint16 red;
+	guint16 green;
+	guint16 blue;
+} GdkColor;
+
+typedef struct {
+	GdkColor base[5];
+	GdkColor white;
+} GtkStyle;
+
+GtkWidget *gtk_box_new(GtkOrientation orientation, gint spacing);
+void gtk_box_pack_start(GtkBox *box, GtkWidget *child, gboolean expand, gboolean fill,
+                        guint padding);
+void gtk_container_add(GtkContainer *container, GtkWidget *widget);
+void gtk_container_set_border_width(GtkContainer *container, guint border_width);
+GtkWidget *gtk_check_button_new_with_mnemonic(const gchar *label);
+GtkWidget *gtk_radio_button_new_with_mnemonic(GSList *group, const gchar *label);
+GtkWidget *gtk_radio_button_new_with_mnemonic_from_widget(GtkRadioButton *radio_group_member,
+                                                          const gchar *label);
+gboolean gtk_toggle_button_get_active(GtkToggleButton *toggle_button);
+void gtk_toggle_button_set_active(GtkToggleButton *toggle_button, gboolean is_active);
+GtkStyle *gtk_widget_get_style(GtkWidget *widget);
+void gtk_widget_show_all(GtkWidget *widget);
+
+#define PIDGIN_PLUGIN_TYPE "gtk-gaim"
+
+typedef struct {
+	GtkWidget *(*get_config_frame)(PurplePlugin *plugin);
+	int page_num;
+
+	void (*_pidgin_reserved1)(void);
+	void (*_pidgin_reserved2)(void);
+	void (*_pidgin_reserved3)(void);
+	void (*_pidgin_reserved4)(void);
+} PidginPluginUiInfo;
+
+typedef struct {
+	PurpleConversation *active_conv;
+	GtkWidget *webview;
+	GArray *nick_colors;  /* GdkColor */
+} PidginConversation;
+
+#define PIDGIN_CONVERSATION(conv) ((PidginConversation *)(conv)->ui_data)
+#define PIDGIN_IS_PIDGIN_CONVERSATION(conv) ((conv) != NULL && (conv)->ui_data != NULL)
+
+GtkWidget *pidgin_make_frame(GtkWidget *parent, const char *title);
+GtkWidget *pidgin_prefs_checkbox(const char *title, const char *key, GtkWidget *page);
+GtkWidget *pidgin_prefs_labeled_spin_button(GtkWidget *page, const gchar *title,
+                                            const char *key, int min, int max,
+                                            GtkSizeGroup *sg);
+
+/**************************************************************************/
+/* Set up by the benchmark rather than by libpurple                       */
+/**************************************************************************/
+
+void purple_stub_set_user_dir(const char *dir);
+void purple_stub_set_debug(gboolean enabled);
+PurpleAccount *purple_stub_account_new(const char *username, const char *protocol_id);
+PurpleConversation *purple_stub_conversation_new(PurpleConversationType type,
+                                                 PurpleAccount *account, const char *name,
+                                                 guint palette_len);
+void purple_stub_conversation_destroy(PurpleConversation *conv);
+int purple_stub_imgstore_add(gconstpointer data, size_t size);
+
+#endif /* PURPLE_STUB_H */
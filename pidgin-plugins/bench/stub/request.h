@@ -0,0 +1,2 @@
+/* See purple-stub.h. */
+#include "purple-stub.h"
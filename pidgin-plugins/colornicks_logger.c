@@ -20,334 +20,7820 @@
 
 #include "internal.h"
 #include "debug.h"
+#include "notify.h"
+#include "request.h"
 #include "gtkplugin.h"
 #include "version.h"
 #include "gtkconv.h"
+#include "gtkprefs.h"
+#include "gtkutils.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef COLORNICKS_SQLITE
+#include <sqlite3.h>
+#endif
 
 #define LUMINANCE(c) (float)((0.3*(c.red))+(0.59*(c.green))+(0.11*(c.blue)))
 
-static gsize colornicks_logger_write(PurpleLog *log, PurpleMessageFlags type,
-							  const char *from, time_t time, const char *message);
-static void colornicks_logger_finalize(PurpleLog *log);
-static GList *colornicks_logger_list(PurpleLogType type, const char *sn, PurpleAccount *account);
-static GList *colornicks_logger_list_syslog(PurpleAccount *account);
-static char *colornicks_logger_read(PurpleLog *log, PurpleLogReadFlags *flags);
-static int colornicks_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account);
+static gsize colornicks_logger_write(PurpleLog *log, PurpleMessageFlags type,
+							  const char *from, time_t time, const char *message);
+static gsize log_write_line(PurpleLog *log, PurpleMessageFlags type,
+                            const char *from, time_t time, const char *message,
+                            gboolean rollover);
+static void colornicks_logger_finalize(PurpleLog *log);
+static GList *colornicks_logger_list(PurpleLogType type, const char *sn, PurpleAccount *account);
+static GList *colornicks_logger_list_syslog(PurpleAccount *account);
+static char *colornicks_logger_read(PurpleLog *log, PurpleLogReadFlags *flags);
+static int colornicks_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account);
+static GList *colornicks_gz_logger_list(PurpleLogType type, const char *sn, PurpleAccount *account);
+static GList *colornicks_gz_logger_list_syslog(PurpleAccount *account);
+static int colornicks_gz_logger_size(PurpleLog *log);
+static int colornicks_gz_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account);
+static gboolean log_get_contents(const char *path, char **contents, gsize *len);
+static GArray *log_index_rebuild(const char *path);
+static void retention_log_opened(const char *path);
+static void retention_log_closed(const char *path);
+static void frame_timer_arm(void);
+struct _ColorNicksLogSummary;
+static void log_summary_save(const char *path, const struct _ColorNicksLogSummary *summary);
+static void log_summary_free(struct _ColorNicksLogSummary *summary);
+#ifdef COLORNICKS_SQLITE
+static void db_commit(void);
+#endif
+
+static PurpleLogLogger *colornicks_logger;
+static PurpleLogLogger *colornicks_gz_logger;
+static PurpleLogLogger *colornicks_bin_logger;
+
+enum {
+	COMMIT_EVERY_MESSAGE,
+	COMMIT_TIME_WINDOW,
+	COMMIT_SIZE_THRESHOLD,
+};
+
+/* Sidecar index.
+ * Next to every log.htm we keep log.htm.idx with one fixed-size record per
+ * message, so readers can binary-search by time or pick out a sender's
+ * messages and slice exact byte ranges without parsing the HTML. All fields
+ * are stored little-endian. nick_id is g_str_hash() of the escaped nick (the
+ * same hash that picks its color), or 0 for lines without a sender. */
+typedef struct {
+	guint64 offset;   /* of the line in the log */
+	gint64 time;
+	guint32 flags;    /* PurpleMessageFlags */
+	guint32 nick_id;
+} LogIndexRecord;
+
+#define INDEX_SUFFIX ".idx"
+
+#define LOG_FOOTER "</body></html>\n"
+
+/* Compressed logs.
+ * The "colornicks-gz" logger writes the same HTML as a series of gzip
+ * members ("frames") of up to FRAME_SIZE bytes of log each. Every frame
+ * decompresses on its own and the file as a whole is still an ordinary gzip
+ * stream, so zcat can read it. A sidecar records where each frame ends, in
+ * the file and in the uncompressed log, so part of a log can be read by
+ * decompressing only the frames that hold it. Offsets in the message and
+ * search indexes are into the uncompressed log. */
+#define COMPRESSED_EXT ".htm.gz"
+#define FRAMES_SUFFIX ".frames"
+#define FRAME_SIZE (64 * 1024)
+#define FRAME_MAX_AGE 60  /* seconds a partial frame may wait for more lines */
+#define FRAME_RETRY_MAX (16 * FRAME_SIZE)  /* lines kept for a frame that failed to write */
+
+/* Stored little-endian, one per frame. */
+typedef struct {
+	guint64 end;          /* in the file */
+	guint64 logical_end;  /* in the uncompressed log */
+} FrameRecord;
+
+/* Binary logs.
+ * The "colornicks-bin" logger writes a log as a stream of records instead of
+ * HTML, and only renders the colored lines when the log is read. After an
+ * 8-byte magic, every record is a BinaryRecord followed by its payload, all
+ * little-endian: either a message (time, PurpleMessageFlags and whether its
+ * timestamp shows the date, nick id and the XHTML body, "/me " and all) or a
+ * nick, which gives a nick id its escaped name and the color it was first
+ * logged in. Nick ids are numbered from 1 in each log, and a nick's record always comes before its first message, so a
+ * log can be streamed in one pass. Index offsets point at message records. */
+#define BINARY_EXT ".cnl"
+#define BINARY_MAGIC "CNLOG\0\0\1"
+#define BINARY_MAGIC_LEN 8
+
+enum {
+	BINARY_MESSAGE = 1,
+	BINARY_NICK = 2
+};
+
+typedef struct {
+	guint32 length;   /* of the payload */
+	guint32 kind;
+} BinaryRecord;
+
+typedef struct {
+	gint64 time;
+	guint32 flags;    /* PurpleMessageFlags, and LOG_FLAG_SHOW_DATE */
+	guint32 nick;     /* 0 for none */
+} BinaryMessage;      /* followed by the body */
+
+/* Logs that render their lines when they are read keep this in the flags of
+ * a message whose timestamp showed the date when it was written, since that
+ * depends on the time of writing; see log_show_date(). */
+#define LOG_FLAG_SHOW_DATE 0x80000000u
+
+typedef struct {
+	guint32 id;
+	char color[8];    /* "#rrggbb", or empty */
+} BinaryNick;         /* followed by the name */
+
+/* Size ledger.
+ * The total size of a conversation's logs is kept per log directory and
+ * bumped by every byte we write, so colornicks_logger_total_size() does not
+ * have to stat every log. An entry is only trusted while the directory's
+ * mtime is the one recorded with it; anything else that adds or removes
+ * logs changes that, and the next query rescans. */
+typedef struct {
+	gint64 size;
+	gint64 mtime;  /* of the directory when size was last known to be right */
+} SizeLedgerEntry;
+
+/* See "Instrumentation" below. */
+typedef struct _LoggerStats LoggerStats;
+
+/* The timestamp a log rendered last; see log_get_timestamp(). */
+typedef struct {
+	GString *str;
+	gint64 time;
+	gboolean show_date;
+} TimestampCache;
+
+/* Hung off PurpleLogCommonLoggerData->extra for every log we write to. */
+typedef struct {
+	PurpleAccount *account;
+	gboolean binary;     /* a colornicks-bin log */
+
+	/* Main loop only */
+	GString *line;       /* scratch buffers reused for every line */
+	GString *nick;
+	TimestampCache stamp;
+	guint64 offset;      /* bytes handed to the log so far */
+	SizeLedgerEntry *ledger;
+	guint messages;      /* what goes into the summary, see log_summary_save() */
+	gint64 first_time;
+	gint64 last_time;
+	GHashTable *speakers;         /* nick -> color, or "" */
+	gboolean summary_partial;     /* appending to a log we have no summary of */
+	GHashTable *nick_ids;         /* binary logs: escaped nick -> BinaryNick */
+	struct _SearchIndex *search;  /* NULL if the log is not being indexed */
+	guint32 search_file;
+	LoggerStats *stats;           /* NULL if built without them */
+	gsize unreported;             /* written outside a write call, for the next to return */
+
+	/* Only the thread that owns the log files touches these */
+	FILE *index;
+	GList *dirty_link;   /* link in dirty_logs, or NULL if fully flushed */
+	GList *open_link;    /* link in open_logs, or NULL if not in the pool yet */
+	gboolean evicted;    /* files closed by the pool until the next write */
+	gsize pending;       /* bytes written since the last flush */
+	gint64 last_sync;    /* monotonic time of the last fdatasync */
+	GString *frame;      /* compressed logs: lines not yet in a frame */
+	GByteArray *frame_records;  /* and their index records */
+	gboolean frames_failed;     /* frames could not be written; lines are dropped */
+	GConverter *compressor;
+	FILE *frames;
+	FrameRecord frame_end;      /* end of the last frame, in host order */
+	struct _ColorNicksLogSummary *summary;  /* from finalize, saved once the log is closed */
+} ColorNicksLogData;
+
+/* Commit policy.
+ * Instead of flushing after every message, lines can be left in the stdio
+ * buffers and committed in batches: all dirty logs at once from a single
+ * timer, or a log at a time once enough bytes have piled up. fdatasync is
+ * optional and rate-limited separately. The settings are read by the writer
+ * thread, so they are only touched with g_atomic_int_*. */
+static gint commit_policy = COMMIT_EVERY_MESSAGE;
+static gint commit_interval = 1000;  /* ms, for COMMIT_TIME_WINDOW */
+static gint commit_size = 64;        /* KiB, for COMMIT_SIZE_THRESHOLD */
+static gint sync_interval = 0;       /* seconds between fdatasyncs, 0 for never */
+static guint commit_timer = 0;
+static gboolean frames_pending = FALSE;  /* compressed lines since the last timed commit */
+static GQueue dirty_logs = G_QUEUE_INIT;
+
+/* Logs are split into segments of at most this size or age; see
+ * log_segment_end(). */
+static gint segment_size = 16;   /* MiB, 0 for no limit */
+static gint segment_age = 24;    /* hours, 0 for no limit */
+
+/* purple_debug is not safe to call off the main loop, so code that may run
+ * on a background thread queues its messages and the main loop prints them. */
+static GMutex thread_errors_lock;
+static GQueue thread_errors = G_QUEUE_INIT;
+static guint thread_errors_source = 0;
+
+static gboolean
+thread_errors_flush(gpointer unused)
+{
+	char *msg;
+
+	g_mutex_lock(&thread_errors_lock);
+	while ((msg = g_queue_pop_head(&thread_errors)) != NULL) {
+		purple_debug_error("log", "%s", msg);
+		g_free(msg);
+	}
+	thread_errors_source = 0;
+	g_mutex_unlock(&thread_errors_lock);
+
+	return FALSE;
+}
+
+static void
+thread_debug_error(const char *format, ...)
+{
+	va_list args;
+	char *msg;
+
+	va_start(args, format);
+	msg = g_strdup_vprintf(format, args);
+	va_end(args);
+
+	g_mutex_lock(&thread_errors_lock);
+	g_queue_push_tail(&thread_errors, msg);
+	if (thread_errors_source == 0)
+		thread_errors_source = g_idle_add(thread_errors_flush, NULL);
+	g_mutex_unlock(&thread_errors_lock);
+}
+
+/* Prints whatever is still queued. Call once all background threads are gone. */
+static void
+thread_errors_shutdown(void)
+{
+	if (thread_errors_source) {
+		g_source_remove(thread_errors_source);
+		thread_errors_source = 0;
+	}
+	thread_errors_flush(NULL);
+}
+
+/* Instrumentation.
+ * Each stage of logging a line is timed on the monotonic clock and added to
+ * a latency histogram, and the messages, bytes and images logged are
+ * counted, all per account. "Show Logging Statistics" prints them to the
+ * debug log, and every stats_interval minutes they are written out to
+ * colornicks-stats.txt as well. A stage is only ever timed by one thread,
+ * the main loop or whichever owns the log files, so none of this takes a
+ * lock; a dump may catch a count mid-update, which is fine for statistics.
+ * Build with -DCOLORNICKS_NO_STATS to leave all of it out. */
+#ifndef COLORNICKS_NO_STATS
+
+#define STATS_FILE "colornicks-stats.txt"
+
+typedef enum {
+	STAGE_NICK_COLOR,
+	STAGE_IMAGES,
+	STAGE_XHTML,
+	STAGE_TIMESTAMP,
+	STAGE_FORMAT,
+	STAGE_WRITE,
+	STAGE_FLUSH,
+	STAGE_COUNT
+} LoggerStage;
+
+static const char * const stage_names[STAGE_COUNT] = {
+	"nick color",
+	"image tags",
+	"xhtml",
+	"timestamp",
+	"format",
+	"write",
+	"flush"
+};
+
+/* Bucket 0 counts times under 1 us, bucket i those under 2^i us; the last
+ * one also takes everything slower. */
+#define STATS_BUCKETS 24
+
+typedef struct {
+	guint64 count;
+	guint64 total;  /* ns */
+	guint64 max;    /* ns */
+	guint64 buckets[STATS_BUCKETS];
+} StageStats;
+
+struct _LoggerStats {
+	char *name;     /* of the account */
+	guint64 messages;
+	guint64 bytes;
+	guint64 images;
+	StageStats stages[STAGE_COUNT];
+};
+
+static GHashTable *logger_stats = NULL;  /* PurpleAccount -> LoggerStats */
+static gint stats_interval = 0;          /* minutes between stats files, 0 for never */
+static guint stats_timer = 0;
+
+#define STATS_DECLARE(var) gint64 var;
+#define STATS_START(var) ((var) = stats_now())
+#define STATS_STOP(stats, stage, var) stats_record((stats), (stage), (var))
+#define STATS_ADD(stats, counter, n) \
+	G_STMT_START { if (stats) (stats)->counter += (n); } G_STMT_END
+
+/* In nanoseconds. */
+static gint64
+stats_now(void)
+{
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return g_get_monotonic_time() * 1000;
+#endif
+}
+
+static void
+stats_record(LoggerStats *stats, LoggerStage stage, gint64 start)
+{
+	StageStats *s;
+	gint64 elapsed;
+	guint64 ns, us;
+
+	if (stats == NULL)
+		return;
+
+	elapsed = stats_now() - start;
+	ns = MAX(elapsed, 0);
+	us = ns / 1000;
+	s = &stats->stages[stage];
+	s->count++;
+	s->total += ns;
+	if (ns > s->max)
+		s->max = ns;
+	s->buckets[us == 0 ? 0 : MIN(g_bit_storage(us), STATS_BUCKETS - 1)]++;
+}
+
+static void
+stats_free(gpointer data)
+{
+	LoggerStats *stats = data;
+
+	g_free(stats->name);
+	g_free(stats);
+}
+
+/* Main loop only. The stats outlive the logs that point at them. */
+static LoggerStats *
+stats_get(PurpleAccount *account)
+{
+	LoggerStats *stats;
+
+	if (logger_stats == NULL)
+		logger_stats = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, stats_free);
+
+	if ((stats = g_hash_table_lookup(logger_stats, account)) == NULL) {
+		stats = g_new0(LoggerStats, 1);
+		stats->name = g_strdup_printf("%s (%s)", purple_account_get_username(account),
+		                              purple_account_get_protocol_id(account));
+		g_hash_table_insert(logger_stats, account, stats);
+	}
+
+	return stats;
+}
+
+/* Returns the time, in microseconds, that fraction of the calls took less
+ * than, as closely as the histogram can tell. */
+static double
+stats_percentile(const StageStats *s, double fraction)
+{
+	guint64 seen = 0;
+	guint i;
+
+	for (i = 0; i < STATS_BUCKETS - 1; i++) {
+		seen += s->buckets[i];
+		if (seen >= fraction * s->count)
+			return MIN((double)(1 << i), s->max / 1000.0);
+	}
+	return s->max / 1000.0;
+}
+
+static void
+stats_format(GString *out)
+{
+	GHashTableIter iter;
+	LoggerStats *stats;
+	guint i;
+
+	if (logger_stats == NULL)
+		return;
+
+	g_hash_table_iter_init(&iter, logger_stats);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stats)) {
+		g_string_append_printf(out, "%s: %" G_GUINT64_FORMAT " messages, %" G_GUINT64_FORMAT
+		                       " bytes, %" G_GUINT64_FORMAT " images\n",
+		                       stats->name, stats->messages, stats->bytes, stats->images);
+
+		for (i = 0; i < STAGE_COUNT; i++) {
+			const StageStats *s = &stats->stages[i];
+
+			if (s->count == 0)
+				continue;
+			g_string_append_printf(out, "  %-10s %10" G_GUINT64_FORMAT " calls, mean %.1f us, "
+			                       "p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			                       stage_names[i], s->count, s->total / 1000.0 / s->count,
+			                       stats_percentile(s, 0.5), stats_percentile(s, 0.99),
+			                       s->max / 1000.0);
+		}
+	}
+}
+
+static gboolean
+stats_timeout_cb(gpointer unused)
+{
+	char *path = g_build_filename(purple_user_dir(), STATS_FILE, NULL);
+	GString *out = g_string_new(NULL);
+
+	stats_format(out);
+	if (!g_file_set_contents(path, out->str, out->len, NULL))
+		purple_debug_error("colornicks", "Unable to write %s\n", path);
+
+	g_string_free(out, TRUE);
+	g_free(path);
+	return TRUE;
+}
+
+static void
+stats_prefs_cb(const char *name, PurplePrefType type, gconstpointer val, gpointer data)
+{
+	stats_interval = purple_prefs_get_int("/plugins/gtk/colornicks_logger/stats_interval");
+
+	if (stats_timer) {
+		purple_timeout_remove(stats_timer);
+		stats_timer = 0;
+	}
+	if (stats_interval > 0)
+		stats_timer = purple_timeout_add_seconds(stats_interval * 60, stats_timeout_cb, NULL);
+}
+
+static void
+stats_action_cb(PurplePluginAction *action)
+{
+	GString *out = g_string_new(NULL);
+
+	stats_format(out);
+	purple_debug_info("colornicks", "Logging statistics:\n%s",
+	                  out->len > 0 ? out->str : "Nothing logged yet\n");
+	g_string_free(out, TRUE);
+}
+
+/* Call once the writer thread is gone. */
+static void
+stats_shutdown(void)
+{
+	if (stats_timer) {
+		purple_timeout_remove(stats_timer);
+		stats_timer = 0;
+	}
+	if (logger_stats) {
+		g_hash_table_destroy(logger_stats);
+		logger_stats = NULL;
+	}
+}
+
+#else
+
+#define STATS_DECLARE(var)
+#define STATS_START(var) ((void)0)
+#define STATS_STOP(stats, stage, var) ((void)0)
+#define STATS_ADD(stats, counter, n) ((void)(n))
+
+#endif /* COLORNICKS_NO_STATS */
+
+/* Background writer.
+ * When async_write is enabled, the main loop only formats log lines and
+ * hands them to a bounded queue. A single writer thread owns all the file
+ * I/O for colornicks logs from then on: writes, flushes and closes happen
+ * there, in the order they were queued. When the queue is full, the main
+ * loop blocks until the writer catches up, so no lines are ever dropped.
+ * Each slot of the queue has a buffer of its own that lines are copied
+ * into, so queueing a line allocates nothing; only lines too long for it
+ * get a copy on the heap. A slot is freed once its job is done. */
+
+#define WRITER_QUEUE_SIZE 1024
+#define WRITER_SLOT_SIZE 512
+
+typedef enum {
+	WRITER_JOB_WRITE,
+	WRITER_JOB_FLUSH,
+	WRITER_JOB_CLOSE,
+	WRITER_JOB_QUIT
+} WriterJobType;
+
+typedef struct {
+	WriterJobType type;
+	PurpleLogCommonLoggerData *data;
+	PurpleAccount *account;
+	char *buf;            /* the slot's buffer, or heap */
+	char *heap;           /* a line too long for the slot, or NULL */
+	gsize len;
+	gboolean has_record;
+	LogIndexRecord record;
+} WriterJob;
+
+static gboolean async_write = FALSE;
+static GThread *writer_thread = NULL;
+static GMutex writer_lock;
+static GCond writer_not_empty;
+static GCond writer_not_full;
+static WriterJob writer_queue[WRITER_QUEUE_SIZE];
+static char *writer_slots = NULL;   /* WRITER_SLOT_SIZE bytes per job */
+static guint writer_head = 0;
+static guint writer_count = 0;
+
+/* These run on whichever thread owns the log files: the main loop when
+ * writing synchronously, or the writer thread otherwise. */
+static void
+log_file_sync(PurpleLogCommonLoggerData *data, gboolean force)
+{
+	ColorNicksLogData *extra = data->extra;
+	gint interval = g_atomic_int_get(&sync_interval);
+	gint64 now;
+
+	if (interval <= 0)
+		return;
+
+	now = g_get_monotonic_time();
+	if (!force && now - extra->last_sync < (gint64)interval * G_USEC_PER_SEC)
+		return;
+
+#ifndef _WIN32
+	if (fdatasync(fileno(data->file)) != 0)
+		thread_debug_error("Error syncing %s: %s\n",
+		                   data->path, g_strerror(errno));
+#endif
+	extra->last_sync = now;
+}
+
+/* Compresses the pending lines of a compressed log into a frame of its own. */
+static void
+log_frame_cut(PurpleLogCommonLoggerData *data)
+{
+	ColorNicksLogData *extra = data->extra;
+	GString *frame = extra->frame;
+	char out[16 * 1024];
+	gsize in = 0, read, written;
+	guint64 frame_len = 0;
+	GConverterResult result;
+	GError *error = NULL;
+	gboolean ok = TRUE;
+	FrameRecord record;
+
+	if (frame->len == 0)
+		return;
+
+	do {
+		result = g_converter_convert(extra->compressor, frame->str + in, frame->len - in,
+		                             out, sizeof(out), G_CONVERTER_INPUT_AT_END,
+		                             &read, &written, &error);
+		if (result == G_CONVERTER_ERROR) {
+			thread_debug_error("Error compressing %s: %s\n", data->path, error->message);
+			g_error_free(error);
+			ok = FALSE;
+			break;
+		}
+		in += read;
+		if (fwrite(out, 1, written, data->file) != written) {
+			thread_debug_error("Error writing %s: %s\n", data->path, g_strerror(errno));
+			ok = FALSE;
+			break;
+		}
+		frame_len += written;
+	} while (result != G_CONVERTER_FINISHED);
+	g_converter_reset(extra->compressor);
+
+	if (!ok) {
+		/* A gzip member cut short would break every later read of the log,
+		 * so it comes back off. The lines stay for the next commit to try
+		 * again, as the offsets of later lines count them; once too many
+		 * pile up, they and the rest of the log are dropped instead. */
+		fflush(data->file);
+		clearerr(data->file);
+#ifndef _WIN32
+		if (ftruncate(fileno(data->file), extra->frame_end.end) != 0)
+			thread_debug_error("Error truncating %s: %s\n", data->path, g_strerror(errno));
+#endif
+		if (frame->len > FRAME_RETRY_MAX) {
+			thread_debug_error("Dropping the rest of %s\n", data->path);
+			g_string_truncate(frame, 0);
+			g_byte_array_set_size(extra->frame_records, 0);
+			extra->frames_failed = TRUE;
+		}
+		return;
+	}
+
+	extra->frame_end.end += frame_len;
+	extra->frame_end.logical_end += frame->len;
+	g_string_truncate(frame, 0);
+
+	record.end = GUINT64_TO_LE(extra->frame_end.end);
+	record.logical_end = GUINT64_TO_LE(extra->frame_end.logical_end);
+	if (extra->frames && fwrite(&record, sizeof(record), 1, extra->frames) != 1)
+		thread_debug_error("Error writing frames for %s: %s\n",
+		                   data->path, g_strerror(errno));
+
+	/* Index records wait for their lines, so the index never points past
+	 * the last frame. */
+	if (extra->index && extra->frame_records->len > 0 &&
+	    fwrite(extra->frame_records->data, extra->frame_records->len, 1, extra->index) != 1)
+		thread_debug_error("Error writing index for %s: %s\n",
+		                   data->path, g_strerror(errno));
+	g_byte_array_set_size(extra->frame_records, 0);
+}
+
+static void
+log_file_commit(PurpleLogCommonLoggerData *data)
+{
+	ColorNicksLogData *extra = data->extra;
+	STATS_DECLARE(start)
+
+	if (data->file == NULL || extra->dirty_link == NULL)
+		return;
+
+	STATS_START(start);
+	if (extra->frame)
+		log_frame_cut(data);
+
+	/* The log goes first so the index never points past its end. */
+	fflush(data->file);
+	if (extra->frames)
+		fflush(extra->frames);
+	if (extra->index)
+		fflush(extra->index);
+	log_file_sync(data, FALSE);
+	STATS_STOP(extra->stats, STAGE_FLUSH, start);
+
+	g_queue_delete_link(&dirty_logs, extra->dirty_link);
+	extra->dirty_link = NULL;
+	extra->pending = 0;
+}
+
+/* Commits every dirty log, or only those of account if it is not NULL. */
+static void
+log_file_commit_all(PurpleAccount *account)
+{
+	GList *l = dirty_logs.head;
+
+	while (l) {
+		PurpleLogCommonLoggerData *data = l->data;
+		ColorNicksLogData *extra = data->extra;
+		l = l->next;
+
+		if (account == NULL || extra->account == account)
+			log_file_commit(data);
+	}
+}
+
+/* File pool.
+ * An open log holds two or three files and their stdio buffers, which adds
+ * up with thousands of rooms open. Only the max_open_logs most recently
+ * written logs keep their files open. The least recently written one is
+ * committed and closed when another needs room, and opened again for
+ * appending on its next write, or to add the footer when it is finalized.
+ * Like dirty_logs, the pool belongs to whichever thread owns the files. */
+static gint max_open_logs = 256;
+static GQueue open_logs = G_QUEUE_INIT;
+static volatile gint pool_open = 0;    /* logs with their files open */
+static volatile gint pool_hits = 0;    /* writes to a log that was open */
+static volatile gint pool_misses = 0;  /* writes that had to reopen it */
+
+static void
+log_file_evict(PurpleLogCommonLoggerData *data)
+{
+	ColorNicksLogData *extra = data->extra;
+
+	log_file_commit(data);
+
+	fclose(data->file);
+	data->file = NULL;
+	if (extra->index) {
+		fclose(extra->index);
+		extra->index = NULL;
+	}
+	if (extra->frames) {
+		fclose(extra->frames);
+		extra->frames = NULL;
+	}
+	extra->evicted = TRUE;
+
+	g_queue_delete_link(&open_logs, extra->open_link);
+	extra->open_link = NULL;
+	g_atomic_int_add(&pool_open, -1);
+}
+
+/* Opens the files of an evicted log again. */
+static gboolean
+log_file_reopen(PurpleLogCommonLoggerData *data)
+{
+	ColorNicksLogData *extra = data->extra;
+	char *path;
+
+	if ((data->file = g_fopen(data->path, "a")) == NULL) {
+		thread_debug_error("Unable to reopen %s: %s\n", data->path, g_strerror(errno));
+		return FALSE;
+	}
+
+	path = g_strconcat(data->path, INDEX_SUFFIX, NULL);
+	extra->index = g_fopen(path, "ab");
+	g_free(path);
+
+	if (extra->frame) {
+		path = g_strconcat(data->path, FRAMES_SUFFIX, NULL);
+		extra->frames = g_fopen(path, "ab");
+		g_free(path);
+	}
+
+	extra->evicted = FALSE;
+	return TRUE;
+}
+
+/* Makes sure the files of a log are open and marks it most recently used,
+ * closing the least recently used logs beyond max_open_logs. */
+static gboolean
+log_file_touch(PurpleLogCommonLoggerData *data)
+{
+	ColorNicksLogData *extra = data->extra;
+	gint max = MAX(g_atomic_int_get(&max_open_logs), 1);
+
+	if (extra->evicted) {
+		if (!log_file_reopen(data))
+			return FALSE;
+		g_atomic_int_inc(&pool_misses);
+	} else
+		g_atomic_int_inc(&pool_hits);
+
+	if (extra->open_link) {
+		g_queue_unlink(&open_logs, extra->open_link);
+		g_queue_push_head_link(&open_logs, extra->open_link);
+	} else {
+		g_queue_push_head(&open_logs, data);
+		extra->open_link = open_logs.head;
+		g_atomic_int_inc(&pool_open);
+	}
+
+	while (g_queue_get_length(&open_logs) > (guint)max)
+		log_file_evict(g_queue_peek_tail(&open_logs));
+
+	return TRUE;
+}
+
+static void
+log_file_write(PurpleLogCommonLoggerData *data, const char *buf, gsize len,
+               const LogIndexRecord *record)
+{
+	ColorNicksLogData *extra = data->extra;
+	gint policy;
+	STATS_DECLARE(start)
+
+	if (data->file == NULL && !extra->evicted)
+		return;
+	if (!log_file_touch(data) || extra->frames_failed)
+		return;
+
+	STATS_START(start);
+	if (extra->frame) {
+		g_string_append_len(extra->frame, buf, len);
+		if (record)
+			g_byte_array_append(extra->frame_records, (const guint8 *)record, sizeof(*record));
+	} else if (fwrite(buf, 1, len, data->file) != len)
+		thread_debug_error("Error writing %s: %s\n",
+		                   data->path, g_strerror(errno));
+	else if (record && extra->index && fwrite(record, sizeof(*record), 1, extra->index) != 1)
+		thread_debug_error("Error writing index for %s: %s\n",
+		                   data->path, g_strerror(errno));
+	STATS_STOP(extra->stats, STAGE_WRITE, start);
+
+	extra->pending += len;
+	if (extra->dirty_link == NULL) {
+		g_queue_push_tail(&dirty_logs, data);
+		extra->dirty_link = dirty_logs.tail;
+	}
+
+	/* Compressed logs get a frame per message when every message is
+	 * committed, which compresses poorly. Otherwise they are committed when
+	 * a frame fills up and the commit timer takes care of the rest. */
+	policy = g_atomic_int_get(&commit_policy);
+	if (policy == COMMIT_EVERY_MESSAGE ||
+	    (policy == COMMIT_SIZE_THRESHOLD &&
+	     extra->pending >= (gsize)g_atomic_int_get(&commit_size) * 1024) ||
+	    (extra->frame && extra->frame->len >= FRAME_SIZE))
+		log_file_commit(data);
+}
+
+static void
+log_file_close(PurpleLogCommonLoggerData *data)
+{
+	ColorNicksLogData *extra = data->extra;
+
+	/* Evicted logs still get their footer. */
+	if (extra && extra->evicted)
+		log_file_reopen(data);
+
+	if (data->file) {
+		if (extra && extra->frame) {
+			g_string_append(extra->frame, LOG_FOOTER);
+			log_frame_cut(data);
+		} else if (extra == NULL || !extra->binary)
+			fputs(LOG_FOOTER, data->file);
+		fflush(data->file);
+		if (extra)
+			log_file_sync(data, TRUE);
+		fclose(data->file);
+	}
+
+	/* Only now does the summary describe what is on disk. */
+	if (extra && extra->summary) {
+		log_summary_save(data->path, extra->summary);
+		log_summary_free(extra->summary);
+	}
+
+	if (extra && extra->index)
+		fclose(extra->index);
+
+	if (extra && extra->frame) {
+		if (extra->frames)
+			fclose(extra->frames);
+		g_object_unref(extra->compressor);
+		g_byte_array_free(extra->frame_records, TRUE);
+		g_string_free(extra->frame, TRUE);
+	}
+
+	if (extra) {
+		if (extra->dirty_link)
+			g_queue_delete_link(&dirty_logs, extra->dirty_link);
+		if (extra->open_link) {
+			g_queue_delete_link(&open_logs, extra->open_link);
+			g_atomic_int_add(&pool_open, -1);
+		}
+		g_string_free(extra->line, TRUE);
+		g_string_free(extra->nick, TRUE);
+		g_string_free(extra->stamp.str, TRUE);
+		if (extra->nick_ids)
+			g_hash_table_destroy(extra->nick_ids);
+		g_slice_free(ColorNicksLogData, extra);
+		retention_log_closed(data->path);
+	}
+	g_free(data->path);
+
+	g_slice_free(PurpleLogCommonLoggerData, data);
+}
+
+/* Queues a job, copying the len bytes of buf for it. */
+static void
+writer_push(WriterJobType type, PurpleLogCommonLoggerData *data,
+            PurpleAccount *account, const char *buf, gsize len,
+            const LogIndexRecord *record)
+{
+	char *heap = len > WRITER_SLOT_SIZE ? g_strndup(buf, len) : NULL;
+	WriterJob *job;
+	guint slot;
+
+	g_mutex_lock(&writer_lock);
+	while (writer_count == WRITER_QUEUE_SIZE)
+		g_cond_wait(&writer_not_full, &writer_lock);
+
+	slot = (writer_head + writer_count) % WRITER_QUEUE_SIZE;
+	job = &writer_queue[slot];
+	job->type = type;
+	job->data = data;
+	job->account = account;
+	job->heap = heap;
+	job->buf = heap ? heap : writer_slots + (gsize)slot * WRITER_SLOT_SIZE;
+	if (len > 0 && heap == NULL)
+		memcpy(job->buf, buf, len);
+	job->len = len;
+	job->has_record = record != NULL;
+	if (record)
+		job->record = *record;
+	writer_count++;
+
+	g_cond_signal(&writer_not_empty);
+	g_mutex_unlock(&writer_lock);
+}
+
+static gpointer
+writer_thread_func(gpointer unused)
+{
+	gboolean quit = FALSE;
+
+	while (!quit) {
+		WriterJob *job;
+
+		g_mutex_lock(&writer_lock);
+		while (writer_count == 0)
+			g_cond_wait(&writer_not_empty, &writer_lock);
+		job = &writer_queue[writer_head];
+		g_mutex_unlock(&writer_lock);
+
+		/* The slot stays taken until its line is written. */
+		switch (job->type) {
+		case WRITER_JOB_WRITE:
+			log_file_write(job->data, job->buf, job->len,
+			               job->has_record ? &job->record : NULL);
+			g_free(job->heap);
+			break;
+
+		case WRITER_JOB_FLUSH:
+			log_file_commit_all(job->account);
+			break;
+
+		case WRITER_JOB_CLOSE:
+			log_file_close(job->data);
+			break;
+
+		case WRITER_JOB_QUIT:
+			log_file_commit_all(NULL);
+			quit = TRUE;
+			break;
+		}
+
+		g_mutex_lock(&writer_lock);
+		writer_head = (writer_head + 1) % WRITER_QUEUE_SIZE;
+		writer_count--;
+		g_cond_signal(&writer_not_full);
+		g_mutex_unlock(&writer_lock);
+	}
+
+	return NULL;
+}
+
+static void
+writer_start(void)
+{
+	if (writer_thread != NULL)
+		return;
+
+	writer_head = 0;
+	writer_count = 0;
+	writer_slots = g_malloc((gsize)WRITER_QUEUE_SIZE * WRITER_SLOT_SIZE);
+	writer_thread = g_thread_new("colornicks-writer", writer_thread_func, NULL);
+	async_write = TRUE;
+}
+
+/* Drains everything that is still queued and joins the writer thread. */
+static void
+writer_stop(void)
+{
+	if (writer_thread == NULL)
+		return;
+
+	writer_push(WRITER_JOB_QUIT, NULL, NULL, NULL, 0, NULL);
+	g_thread_join(writer_thread);
+	writer_thread = NULL;
+	g_free(writer_slots);
+	writer_slots = NULL;
+	async_write = FALSE;
+}
+
+/* Writes buf to the log in one go, along with its index record if there is
+ * one. The writer thread gets its own copy, in its queue. */
+static void
+log_emit(PurpleLogCommonLoggerData *data, const char *buf, gsize len,
+         const LogIndexRecord *record)
+{
+	ColorNicksLogData *extra = data->extra;
+
+	if (async_write)
+		writer_push(WRITER_JOB_WRITE, data, NULL, buf, len, record);
+	else
+		log_file_write(data, buf, len, record);
+
+	extra->offset += len;
+	if (extra->ledger)
+		extra->ledger->size += len;
+
+	if (extra->frame && g_atomic_int_get(&commit_policy) == COMMIT_SIZE_THRESHOLD)
+		frame_timer_arm();
+}
+
+static guint64
+log_file_size(FILE *file)
+{
+	struct stat st;
+
+	if (fstat(fileno(file), &st) != 0)
+		return 0;
+	return st.st_size;
+}
+
+/* Opens the index of the log at path for appending. Appending to a log
+ * that already has lines is rare (a log reopened within the same second, or
+ * one left behind by an older version or a crash), and its index may be
+ * missing or stop short, so it is rebuilt first; new records would
+ * otherwise follow a gap. */
+static FILE *
+log_index_open(const char *path, FILE *file)
+{
+	char *index_path = g_strconcat(path, INDEX_SUFFIX, NULL);
+	FILE *index;
+
+	if (log_file_size(file) > 0) {
+		GArray *records = log_index_rebuild(path);
+
+		if (records)
+			g_array_free(records, TRUE);
+	}
+
+	index = g_fopen(index_path, "ab");
+
+	if (index == NULL)
+		purple_debug_error("log", "Unable to create index %s: %s\n",
+		                   index_path, g_strerror(errno));
+	g_free(index_path);
+
+	return index;
+}
+
+/* Reads the last record of the frames sidecar of the compressed log at path
+ * into end, in host order. */
+static gboolean
+log_frames_last(const char *path, FrameRecord *end)
+{
+	char *frames_path = g_strconcat(path, FRAMES_SUFFIX, NULL);
+	FILE *frames = g_fopen(frames_path, "rb");
+	gboolean found = FALSE;
+
+	g_free(frames_path);
+	if (frames == NULL)
+		return FALSE;
+
+	if (fseek(frames, -(long)sizeof(FrameRecord), SEEK_END) == 0 &&
+	    fread(end, sizeof(FrameRecord), 1, frames) == 1) {
+		end->end = GUINT64_FROM_LE(end->end);
+		end->logical_end = GUINT64_FROM_LE(end->logical_end);
+		found = TRUE;
+	}
+	fclose(frames);
+
+	return found;
+}
+
+/* Opens the frames sidecar of the compressed log at path for appending and
+ * sets end to where the last frame in it ends. */
+static FILE *
+log_frames_open(const char *path, FILE *file, FrameRecord *end)
+{
+	char *frames_path = g_strconcat(path, FRAMES_SUFFIX, NULL);
+	FILE *frames;
+
+	if (!log_frames_last(path, end)) {
+		end->end = log_file_size(file);
+		end->logical_end = 0;
+	}
+
+	frames = g_fopen(frames_path, "ab");
+	if (frames == NULL)
+		purple_debug_error("log", "Unable to create frame index %s: %s\n",
+		                   frames_path, g_strerror(errno));
+	g_free(frames_path);
+
+	return frames;
+}
+
+/* The uncompressed size of the compressed log at path, or -1 if unknown. */
+static gint64
+log_logical_size(const char *path)
+{
+	FrameRecord end;
+
+	if (log_frames_last(path, &end))
+		return end.logical_end;
+	return -1;
+}
+
+static int
+compressed_total_size(const char *dir)
+{
+	GDir *d = g_dir_open(dir, 0, NULL);
+	const char *name;
+	int size = 0;
+
+	if (d == NULL)
+		return 0;
+
+	while ((name = g_dir_read_name(d)) != NULL) {
+		if (g_str_has_suffix(name, COMPRESSED_EXT)) {
+			char *path = g_build_filename(dir, name, NULL);
+			gint64 logical = log_logical_size(path);
+			struct stat st;
+
+			if (logical < 0 && g_stat(path, &st) == 0)
+				logical = st.st_size;
+			if (logical > 0)
+				size += logical;
+			g_free(path);
+		}
+	}
+	g_dir_close(d);
+
+	return size;
+}
+
+static GHashTable *size_ledger = NULL;  /* "ext:dir" -> SizeLedgerEntry */
+
+static gint64
+dir_mtime(const char *dir)
+{
+	struct stat st;
+
+	if (g_stat(dir, &st) != 0)
+		return -1;
+	return st.st_mtime;
+}
+
+static char *
+size_ledger_file(void)
+{
+	return g_build_filename(purple_user_dir(), "colornicks-sizes.cache", NULL);
+}
+
+static SizeLedgerEntry *
+size_ledger_lookup(const char *dir, const char *ext)
+{
+	char *key = g_strconcat(ext, ":", dir, NULL);
+	SizeLedgerEntry *entry = g_hash_table_lookup(size_ledger, key);
+
+	if (entry == NULL) {
+		entry = g_new(SizeLedgerEntry, 1);
+		entry->size = 0;
+		entry->mtime = -2;  /* never matches */
+		g_hash_table_insert(size_ledger, key, entry);
+	} else {
+		g_free(key);
+	}
+
+	return entry;
+}
+
+/* The cache file is consumed on load and written back on unload, so a
+ * crash in between, which may leave appended bytes uncounted, simply
+ * means starting from scratch. */
+static void
+size_ledger_load(void)
+{
+	GKeyFile *keyfile = g_key_file_new();
+	char *file = size_ledger_file();
+	gchar **groups;
+	gsize i, n;
+
+	size_ledger = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	if (g_key_file_load_from_file(keyfile, file, G_KEY_FILE_NONE, NULL)) {
+		groups = g_key_file_get_groups(keyfile, &n);
+		for (i = 0; i < n; i++) {
+			SizeLedgerEntry *entry = g_new(SizeLedgerEntry, 1);
+			entry->size = g_key_file_get_int64(keyfile, groups[i], "size", NULL);
+			entry->mtime = g_key_file_get_int64(keyfile, groups[i], "mtime", NULL);
+			g_hash_table_insert(size_ledger, g_strdup(groups[i]), entry);
+		}
+		g_strfreev(groups);
+		g_unlink(file);
+	}
+
+	g_key_file_free(keyfile);
+	g_free(file);
+}
+
+static void
+size_ledger_save(void)
+{
+	GKeyFile *keyfile = g_key_file_new();
+	char *file = size_ledger_file();
+	GHashTableIter iter;
+	gpointer key, value;
+	char *contents;
+	gsize len;
+
+	g_hash_table_iter_init(&iter, size_ledger);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		SizeLedgerEntry *entry = value;
+
+		if (entry->mtime < 0)
+			continue;
+		g_key_file_set_int64(keyfile, key, "size", entry->size);
+		g_key_file_set_int64(keyfile, key, "mtime", entry->mtime);
+	}
+
+	contents = g_key_file_to_data(keyfile, &len, NULL);
+	if (!g_file_set_contents(file, contents, len, NULL))
+		purple_debug_error("log", "Unable to write %s\n", file);
+
+	g_free(contents);
+	g_key_file_free(keyfile);
+	g_free(file);
+
+	g_hash_table_destroy(size_ledger);
+	size_ledger = NULL;
+}
+
+/* Called after we create files in dir, with its mtime from before. If the
+ * entry was right up to then, our own change does not invalidate it. */
+static SizeLedgerEntry *
+size_ledger_created(const char *dir, const char *ext, gint64 before)
+{
+	SizeLedgerEntry *entry = size_ledger_lookup(dir, ext);
+
+	if (entry->mtime == before)
+		entry->mtime = dir_mtime(dir);
+
+	return entry;
+}
+
+static int
+size_ledger_total(PurpleLogType type, const char *name, PurpleAccount *account, const char *ext)
+{
+	char *dir = purple_log_get_log_dir(type, name, account);
+	SizeLedgerEntry *entry;
+	gint64 mtime;
+
+	if (dir == NULL)
+		return 0;
+
+	mtime = dir_mtime(dir);
+	entry = size_ledger_lookup(dir, ext);
+
+	/* Changes within the current second may not have moved the mtime yet.
+	 * Compressed logs count with their uncompressed size, which is what
+	 * we add for them as they are written. */
+	if (entry->mtime != mtime || mtime >= (gint64)time(NULL) - 1) {
+		if (strcmp(ext, COMPRESSED_EXT) == 0)
+			entry->size = compressed_total_size(dir);
+		else
+			entry->size = purple_log_common_total_sizer(type, name, account, ext);
+		entry->mtime = mtime;
+	}
+	g_free(dir);
+
+	return entry->size;
+}
+
+/* Returns the extension of the files logger writes, or NULL if it is not one
+ * of our loggers that write files. */
+static const char *
+log_file_ext(PurpleLogLogger *logger)
+{
+	if (logger == colornicks_logger)
+		return ".htm";
+	if (logger == colornicks_gz_logger)
+		return COMPRESSED_EXT;
+	if (logger == colornicks_bin_logger)
+		return BINARY_EXT;
+	return NULL;
+}
+
+/* Log listings.
+ * purple_log_common_lister() reads the whole directory and parses every
+ * filename on each call, which the log viewer and history lookups do a lot.
+ * Listings are cached per directory instead, and callers get copies. A
+ * GFileMonitor drops a listing as soon as something else adds or removes a
+ * log there, while the logs we create ourselves are added in place. */
+
+#define LISTING_CACHE_MAX 128
+
+typedef struct {
+	char *key;
+	char *ext;
+	GList *logs;
+	GHashTable *own;        /* basenames we created and expect to hear about */
+	GFileMonitor *monitor;
+	GList *lru_link;
+} LogListing;
+
+typedef struct {
+	PurpleLogType type;
+	char *name;
+	PurpleAccount *account;
+} ListingWarmup;
+
+static GHashTable *listings = NULL;     /* "ext:dir" -> LogListing */
+static GQueue listings_lru = G_QUEUE_INIT;
+static GQueue listing_warmups = G_QUEUE_INIT;
+static guint listing_warmup_source = 0;
+
+static void
+log_listing_free(gpointer data)
+{
+	LogListing *listing = data;
+
+	if (listing->monitor) {
+		g_file_monitor_cancel(listing->monitor);
+		g_object_unref(listing->monitor);
+	}
+	g_list_free_full(listing->logs, (GDestroyNotify)purple_log_free);
+	g_hash_table_destroy(listing->own);
+	g_queue_delete_link(&listings_lru, listing->lru_link);
+	g_free(listing->key);
+	g_free(listing->ext);
+	g_free(listing);
+}
+
+static void
+log_listing_changed_cb(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                       GFileMonitorEvent event, LogListing *listing)
+{
+	char *name;
+	gboolean own;
+
+	/* Appends to existing logs do not change the listing. */
+	if (event != G_FILE_MONITOR_EVENT_CREATED && event != G_FILE_MONITOR_EVENT_DELETED &&
+	    event != G_FILE_MONITOR_EVENT_MOVED)
+		return;
+
+	name = g_file_get_basename(file);
+	if (!g_str_has_suffix(name, listing->ext)) {
+		g_free(name);
+		return;
+	}
+
+	own = event == G_FILE_MONITOR_EVENT_CREATED && g_hash_table_remove(listing->own, name);
+	g_free(name);
+
+	if (!own)
+		g_hash_table_remove(listings, listing->key);
+}
+
+static PurpleLog *
+log_copy(PurpleLog *log, const char *path)
+{
+	PurpleLog *copy = purple_log_new(log->type, log->name, log->account, NULL, log->time, log->tm);
+	PurpleLogCommonLoggerData *data = g_slice_new0(PurpleLogCommonLoggerData);
+
+	data->path = g_strdup(path);
+	copy->logger = log->logger;
+	copy->logger_data = data;
+
+	return copy;
+}
+
+/* Returns the cached listing for a conversation, listing it now if needed,
+ * or NULL if the directory cannot be watched. */
+static LogListing *
+log_listing_lookup(PurpleLogType type, const char *name, PurpleAccount *account,
+                   const char *ext, PurpleLogLogger *logger)
+{
+	char *dir = purple_log_get_log_dir(type, name, account);
+	LogListing *listing;
+	GFile *file;
+	char *key;
+
+	if (dir == NULL)
+		return NULL;
+
+	key = g_strconcat(ext, ":", dir, NULL);
+	if ((listing = g_hash_table_lookup(listings, key)) != NULL) {
+		g_queue_unlink(&listings_lru, listing->lru_link);
+		g_queue_push_head_link(&listings_lru, listing->lru_link);
+		g_free(key);
+		g_free(dir);
+		return listing;
+	}
+
+	listing = g_new0(LogListing, 1);
+	listing->key = key;
+	listing->ext = g_strdup(ext);
+	listing->own = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	/* Watch first, so nothing that happens while listing is missed. */
+	file = g_file_new_for_path(dir);
+	listing->monitor = g_file_monitor_directory(file, G_FILE_MONITOR_NONE, NULL, NULL);
+	g_object_unref(file);
+	g_free(dir);
+
+	if (listing->monitor == NULL) {
+		g_hash_table_destroy(listing->own);
+		g_free(listing->ext);
+		g_free(listing->key);
+		g_free(listing);
+		return NULL;
+	}
+	g_signal_connect(G_OBJECT(listing->monitor), "changed",
+	                 G_CALLBACK(log_listing_changed_cb), listing);
+
+	listing->logs = purple_log_common_lister(type, name, account, ext, logger);
+
+	g_queue_push_head(&listings_lru, listing);
+	listing->lru_link = listings_lru.head;
+	g_hash_table_insert(listings, listing->key, listing);
+
+	while (g_queue_get_length(&listings_lru) > LISTING_CACHE_MAX) {
+		LogListing *oldest = g_queue_peek_tail(&listings_lru);
+		g_hash_table_remove(listings, oldest->key);
+	}
+
+	return listing;
+}
+
+static GList *
+log_listing_get(PurpleLogType type, const char *name, PurpleAccount *account,
+                const char *ext, PurpleLogLogger *logger)
+{
+	LogListing *listing = log_listing_lookup(type, name, account, ext, logger);
+	GList *l, *copy = NULL;
+
+	if (listing == NULL)
+		return purple_log_common_lister(type, name, account, ext, logger);
+
+	for (l = listing->logs; l; l = l->next) {
+		PurpleLog *log = l->data;
+		copy = g_list_prepend(copy, log_copy(log, ((PurpleLogCommonLoggerData *)log->logger_data)->path));
+	}
+
+	return copy;
+}
+
+/* Adds a log we just created at path to its directory's listing, if that
+ * is cached. */
+static void
+log_listing_created(PurpleLog *log, const char *dir, const char *ext, const char *path)
+{
+	char *key = g_strconcat(ext, ":", dir, NULL);
+	LogListing *listing = g_hash_table_lookup(listings, key);
+	g_free(key);
+
+	if (listing == NULL)
+		return;
+
+	g_hash_table_add(listing->own, g_path_get_basename(path));
+	listing->logs = g_list_prepend(listing->logs, log_copy(log, path));
+}
+
+static gboolean
+log_listing_warmup_cb(gpointer unused)
+{
+	ListingWarmup *warmup = g_queue_pop_head(&listing_warmups);
+
+	if (warmup) {
+		/* The listing of the logger new logs go to, which is the one
+		 * /purple/logging/format names. */
+		PurpleLogLogger *logger = purple_log_logger_get();
+		const char *ext = log_file_ext(logger);
+
+		/* The account may have gone away since the conversation opened. */
+		if (ext && g_list_find(purple_accounts_get_all(), warmup->account))
+			log_listing_lookup(warmup->type, warmup->name, warmup->account, ext, logger);
+		g_free(warmup->name);
+		g_free(warmup);
+	}
+
+	if (g_queue_is_empty(&listing_warmups)) {
+		listing_warmup_source = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* List a new conversation's logs while the main loop is idle, so the first
+ * look at its history comes from the cache. */
+static void
+listing_conv_created_cb(PurpleConversation *conv)
+{
+	ListingWarmup *warmup = g_new(ListingWarmup, 1);
+
+	warmup->type = purple_conversation_get_type(conv) == PURPLE_CONV_TYPE_CHAT ?
+		PURPLE_LOG_CHAT : PURPLE_LOG_IM;
+	warmup->name = g_strdup(purple_conversation_get_name(conv));
+	warmup->account = purple_conversation_get_account(conv);
+	g_queue_push_tail(&listing_warmups, warmup);
+
+	if (listing_warmup_source == 0)
+		listing_warmup_source = g_idle_add_full(G_PRIORITY_LOW, log_listing_warmup_cb, NULL, NULL);
+}
+
+static void
+listing_account_removed_cb(PurpleAccount *account)
+{
+	/* Cached logs point at their account. */
+	g_hash_table_remove_all(listings);
+}
+
+static void
+listings_init(void)
+{
+	listings = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, log_listing_free);
+}
+
+static void
+listings_shutdown(void)
+{
+	ListingWarmup *warmup;
+
+	if (listing_warmup_source) {
+		g_source_remove(listing_warmup_source);
+		listing_warmup_source = 0;
+	}
+	while ((warmup = g_queue_pop_head(&listing_warmups)) != NULL) {
+		g_free(warmup->name);
+		g_free(warmup);
+	}
+
+	g_hash_table_destroy(listings);
+	listings = NULL;
+}
+
+/* Full-text search.
+ * Each account has an inverted index in its log directory. New postings are
+ * appended to a journal, colornicks-search.postings, as a "file\toffset\t
+ * token token ...\n" line per message. Once the journal passes
+ * SEARCH_JOURNAL_MAX bytes, a background thread merges it into
+ * colornicks-search.index. That file lists every token once, in order,
+ * with the (file, offset) postings of the messages that contain it. A
+ * query binary-searches the mapped index for each of its tokens and reads
+ * only their postings. Only the journal, which merging keeps small, is
+ * ever read into memory. A merge that fails leaves the journal as it was
+ * and is tried again after a minute, then twice as long each time it
+ * fails again, up to an hour.
+ * colornicks-search.files gives every indexed log an id ("id\tpath" per
+ * line, the path relative to the account directory). A removed log gets a
+ * "-id" line; its postings are ignored and dropped at the next merge.
+ * colornicks_logger_write() feeds new messages as they are logged, and a
+ * background thread indexes logs written before the index existed. A log
+ * only gets its id once all of it is indexed, so an interrupted backfill
+ * starts that log over. Markup is stripped and text casefolded before
+ * splitting it into runs of letters and digits, so nick colors and
+ * formatting never become tokens. */
+
+#define SEARCH_FILES "colornicks-search.files"
+#define SEARCH_POSTINGS "colornicks-search.postings"
+#define SEARCH_MERGING ".merging"   /* suffix of a journal being merged */
+#define SEARCH_SEGMENT "colornicks-search.index"
+#define SEARCH_MAGIC "CNSIDX\0\1"
+#define SEARCH_MAGIC_LEN 8
+#define SEARCH_TOKEN_MAX 64         /* bytes; longer runs are cut */
+#define SEARCH_JOURNAL_MAX (4 * 1024 * 1024)
+#define SEARCH_RETRY_MIN 60         /* seconds before a failed merge is retried */
+#define SEARCH_RETRY_MAX (60 * 60)
+
+typedef struct {
+	guint32 file;
+	guint64 offset;
+} SearchPosting;
+
+/* colornicks-search.index, all little-endian: a SearchSegmentHeader, the
+ * postings of every token one after the other, a SearchTerm per token in
+ * token order, and the NUL-terminated tokens. */
+typedef struct {
+	char magic[SEARCH_MAGIC_LEN];
+	guint32 n_terms;
+	guint32 reserved;
+	guint64 terms;      /* file offset of the SearchTerms */
+	guint64 names;      /* and of the tokens */
+} SearchSegmentHeader;
+
+typedef struct {
+	guint32 name;       /* offset of the token among the tokens */
+	guint32 count;
+	guint64 first;      /* index of its first posting */
+} SearchTerm;
+
+typedef struct {
+	guint32 file;
+	guint32 reserved;
+	guint64 offset;
+} SearchDiskPosting;
+
+typedef struct _SearchIndex {
+	char *dir;                /* account log directory */
+	FILE *files_out;
+	FILE *postings_out;
+	gsize journal_size;       /* bytes in the journal, not counting one being merged */
+	GPtrArray *files;         /* id -> path relative to dir, NULL once removed */
+	GHashTable *file_ids;     /* path -> id + 1 */
+	GHashTable *tokens;       /* journal token -> GArray of SearchPosting, NULL until searched */
+	GMappedFile *segment;     /* the merged index, NULL if there is none */
+	gboolean segment_loaded;
+	gboolean merging;
+	guint merge_retry;        /* source retrying a failed merge, or 0 */
+	guint merge_delay;        /* seconds it waited, 0 after a merge succeeds */
+} SearchIndex;
+
+/* What the "search" IPC call hands back; free path and the hit with g_free. */
+typedef struct {
+	char *path;
+	goffset offset;
+} ColorNicksSearchHit;
+
+static gboolean search_enabled = TRUE;
+static GMutex search_lock;                  /* guards every SearchIndex */
+static GHashTable *search_indexes = NULL;   /* account directory -> SearchIndex */
+static GThread *search_backfill_thread = NULL;
+static GThreadPool *search_merger = NULL;
+static volatile gint search_cancel = 0;
+
+static gint
+search_token_cmp(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Appends the distinct tokens of text to tokens, sorted. */
+static void
+search_tokenize(const char *text, GPtrArray *tokens)
+{
+	char *folded = g_utf8_casefold(text, -1);
+	const char *p = folded, *start = NULL;
+	guint first = tokens->len, i, j;
+
+	for (;;) {
+		gunichar c = g_utf8_get_char(p);
+
+		if (c != 0 && g_unichar_isalnum(c)) {
+			if (start == NULL)
+				start = p;
+		} else if (start != NULL) {
+			gsize len = p - start;
+
+			if (len > SEARCH_TOKEN_MAX) {
+				const char *end = start + SEARCH_TOKEN_MAX;
+				end = g_utf8_find_prev_char(start, end + 1);
+				len = end - start;
+			}
+			if (len >= 2)
+				g_ptr_array_add(tokens, g_strndup(start, len));
+			start = NULL;
+		}
+		if (c == 0)
+			break;
+		p = g_utf8_next_char(p);
+	}
+	g_free(folded);
+
+	if (tokens->len - first < 2)
+		return;
+
+	/* Sort and drop duplicates. */
+	qsort(tokens->pdata + first, tokens->len - first, sizeof(gpointer), search_token_cmp);
+	for (i = j = first + 1; i < tokens->len; i++) {
+		if (strcmp(tokens->pdata[i], tokens->pdata[j - 1]) == 0)
+			g_free(tokens->pdata[i]);
+		else
+			tokens->pdata[j++] = tokens->pdata[i];
+	}
+	/* The slots past j were moved or freed above, and shrinking frees them. */
+	for (i = j; i < tokens->len; i++)
+		tokens->pdata[i] = NULL;
+	g_ptr_array_set_size(tokens, j);
+}
+
+static gint
+search_posting_cmp(gconstpointer a, gconstpointer b)
+{
+	const SearchPosting *x = a, *y = b;
+
+	if (x->file != y->file)
+		return x->file < y->file ? -1 : 1;
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	return 0;
+}
+
+/* Sorts postings and drops duplicates. */
+static void
+search_postings_sort(GArray *postings)
+{
+	guint i, n;
+
+	g_array_sort(postings, search_posting_cmp);
+	for (i = n = 0; i < postings->len; i++)
+		if (n == 0 || search_posting_cmp(&g_array_index(postings, SearchPosting, i),
+		                                 &g_array_index(postings, SearchPosting, n - 1)) != 0)
+			g_array_index(postings, SearchPosting, n++) = g_array_index(postings, SearchPosting, i);
+	g_array_set_size(postings, n);
+}
+
+static void
+search_postings_add(GHashTable *tokens, const char *token, guint32 file, guint64 offset)
+{
+	GArray *postings = g_hash_table_lookup(tokens, token);
+	SearchPosting posting = { file, offset };
+
+	if (postings == NULL) {
+		postings = g_array_new(FALSE, FALSE, sizeof(SearchPosting));
+		g_hash_table_insert(tokens, g_strdup(token), postings);
+	}
+	g_array_append_val(postings, posting);
+}
+
+static GHashTable *
+search_tokens_new(void)
+{
+	return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+}
+
+/* Adds the postings of the journal at path to tokens. */
+static void
+search_journal_read(const char *path, GHashTable *tokens)
+{
+	char *contents, *line, *end;
+	gsize len;
+
+	if (!g_file_get_contents(path, &contents, &len, NULL))
+		return;
+
+	for (line = contents; (end = memchr(line, '\n', contents + len - line)) != NULL; line = end + 1) {
+		char *p, *token;
+		guint32 file;
+		guint64 offset;
+
+		*end = '\0';
+		file = strtoul(line, &p, 10);
+		if (*p++ != '\t')
+			continue;
+		offset = g_ascii_strtoull(p, &p, 10);
+		if (*p++ != '\t')
+			continue;
+		for (token = p; *token; token = p) {
+			if ((p = strchr(token, ' ')) != NULL)
+				*p++ = '\0';
+			else
+				p = token + strlen(token);
+			if (*token)
+				search_postings_add(tokens, token, file, offset);
+		}
+	}
+	g_free(contents);
+}
+
+/* Whether data looks like a whole merged index. */
+static gboolean
+search_segment_check(const char *data, gsize len)
+{
+	const SearchSegmentHeader *header = (const SearchSegmentHeader *)data;
+	guint64 terms, names;
+
+	if (len < sizeof(SearchSegmentHeader) ||
+	    memcmp(header->magic, SEARCH_MAGIC, SEARCH_MAGIC_LEN) != 0)
+		return FALSE;
+
+	terms = GUINT64_FROM_LE(header->terms);
+	names = GUINT64_FROM_LE(header->names);
+	return terms >= sizeof(SearchSegmentHeader) &&
+	       (terms - sizeof(SearchSegmentHeader)) % sizeof(SearchDiskPosting) == 0 &&
+	       names == terms + (guint64)GUINT32_FROM_LE(header->n_terms) * sizeof(SearchTerm) &&
+	       names <= len && (names == len || data[len - 1] == '\0');
+}
+
+/* Appends the postings of term i of a checked index to postings, in host
+ * order, leaving out files for which removed says so. Returns its token. */
+static const char *
+search_segment_term(const char *data, gsize len, guint i, const gboolean *removed,
+                    guint n_removed, GArray *postings)
+{
+	const SearchSegmentHeader *header = (const SearchSegmentHeader *)data;
+	guint64 terms_offset = GUINT64_FROM_LE(header->terms);
+	guint64 names_offset = GUINT64_FROM_LE(header->names);
+	const SearchTerm *term = (const SearchTerm *)(data + terms_offset) + i;
+	const SearchDiskPosting *disk = (const SearchDiskPosting *)(data + sizeof(SearchSegmentHeader));
+	guint64 first = GUINT64_FROM_LE(term->first), j;
+	guint32 count = GUINT32_FROM_LE(term->count);
+
+	if (GUINT32_FROM_LE(term->name) >= len - names_offset)
+		return NULL;
+
+	if (postings && (first + count) * sizeof(SearchDiskPosting) <=
+	                terms_offset - sizeof(SearchSegmentHeader)) {
+		for (j = first; j < first + count; j++) {
+			SearchPosting posting;
+
+			posting.file = GUINT32_FROM_LE(disk[j].file);
+			posting.offset = GUINT64_FROM_LE(disk[j].offset);
+			if (posting.file >= n_removed || !removed[posting.file])
+				g_array_append_val(postings, posting);
+		}
+	}
+
+	return data + names_offset + GUINT32_FROM_LE(term->name);
+}
+
+/* Appends the postings of token in a checked index to postings. */
+static void
+search_segment_lookup(const char *data, gsize len, const char *token, GArray *postings)
+{
+	const SearchSegmentHeader *header = (const SearchSegmentHeader *)data;
+	guint lo = 0, hi = GUINT32_FROM_LE(header->n_terms);
+
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		const char *name = search_segment_term(data, len, mid, NULL, 0, NULL);
+		int cmp;
+
+		if (name == NULL)
+			return;
+		if ((cmp = strcmp(token, name)) == 0) {
+			search_segment_term(data, len, mid, NULL, 0, postings);
+			return;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+}
+
+static GMappedFile *
+search_segment_open(const char *dir)
+{
+	char *path = g_build_filename(dir, SEARCH_SEGMENT, NULL);
+	GMappedFile *segment = g_mapped_file_new(path, FALSE, NULL);
+
+	g_free(path);
+	if (segment && !search_segment_check(g_mapped_file_get_contents(segment),
+	                                     g_mapped_file_get_length(segment))) {
+		g_mapped_file_unref(segment);
+		segment = NULL;
+	}
+	return segment;
+}
+
+/* Writes one token of a merge: its postings, and its term. Returns FALSE
+ * on a write error. */
+static gboolean
+search_merge_term(FILE *out, const char *token, GArray *postings, GArray *terms,
+                  GString *names, guint64 *total)
+{
+	SearchTerm term;
+	guint i;
+
+	search_postings_sort(postings);
+	if (postings->len == 0)
+		return TRUE;
+
+	for (i = 0; i < postings->len; i++) {
+		SearchPosting *posting = &g_array_index(postings, SearchPosting, i);
+		SearchDiskPosting disk;
+
+		disk.file = GUINT32_TO_LE(posting->file);
+		disk.reserved = 0;
+		disk.offset = GUINT64_TO_LE(posting->offset);
+		if (fwrite(&disk, sizeof(disk), 1, out) != 1)
+			return FALSE;
+	}
+
+	term.name = GUINT32_TO_LE(names->len);
+	term.count = GUINT32_TO_LE(postings->len);
+	term.first = GUINT64_TO_LE(*total);
+	g_array_append_val(terms, term);
+	g_string_append_len(names, token, strlen(token) + 1);
+	*total += postings->len;
+
+	return TRUE;
+}
+
+static gboolean search_merge_retry_cb(gpointer data);
+
+/* Merges the journal of an index into its merged index. Runs on the
+ * merger thread. */
+static void
+search_merge_func(gpointer data, gpointer unused)
+{
+	SearchIndex *index = data;
+	char *journal = g_build_filename(index->dir, SEARCH_POSTINGS, NULL);
+	char *merging = g_strconcat(journal, SEARCH_MERGING, NULL);
+	char *segment_path = g_build_filename(index->dir, SEARCH_SEGMENT, NULL);
+	char *tmp = g_strconcat(segment_path, ".part", NULL);
+	GHashTable *tokens = search_tokens_new();
+	GArray *terms = g_array_new(FALSE, FALSE, sizeof(SearchTerm));
+	GArray *postings = g_array_new(FALSE, FALSE, sizeof(SearchPosting));
+	GString *names = g_string_new(NULL);
+	GPtrArray *keys = g_ptr_array_new();
+	GMappedFile *old;
+	SearchSegmentHeader header;
+	const char *old_data = NULL;
+	gsize old_len = 0;
+	guint old_terms = 0, i = 0, j = 0, n_removed, steps = 0;
+	gboolean *removed, ok = TRUE;
+	guint64 total = 0;
+	GHashTableIter iter;
+	gpointer key;
+	FILE *out;
+
+	/* New postings go to a fresh journal while this one is merged. One left
+	 * by an interrupted merge goes first; the current journal is next. */
+	g_mutex_lock(&search_lock);
+	if (!g_file_test(merging, G_FILE_TEST_EXISTS) && index->postings_out) {
+		fclose(index->postings_out);
+		if (g_rename(journal, merging) != 0)
+			thread_debug_error("Unable to rename %s: %s\n", journal, g_strerror(errno));
+		index->postings_out = g_fopen(journal, "a");
+		index->journal_size = 0;
+	}
+	n_removed = index->files->len;
+	removed = g_new(gboolean, MAX(n_removed, 1));
+	for (i = 0; i < n_removed; i++)
+		removed[i] = g_ptr_array_index(index->files, i) == NULL;
+	g_mutex_unlock(&search_lock);
+
+	search_journal_read(merging, tokens);
+	g_hash_table_iter_init(&iter, tokens);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_ptr_array_add(keys, key);
+	g_ptr_array_sort(keys, search_token_cmp);
+
+	if ((old = search_segment_open(index->dir)) != NULL) {
+		old_data = g_mapped_file_get_contents(old);
+		old_len = g_mapped_file_get_length(old);
+		old_terms = GUINT32_FROM_LE(((const SearchSegmentHeader *)old_data)->n_terms);
+	}
+
+	/* The postings go first, so they can be streamed; the header is filled
+	 * in last. */
+	memset(&header, 0, sizeof(header));
+	if ((out = g_fopen(tmp, "wb")) == NULL ||
+	    fwrite(&header, sizeof(header), 1, out) != 1)
+		ok = FALSE;
+
+	/* Both lists are in token order. */
+	for (i = j = 0; ok && (i < old_terms || j < keys->len); ) {
+		const char *old_token = i < old_terms ?
+			search_segment_term(old_data, old_len, i, NULL, 0, NULL) : NULL;
+		const char *new_token = j < keys->len ? g_ptr_array_index(keys, j) : NULL;
+		int cmp = old_token == NULL ? 1 : new_token == NULL ? -1 : strcmp(old_token, new_token);
+
+		if (i < old_terms && old_token == NULL) {
+			i++;
+			continue;
+		}
+
+		g_array_set_size(postings, 0);
+		if (cmp <= 0)
+			search_segment_term(old_data, old_len, i++, removed, n_removed, postings);
+		if (cmp >= 0) {
+			GArray *added = g_hash_table_lookup(tokens, new_token);
+			guint k;
+
+			for (k = 0; k < added->len; k++) {
+				SearchPosting *posting = &g_array_index(added, SearchPosting, k);
+				if (posting->file >= n_removed || !removed[posting->file])
+					g_array_append_val(postings, *posting);
+			}
+			j++;
+		}
+		ok = search_merge_term(out, cmp <= 0 ? old_token : new_token, postings,
+		                       terms, names, &total);
+
+		if (++steps % 4096 == 0 && g_atomic_int_get(&search_cancel))
+			ok = FALSE;
+	}
+
+	if (ok) {
+		header.terms = sizeof(header) + total * sizeof(SearchDiskPosting);
+		header.names = header.terms + (guint64)terms->len * sizeof(SearchTerm);
+		memcpy(header.magic, SEARCH_MAGIC, SEARCH_MAGIC_LEN);
+		header.n_terms = GUINT32_TO_LE(terms->len);
+		header.terms = GUINT64_TO_LE(header.terms);
+		header.names = GUINT64_TO_LE(header.names);
+
+		ok = (terms->len == 0 || fwrite(terms->data, sizeof(SearchTerm), terms->len, out) == terms->len) &&
+		     (names->len == 0 || fwrite(names->str, names->len, 1, out) == 1) &&
+		     fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1 &&
+		     fflush(out) == 0 && fsync(fileno(out)) == 0;
+	}
+	if (out && fclose(out) != 0)
+		ok = FALSE;
+
+	if (ok && !g_atomic_int_get(&search_cancel)) {
+		g_mutex_lock(&search_lock);
+		if (g_rename(tmp, segment_path) == 0) {
+			g_unlink(merging);
+			if (index->segment)
+				g_mapped_file_unref(index->segment);
+			index->segment = NULL;
+			index->segment_loaded = FALSE;
+			/* The journal left is read again at the next search. */
+			if (index->tokens) {
+				g_hash_table_destroy(index->tokens);
+				index->tokens = NULL;
+			}
+			index->merging = FALSE;
+			index->merge_delay = 0;
+		} else {
+			thread_debug_error("Unable to rename %s: %s\n", tmp, g_strerror(errno));
+			g_unlink(tmp);
+			ok = FALSE;
+		}
+		g_mutex_unlock(&search_lock);
+	} else {
+		if (!g_atomic_int_get(&search_cancel))
+			thread_debug_error("Unable to write %s: %s\n", tmp, g_strerror(errno));
+		g_unlink(tmp);
+		ok = FALSE;
+	}
+
+	/* Retried later rather than on every message, which would only fail
+	 * again. The journal being merged stays and goes first next time. */
+	if (!ok && !g_atomic_int_get(&search_cancel)) {
+		g_mutex_lock(&search_lock);
+		index->merging = FALSE;
+		index->merge_delay = CLAMP(index->merge_delay * 2, SEARCH_RETRY_MIN, SEARCH_RETRY_MAX);
+		index->merge_retry = g_timeout_add_seconds(index->merge_delay, search_merge_retry_cb, index);
+		g_mutex_unlock(&search_lock);
+	}
+
+	if (old)
+		g_mapped_file_unref(old);
+	g_free(removed);
+	g_ptr_array_free(keys, TRUE);
+	g_string_free(names, TRUE);
+	g_array_free(postings, TRUE);
+	g_array_free(terms, TRUE);
+	g_hash_table_destroy(tokens);
+	g_free(tmp);
+	g_free(segment_path);
+	g_free(merging);
+	g_free(journal);
+}
+
+static void
+search_merge_start_locked(SearchIndex *index)
+{
+	if (index->merging || index->merge_retry || search_merger == NULL)
+		return;
+
+	index->merging = TRUE;
+	g_thread_pool_push(search_merger, index, NULL);
+}
+
+static gboolean
+search_merge_retry_cb(gpointer data)
+{
+	SearchIndex *index = data;
+
+	g_mutex_lock(&search_lock);
+	index->merge_retry = 0;
+	search_merge_start_locked(index);
+	g_mutex_unlock(&search_lock);
+
+	return FALSE;
+}
+
+/* Records a message's (sorted, distinct) tokens. */
+static void
+search_index_add_locked(SearchIndex *index, guint32 file, guint64 offset, GPtrArray *tokens)
+{
+	guint i;
+
+	if (tokens->len == 0)
+		return;
+
+	if (index->postings_out) {
+		char prefix[48];
+		gsize len = g_snprintf(prefix, sizeof(prefix), "%u\t%" G_GUINT64_FORMAT "\t", file, offset);
+
+		fputs(prefix, index->postings_out);
+		for (i = 0; i < tokens->len; i++) {
+			if (i > 0)
+				fputc(' ', index->postings_out);
+			fputs(tokens->pdata[i], index->postings_out);
+			len += strlen(tokens->pdata[i]) + 1;
+		}
+		fputc('\n', index->postings_out);
+
+		index->journal_size += len;
+		if (index->journal_size >= SEARCH_JOURNAL_MAX)
+			search_merge_start_locked(index);
+	}
+
+	if (index->tokens)
+		for (i = 0; i < tokens->len; i++)
+			search_postings_add(index->tokens, tokens->pdata[i], file, offset);
+}
+
+/* Returns the id of the log at relpath, giving it one if it has none yet;
+ * created says which. */
+static guint32
+search_file_id_locked(SearchIndex *index, const char *relpath, gboolean *created)
+{
+	gpointer id = g_hash_table_lookup(index->file_ids, relpath);
+	char *path;
+
+	*created = id == NULL;
+	if (id)
+		return GPOINTER_TO_UINT(id) - 1;
+
+	path = g_strdup(relpath);
+	g_ptr_array_add(index->files, path);
+	g_hash_table_insert(index->file_ids, path, GUINT_TO_POINTER(index->files->len));
+	if (index->files_out) {
+		fprintf(index->files_out, "%u\t%s\n", index->files->len - 1, relpath);
+		fflush(index->files_out);
+	}
+	return index->files->len - 1;
+}
+
+static void
+search_file_forget_locked(SearchIndex *index, guint32 id)
+{
+	if (id >= index->files->len || g_ptr_array_index(index->files, id) == NULL)
+		return;
+
+	/* The table owns the path. */
+	g_hash_table_remove(index->file_ids, g_ptr_array_index(index->files, id));
+	g_ptr_array_index(index->files, id) = NULL;
+}
+
+static void
+search_index_free(gpointer data)
+{
+	SearchIndex *index = data;
+
+	if (index->merge_retry)
+		g_source_remove(index->merge_retry);
+	if (index->files_out)
+		fclose(index->files_out);
+	if (index->postings_out)
+		fclose(index->postings_out);
+	g_ptr_array_free(index->files, TRUE);
+	g_hash_table_destroy(index->file_ids);
+	if (index->tokens)
+		g_hash_table_destroy(index->tokens);
+	if (index->segment)
+		g_mapped_file_unref(index->segment);
+	g_free(index->dir);
+	g_free(index);
+}
+
+/* Returns the index for the account directory dir, opening it if needed.
+ * Main loop only. */
+static SearchIndex *
+search_index_get(const char *dir)
+{
+	SearchIndex *index = g_hash_table_lookup(search_indexes, dir);
+	char *path, *contents;
+
+	if (index)
+		return index;
+
+	index = g_new0(SearchIndex, 1);
+	index->dir = g_strdup(dir);
+	index->files = g_ptr_array_new();
+	index->file_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	path = g_build_filename(dir, SEARCH_FILES, NULL);
+	if (g_file_get_contents(path, &contents, NULL, NULL)) {
+		char **lines = g_strsplit(contents, "\n", -1), **l;
+
+		/* Ids are assigned in order, so a line's id is its position among
+		 * the lines that are not removals. */
+		for (l = lines; *l; l++) {
+			char *tab = strchr(*l, '\t');
+			if (**l == '-')
+				search_file_forget_locked(index, strtoul(*l + 1, NULL, 10));
+			else if (tab && strtoul(*l, NULL, 10) == index->files->len) {
+				gboolean created;
+				search_file_id_locked(index, tab + 1, &created);
+			}
+		}
+		g_strfreev(lines);
+		g_free(contents);
+	}
+	if (purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR) == 0)
+		index->files_out = g_fopen(path, "a");
+	g_free(path);
+
+	path = g_build_filename(dir, SEARCH_POSTINGS, NULL);
+	if (index->files_out)
+		index->postings_out = g_fopen(path, "a");
+	if (index->postings_out)
+		index->journal_size = log_file_size(index->postings_out);
+	else
+		purple_debug_error("colornicks", "Could not open the search index in %s\n", dir);
+
+	/* Finish a merge the last session did not. */
+	contents = g_strconcat(path, SEARCH_MERGING, NULL);
+	if (index->journal_size >= SEARCH_JOURNAL_MAX || g_file_test(contents, G_FILE_TEST_EXISTS))
+		search_merge_start_locked(index);
+	g_free(contents);
+	g_free(path);
+
+	g_hash_table_insert(search_indexes, index->dir, index);
+	return index;
+}
+
+/* Maps the merged index and reads the journal, if that has not been done
+ * since they last changed. */
+static void
+search_index_load_locked(SearchIndex *index)
+{
+	char *path, *merging;
+
+	if (!index->segment_loaded) {
+		index->segment = search_segment_open(index->dir);
+		index->segment_loaded = TRUE;
+	}
+
+	if (index->tokens)
+		return;
+
+	index->tokens = search_tokens_new();
+	if (index->postings_out)
+		fflush(index->postings_out);
+
+	path = g_build_filename(index->dir, SEARCH_POSTINGS, NULL);
+	merging = g_strconcat(path, SEARCH_MERGING, NULL);
+	search_journal_read(merging, index->tokens);
+	search_journal_read(path, index->tokens);
+	g_free(merging);
+	g_free(path);
+}
+
+/* Gives the log a file id in its account's search index. Main loop only. */
+static void
+search_log_created(ColorNicksLogData *extra, const char *dir, const char *path)
+{
+	char *account_dir;
+	gboolean created;
+
+	if (!search_enabled || dir == NULL)
+		return;
+
+	account_dir = g_path_get_dirname(dir);
+	if (g_str_has_prefix(path, account_dir) && path[strlen(account_dir)] == G_DIR_SEPARATOR) {
+		extra->search = search_index_get(account_dir);
+		g_mutex_lock(&search_lock);
+		extra->search_file = search_file_id_locked(extra->search,
+			path + strlen(account_dir) + 1, &created);
+		g_mutex_unlock(&search_lock);
+	}
+	g_free(account_dir);
+}
+
+/* Forgets the log at path, which has been removed. Main loop only. */
+static void
+search_log_removed(const char *path)
+{
+	char *conv_dir, *account_dir, *files_path;
+	SearchIndex *index = NULL;
+	gsize len;
+
+	if (search_indexes == NULL)
+		return;
+
+	conv_dir = g_path_get_dirname(path);
+	account_dir = g_path_get_dirname(conv_dir);
+	len = strlen(account_dir);
+
+	/* No need to create an index only to record that. */
+	files_path = g_build_filename(account_dir, SEARCH_FILES, NULL);
+	if (g_str_has_prefix(path, account_dir) && path[len] == G_DIR_SEPARATOR &&
+	    (g_hash_table_contains(search_indexes, account_dir) ||
+	     g_file_test(files_path, G_FILE_TEST_EXISTS)))
+		index = search_index_get(account_dir);
+
+	if (index) {
+		gpointer id;
+
+		g_mutex_lock(&search_lock);
+		if ((id = g_hash_table_lookup(index->file_ids, path + len + 1)) != NULL) {
+			search_file_forget_locked(index, GPOINTER_TO_UINT(id) - 1);
+			if (index->files_out) {
+				fprintf(index->files_out, "-%u\n", GPOINTER_TO_UINT(id) - 1);
+				fflush(index->files_out);
+			}
+		}
+		g_mutex_unlock(&search_lock);
+	}
+
+	g_free(files_path);
+	g_free(account_dir);
+	g_free(conv_dir);
+}
+
+static void
+search_log_message(ColorNicksLogData *extra, guint64 offset, const char *from,
+                   const char *xhtml)
+{
+	GPtrArray *tokens;
+	char *text;
+
+	if (extra->search == NULL)
+		return;
+
+	tokens = g_ptr_array_new_with_free_func(g_free);
+	text = purple_markup_strip_html(xhtml);
+	if (from) {
+		char *with_nick = g_strconcat(from, " ", text, NULL);
+		g_free(text);
+		text = with_nick;
+	}
+	search_tokenize(text, tokens);
+	g_free(text);
+
+	g_mutex_lock(&search_lock);
+	search_index_add_locked(extra->search, extra->search_file, offset, tokens);
+	g_mutex_unlock(&search_lock);
+
+	g_ptr_array_free(tokens, TRUE);
+}
+
+/* Indexes one log we did not write ourselves. Its postings are only
+ * recorded, along with its id, once all of it has been read. */
+static void
+search_backfill_log(SearchIndex *index, const char *relpath)
+{
+	char *path, *contents, *line, *end;
+	GArray *offsets;
+	GPtrArray *messages;
+	gboolean known, created;
+	guint32 file;
+	gsize len;
+	guint i;
+
+	g_mutex_lock(&search_lock);
+	known = g_hash_table_contains(index->file_ids, relpath);
+	g_mutex_unlock(&search_lock);
+	if (known)
+		return;
+
+	path = g_build_filename(index->dir, relpath, NULL);
+	if (!log_get_contents(path, &contents, &len)) {
+		g_free(path);
+		return;
+	}
+	g_free(path);
+
+	offsets = g_array_new(FALSE, FALSE, sizeof(guint64));
+	messages = g_ptr_array_new_with_free_func((GDestroyNotify)g_ptr_array_unref);
+
+	/* Skip the header; every other line is a message. */
+	line = memchr(contents, '\n', len);
+	for (line = line ? line + 1 : contents + len;
+	     (end = memchr(line, '\n', contents + len - line)) != NULL; line = end + 1) {
+		GPtrArray *tokens = g_ptr_array_new_with_free_func(g_free);
+		guint64 offset = line - contents;
+		char *text, *body;
+
+		*end = '\0';
+		text = purple_markup_strip_html(line);
+		/* Leave out the "(12:34:56) " timestamp. */
+		body = text;
+		if (*body == '(' && (body = strstr(body, ") ")) != NULL)
+			body += 2;
+		else
+			body = text;
+		search_tokenize(body, tokens);
+		g_free(text);
+
+		g_array_append_val(offsets, offset);
+		g_ptr_array_add(messages, tokens);
+
+		if (g_atomic_int_get(&search_cancel))
+			break;
+	}
+	g_free(contents);
+
+	if (!g_atomic_int_get(&search_cancel)) {
+		g_mutex_lock(&search_lock);
+		file = search_file_id_locked(index, relpath, &created);
+		/* Unless we started writing to it meanwhile. */
+		for (i = 0; created && i < messages->len; i++)
+			search_index_add_locked(index, file, g_array_index(offsets, guint64, i),
+			                        g_ptr_array_index(messages, i));
+		if (index->postings_out)
+			fflush(index->postings_out);
+		g_mutex_unlock(&search_lock);
+	}
+
+	g_ptr_array_free(messages, TRUE);
+	g_array_free(offsets, TRUE);
+}
+
+static gpointer
+search_backfill_func(gpointer data)
+{
+	GList *indexes = data, *l;
+
+	for (l = indexes; l && !g_atomic_int_get(&search_cancel); l = l->next) {
+		SearchIndex *index = l->data;
+		GDir *account_dir = g_dir_open(index->dir, 0, NULL);
+		const char *name;
+
+		if (account_dir == NULL)
+			continue;
+
+		while ((name = g_dir_read_name(account_dir)) != NULL &&
+		       !g_atomic_int_get(&search_cancel)) {
+			char *conv_path = g_build_filename(index->dir, name, NULL);
+			GDir *conv_dir = g_dir_open(conv_path, 0, NULL);
+			const char *log;
+
+			g_free(conv_path);
+			if (conv_dir == NULL)
+				continue;
+
+			while ((log = g_dir_read_name(conv_dir)) != NULL &&
+			       !g_atomic_int_get(&search_cancel)) {
+				if (g_str_has_suffix(log, ".htm") || g_str_has_suffix(log, COMPRESSED_EXT)) {
+					char *relpath = g_build_filename(name, log, NULL);
+					search_backfill_log(index, relpath);
+					g_free(relpath);
+				}
+			}
+			g_dir_close(conv_dir);
+		}
+		g_dir_close(account_dir);
+	}
+
+	g_list_free(indexes);
+	return NULL;
+}
+
+static void
+search_backfill_start(void)
+{
+	GList *indexes = NULL, *l;
+
+	for (l = purple_accounts_get_all(); l; l = l->next) {
+		char *dir = purple_log_get_log_dir(PURPLE_LOG_SYSTEM, ".system", l->data);
+		if (dir) {
+			char *account_dir = g_path_get_dirname(dir);
+			indexes = g_list_prepend(indexes, search_index_get(account_dir));
+			g_free(account_dir);
+			g_free(dir);
+		}
+	}
+
+	search_backfill_thread = g_thread_try_new("colornicks-search", search_backfill_func,
+	                                          indexes, NULL);
+	if (search_backfill_thread == NULL)
+		g_list_free(indexes);
+}
+
+/* Returns the messages in index that contain every token of query, as a
+ * list of ColorNicksSearchHit in log and offset order. */
+static GList *
+search_index_query(SearchIndex *index, const char *query)
+{
+	GPtrArray *tokens = g_ptr_array_new_with_free_func(g_free);
+	GArray *result = NULL;
+	GList *hits = NULL, *l, *next;
+	char *checked = NULL;
+	gboolean exists = FALSE;
+	guint i, j, k, n;
+
+	search_tokenize(query, tokens);
+	if (tokens->len == 0) {
+		g_ptr_array_free(tokens, TRUE);
+		return NULL;
+	}
+
+	g_mutex_lock(&search_lock);
+	search_index_load_locked(index);
+
+	for (i = 0; i < tokens->len; i++) {
+		GArray *journal = g_hash_table_lookup(index->tokens, tokens->pdata[i]);
+		GArray *postings = g_array_new(FALSE, FALSE, sizeof(SearchPosting));
+
+		if (index->segment)
+			search_segment_lookup(g_mapped_file_get_contents(index->segment),
+			                      g_mapped_file_get_length(index->segment),
+			                      tokens->pdata[i], postings);
+		if (journal)
+			g_array_append_vals(postings, journal->data, journal->len);
+		search_postings_sort(postings);
+
+		if (result == NULL) {
+			result = postings;
+			if (result->len == 0)
+				break;
+			continue;
+		}
+
+		/* Intersect the two sorted lists in place. */
+		for (j = k = n = 0; j < result->len && k < postings->len; ) {
+			int cmp = search_posting_cmp(&g_array_index(result, SearchPosting, j),
+			                             &g_array_index(postings, SearchPosting, k));
+			if (cmp < 0)
+				j++;
+			else if (cmp > 0)
+				k++;
+			else {
+				g_array_index(result, SearchPosting, n++) = g_array_index(result, SearchPosting, j);
+				j++;
+				k++;
+			}
+		}
+		g_array_set_size(result, n);
+		g_array_free(postings, TRUE);
+		if (result->len == 0)
+			break;
+	}
+
+	for (i = result ? result->len : 0; i-- > 0; ) {
+		SearchPosting *posting = &g_array_index(result, SearchPosting, i);
+		const char *relpath = posting->file < index->files->len ?
+			g_ptr_array_index(index->files, posting->file) : NULL;
+		ColorNicksSearchHit *hit;
+
+		/* Removed logs. */
+		if (relpath == NULL)
+			continue;
+
+		hit = g_new(ColorNicksSearchHit, 1);
+		hit->path = g_build_filename(index->dir, relpath, NULL);
+		hit->offset = posting->offset;
+		hits = g_list_prepend(hits, hit);
+	}
+	g_mutex_unlock(&search_lock);
+
+	if (result)
+		g_array_free(result, TRUE);
+	g_ptr_array_free(tokens, TRUE);
+
+	/* Logs may have been deleted by something other than us. */
+	for (l = hits; l; l = next) {
+		ColorNicksSearchHit *hit = l->data;
+
+		next = l->next;
+		if (checked == NULL || strcmp(checked, hit->path) != 0) {
+			g_free(checked);
+			checked = g_strdup(hit->path);
+			exists = g_file_test(checked, G_FILE_TEST_IS_REGULAR);
+		}
+		if (!exists) {
+			g_free(hit->path);
+			g_free(hit);
+			hits = g_list_delete_link(hits, l);
+		}
+	}
+	g_free(checked);
+
+	return hits;
+}
+
+static void
+search_flush(void)
+{
+	GHashTableIter iter;
+	SearchIndex *index;
+
+	if (search_indexes == NULL)
+		return;
+
+	g_mutex_lock(&search_lock);
+	g_hash_table_iter_init(&iter, search_indexes);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&index))
+		if (index->postings_out)
+			fflush(index->postings_out);
+	g_mutex_unlock(&search_lock);
+}
+
+/* IPC: collects the messages of account's logs matching every word of
+ * query as ColorNicksSearchHits in *hits. */
+static gboolean
+ipc_search(PurpleAccount *account, const char *query, GList **hits)
+{
+	char *dir, *account_dir;
+
+	*hits = NULL;
+	if (search_indexes == NULL || query == NULL)
+		return FALSE;
+
+	dir = purple_log_get_log_dir(PURPLE_LOG_SYSTEM, ".system", account);
+	if (dir == NULL)
+		return FALSE;
+
+	account_dir = g_path_get_dirname(dir);
+	*hits = search_index_query(search_index_get(account_dir), query);
+	g_free(account_dir);
+	g_free(dir);
+
+	return TRUE;
+}
+
+static void
+search_init(void)
+{
+	g_atomic_int_set(&search_cancel, 0);
+	search_merger = g_thread_pool_new(search_merge_func, NULL, 1, FALSE, NULL);
+	search_indexes = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, search_index_free);
+	if (search_enabled)
+		search_backfill_start();
+}
+
+/* A merge that is cut short is finished by the next session. */
+static void
+search_shutdown(void)
+{
+	g_atomic_int_set(&search_cancel, 1);
+	if (search_backfill_thread) {
+		g_thread_join(search_backfill_thread);
+		search_backfill_thread = NULL;
+	}
+	g_thread_pool_free(search_merger, FALSE, TRUE);
+	search_merger = NULL;
+
+	g_hash_table_destroy(search_indexes);
+	search_indexes = NULL;
+}
+
+/* Commits dirty logs on whichever thread owns them. */
+static void
+log_commit(PurpleAccount *account)
+{
+	if (async_write)
+		writer_push(WRITER_JOB_FLUSH, NULL, account, NULL, 0, NULL);
+	else
+		log_file_commit_all(account);
+	search_flush();
+#ifdef COLORNICKS_SQLITE
+	db_commit();
+#endif
+}
+
+static gboolean
+commit_timeout_cb(gpointer unused)
+{
+	log_commit(NULL);
+	return TRUE;
+}
+
+/* Under COMMIT_SIZE_THRESHOLD, compressed logs otherwise only commit once a
+ * frame fills up. The timer stops once a tick finds nothing written. */
+static gboolean
+frame_timeout_cb(gpointer unused)
+{
+	if (!frames_pending) {
+		commit_timer = 0;
+		return FALSE;
+	}
+
+	frames_pending = FALSE;
+	log_commit(NULL);
+	return TRUE;
+}
+
+/* Called on the main loop whenever a compressed log is written to. */
+static void
+frame_timer_arm(void)
+{
+	frames_pending = TRUE;
+	if (commit_timer == 0)
+		commit_timer = purple_timeout_add_seconds(FRAME_MAX_AGE, frame_timeout_cb, NULL);
+}
+
+static void
+commit_timer_update(void)
+{
+	if (commit_timer) {
+		purple_timeout_remove(commit_timer);
+		commit_timer = 0;
+	}
+
+	if (g_atomic_int_get(&commit_policy) == COMMIT_TIME_WINDOW)
+		commit_timer = purple_timeout_add(MAX(g_atomic_int_get(&commit_interval), 10),
+		                                  commit_timeout_cb, NULL);
+	else if (g_atomic_int_get(&commit_policy) == COMMIT_SIZE_THRESHOLD && frames_pending)
+		commit_timer = purple_timeout_add_seconds(FRAME_MAX_AGE, frame_timeout_cb, NULL);
+}
+
+static void
+signed_off_cb(PurpleConnection *gc)
+{
+	log_commit(purple_connection_get_account(gc));
+}
+
+static void
+commit_prefs_cb(const char *name, PurplePrefType type, gconstpointer val, gpointer data)
+{
+	g_atomic_int_set(&commit_policy, purple_prefs_get_int("/plugins/gtk/colornicks_logger/commit_policy"));
+	g_atomic_int_set(&commit_interval, purple_prefs_get_int("/plugins/gtk/colornicks_logger/commit_interval"));
+	g_atomic_int_set(&commit_size, purple_prefs_get_int("/plugins/gtk/colornicks_logger/commit_size"));
+	g_atomic_int_set(&sync_interval, purple_prefs_get_int("/plugins/gtk/colornicks_logger/sync_interval"));
+	g_atomic_int_set(&max_open_logs, purple_prefs_get_int("/plugins/gtk/colornicks_logger/max_open_logs"));
+
+	/* Whatever was pending under the old policy goes out now. */
+	log_commit(NULL);
+	commit_timer_update();
+}
+
+static void
+segment_prefs_cb(const char *name, PurplePrefType type, gconstpointer val, gpointer data)
+{
+	segment_size = purple_prefs_get_int("/plugins/gtk/colornicks_logger/segment_size");
+	segment_age = purple_prefs_get_int("/plugins/gtk/colornicks_logger/segment_age");
+}
+
+/* Nick colors.
+ * Working out a nick's color means reading the webview style, a few
+ * luminance computations and a string format, and the answer only changes
+ * with the theme or the palette. Every conversation keeps the style factors
+ * and the formatted color of each palette entry it has used, so looking up
+ * a nick afterwards is just a hash. */
+typedef struct {
+	GtkWidget *webview;  /* weak; NULL once the widget is gone */
+	gulong style_handler;
+	GArray *palette;     /* the gtkconv->nick_colors this was computed for */
+	guint palette_len;
+	gboolean have_style;
+	float base_factor;   /* 1 - L(base) / L(white) */
+	float white_lum;     /* L(white) */
+	char (*hex)[8];      /* "#rrggbb" per palette entry, empty until used */
+} NickColorCache;
+
+static void
+nick_color_cache_invalidate(NickColorCache *cache)
+{
+	cache->have_style = FALSE;
+	if (cache->hex)
+		memset(cache->hex, 0, cache->palette_len * sizeof(*cache->hex));
+}
+
+static void
+nick_color_style_updated_cb(GtkWidget *webview, NickColorCache *cache)
+{
+	nick_color_cache_invalidate(cache);
+}
+
+static void
+nick_color_cache_free(PurpleConversation *conv)
+{
+	NickColorCache *cache = purple_conversation_get_data(conv, "colornicks-nick-colors");
+
+	if (cache == NULL)
+		return;
+
+	if (cache->webview) {
+		g_signal_handler_disconnect(cache->webview, cache->style_handler);
+		g_object_remove_weak_pointer(G_OBJECT(cache->webview), (gpointer *)&cache->webview);
+	}
+	g_free(cache->hex);
+	g_free(cache);
+
+	purple_conversation_set_data(conv, "colornicks-nick-colors", NULL);
+}
+
+/* Returns NULL once the conversation is being deleted: its logs may still be
+ * flushed then, and a cache made now would never be freed. */
+static NickColorCache *
+nick_color_cache_get(PurpleConversation *conv, PidginConversation *gtkconv)
+{
+	NickColorCache *cache = purple_conversation_get_data(conv, "colornicks-nick-colors");
+
+	if (cache == NULL) {
+		if (purple_conversation_get_data(conv, "colornicks-deleting"))
+			return NULL;
+
+		cache = g_new0(NickColorCache, 1);
+		purple_conversation_set_data(conv, "colornicks-nick-colors", cache);
+	}
+
+	if (cache->webview != gtkconv->webview) {
+		if (cache->webview) {
+			g_signal_handler_disconnect(cache->webview, cache->style_handler);
+			g_object_remove_weak_pointer(G_OBJECT(cache->webview), (gpointer *)&cache->webview);
+		}
+		cache->webview = gtkconv->webview;
+		g_object_add_weak_pointer(G_OBJECT(cache->webview), (gpointer *)&cache->webview);
+		cache->style_handler = g_signal_connect(G_OBJECT(cache->webview), "style-updated",
+		                                        G_CALLBACK(nick_color_style_updated_cb), cache);
+		nick_color_cache_invalidate(cache);
+	}
+
+	if (cache->palette != gtkconv->nick_colors || cache->palette_len != gtkconv->nick_colors->len) {
+		cache->palette = gtkconv->nick_colors;
+		cache->palette_len = gtkconv->nick_colors->len;
+		g_free(cache->hex);
+		cache->hex = g_malloc0(cache->palette_len * sizeof(*cache->hex));
+	}
+
+	if (!cache->have_style) {
+		GtkStyle *style = gtk_widget_get_style(gtkconv->webview);
+		cache->base_factor = (1-(LUMINANCE(style->base[GTK_STATE_NORMAL]) / LUMINANCE(style->white)));
+		cache->white_lum = LUMINANCE(style->white);
+		cache->have_style = TRUE;
+	}
+
+	return cache;
+}
+
+/* Formats palette color col for a webview with the given style factors. */
+static void
+nick_color_format(GdkColor col, float base_factor, float white_lum, char hex[8])
+{
+	float scale = base_factor * (white_lum/MAX(MAX(col.red, col.blue), col.green));
+
+	/* The colors are chosen to look fine on white; we should never have to darken */
+	if (scale > 1) {
+		col.red   *= scale;
+		col.green *= scale;
+		col.blue  *= scale;
+	}
+
+	g_snprintf(hex, 8, "#%02x%02x%02x",
+	           (col.red >> 8), (col.green >> 8), (col.blue >> 8));
+}
+
+/* The returned string belongs to the conversation; do not free it. */
+static const char *
+get_nick_color(PurpleConversation *conv, const char *name)
+{
+	PidginConversation *gtkconv;
+	NickColorCache *cache;
+	guint index;
+
+	if (conv == NULL)
+		return NULL;
+
+	gtkconv = PIDGIN_CONVERSATION(conv);
+	g_return_val_if_fail(name != NULL && gtkconv != NULL && gtkconv->nick_colors != NULL, NULL);
+	g_return_val_if_fail(gtkconv->nick_colors->len > 0, NULL);
+
+	if ((cache = nick_color_cache_get(conv, gtkconv)) == NULL)
+		return NULL;
+	index = g_str_hash(name) % cache->palette_len;
+	if (cache->hex[index][0] != '\0')
+		return cache->hex[index];
+
+	nick_color_format(g_array_index(gtkconv->nick_colors, GdkColor, index),
+	                  cache->base_factor, cache->white_lum, cache->hex[index]);
+	return cache->hex[index];
+}
+
+static void
+deleting_conv_cb(PurpleConversation *conv)
+{
+	nick_color_cache_free(conv);
+	purple_conversation_set_data(conv, "colornicks-deleting", GINT_TO_POINTER(TRUE));
+}
+
+/* Shared image store.
+ * Inline images are saved once, named by their content hash, in a directory
+ * shared by every colornicks log, and log lines refer to them by relative
+ * path. The store remembers which images it already has, so a repeated
+ * sticker costs neither a hash nor a stat, and new images are written out
+ * by a small thread pool. */
+
+#define IMAGE_STORE_DIR "colornicks-images"
+/* Log directories are logs/<protocol>/<account>/<buddy> */
+#define IMAGE_STORE_RELATIVE "../../../" IMAGE_STORE_DIR "/"
+
+typedef struct {
+	char *filename;
+	gpointer data;
+	gsize size;
+} ImageWriteJob;
+
+static char *image_store_path = NULL;
+static GThreadPool *image_store_pool = NULL;
+static GHashTable *image_store_ids = NULL;    /* imgstore id -> filename, once stored */
+static GMutex image_store_lock;
+static GHashTable *image_store_known = NULL;  /* filename -> IMAGE_PENDING or IMAGE_STORED */
+
+enum {
+	IMAGE_PENDING = 1,   /* being written */
+	IMAGE_STORED
+};
+
+static void
+image_store_write_func(gpointer data, gpointer unused)
+{
+	ImageWriteJob *job = data;
+	char *path = g_build_filename(image_store_path, job->filename, NULL);
+	char *tmp = g_strconcat(path, ".part", NULL);
+	FILE *image_file;
+	gboolean ok = FALSE;
+
+	/* Write to a temporary name first so a half-written image never
+	 * shows up under its final one. */
+	if ((image_file = g_fopen(tmp, "wb")) != NULL) {
+		ok = fwrite(job->data, job->size, 1, image_file) == 1;
+		if (fclose(image_file) != 0)
+			ok = FALSE;
+
+		if (ok && g_rename(tmp, path) != 0)
+			ok = FALSE;
+
+		if (!ok) {
+			thread_debug_error("Error writing %s: %s\n", path, g_strerror(errno));
+
+			/* Attempt to not leave half-written files around. */
+			g_unlink(tmp);
+		}
+	} else {
+		thread_debug_error("Unable to create file %s: %s\n", tmp, g_strerror(errno));
+	}
+
+	/* On failure, let the next message carrying this image try again. */
+	g_mutex_lock(&image_store_lock);
+	if (ok)
+		g_hash_table_replace(image_store_known, g_strdup(job->filename),
+		                     GINT_TO_POINTER(IMAGE_STORED));
+	else
+		g_hash_table_remove(image_store_known, job->filename);
+	g_mutex_unlock(&image_store_lock);
+
+	g_free(tmp);
+	g_free(path);
+	g_free(job->filename);
+	g_free(job->data);
+	g_free(job);
+}
+
+static void
+image_store_init(void)
+{
+	GDir *dir;
+
+	if (image_store_path != NULL)
+		return;
+
+	image_store_path = g_build_filename(purple_user_dir(), "logs", IMAGE_STORE_DIR, NULL);
+	purple_build_dir(image_store_path, S_IRUSR | S_IWUSR | S_IXUSR);
+
+	image_store_ids = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	image_store_known = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	/* One directory scan per session instead of a stat per image. */
+	if ((dir = g_dir_open(image_store_path, 0, NULL)) != NULL) {
+		const char *name;
+
+		while ((name = g_dir_read_name(dir)) != NULL)
+			if (!g_str_has_suffix(name, ".part"))
+				g_hash_table_insert(image_store_known, g_strdup(name),
+				                    GINT_TO_POINTER(IMAGE_STORED));
+		g_dir_close(dir);
+	}
+
+	image_store_pool = g_thread_pool_new(image_store_write_func, NULL, 2, FALSE, NULL);
+}
+
+/* Waits for every pending image to be written. */
+static void
+image_store_shutdown(void)
+{
+	if (image_store_path == NULL)
+		return;
+
+	g_thread_pool_free(image_store_pool, FALSE, TRUE);
+	image_store_pool = NULL;
+
+	g_hash_table_destroy(image_store_ids);
+	image_store_ids = NULL;
+	g_hash_table_destroy(image_store_known);
+	image_store_known = NULL;
+
+	g_free(image_store_path);
+	image_store_path = NULL;
+}
+
+/* Returns the store filename for the image, which must be g_free()d, or
+ * NULL if there is no such image. */
+static char *
+image_store_add(int imgid)
+{
+	PurpleStoredImage *image;
+	char *filename;
+	int state;
+
+	image_store_init();
+
+	filename = g_hash_table_lookup(image_store_ids, GINT_TO_POINTER(imgid));
+	if (filename != NULL)
+		return g_strdup(filename);
+
+	image = purple_imgstore_find_by_id(imgid);
+	if (image == NULL)
+		return NULL;
+
+	filename = purple_util_get_image_filename(purple_imgstore_get_data(image),
+	                                          purple_imgstore_get_size(image));
+
+	g_mutex_lock(&image_store_lock);
+	state = GPOINTER_TO_INT(g_hash_table_lookup(image_store_known, filename));
+	if (state == 0)
+		g_hash_table_insert(image_store_known, g_strdup(filename),
+		                    GINT_TO_POINTER(IMAGE_PENDING));
+	g_mutex_unlock(&image_store_lock);
+
+	if (state == 0) {
+		ImageWriteJob *job = g_new(ImageWriteJob, 1);
+		job->filename = g_strdup(filename);
+		job->size = purple_imgstore_get_size(image);
+		job->data = g_malloc(job->size);
+		memcpy(job->data, purple_imgstore_get_data(image), job->size);
+		g_thread_pool_push(image_store_pool, job, NULL);
+	}
+
+	/* Only remember the id once the image is on disk, so a failed write is
+	 * retried by the next message that carries it. */
+	if (state == IMAGE_STORED)
+		g_hash_table_insert(image_store_ids, GINT_TO_POINTER(imgid), g_strdup(filename));
+
+	return filename;
+}
+
+/* NOTE: This can return msg (which you may or may not want to g_free())
+ * NOTE: or a newly allocated string which you MUST g_free(). */
+static char *
+convert_image_tags(const char *msg, guint *images)
+{
+	const char *tmp;
+	const char *start;
+	const char *end;
+	GData *attributes;
+	GString *newmsg = NULL;
+
+	tmp = msg;
+
+	while (purple_markup_find_tag("img", tmp, &start, &end, &attributes)) {
+		int imgid = 0;
+		char *idstr = NULL;
+
+		if (newmsg == NULL)
+			newmsg = g_string_new("");
+
+		/* copy any text before the img tag */
+		if (tmp < start)
+			g_string_append_len(newmsg, tmp, start - tmp);
+
+		if ((idstr = g_datalist_get_data(&attributes, "id")) != NULL)
+			imgid = atoi(idstr);
+		g_datalist_clear(&attributes);
+
+		if (imgid != 0)
+		{
+			char *filename = image_store_add(imgid);
+
+			if (filename == NULL)
+			{
+				/* This should never happen. */
+				/* This *does* happen for failed Direct-IMs -DAA */
+				g_string_free(newmsg, TRUE);
+				g_return_val_if_reached((char *)msg);
+			}
+
+			/* Write the new image tag */
+			g_string_append_printf(newmsg, "<IMG SRC=\"" IMAGE_STORE_RELATIVE "%s\">", filename);
+			g_free(filename);
+			(*images)++;
+		}
+
+		/* Continue from the end of the tag */
+		tmp = end + 1;
+	}
+
+	if (newmsg == NULL)
+	{
+		/* No images were found to change. */
+		return (char *)msg;
+	}
+
+	/* Append any remaining message data */
+	g_string_append(newmsg, tmp);
+
+	return g_string_free(newmsg, FALSE);
+}
+
+/* Whether a line logged now for when shows the date, as html_logger_write()
+ * decides it. */
+static gboolean
+log_show_date(PurpleLog *log, time_t when)
+{
+	return (log->type == PURPLE_LOG_SYSTEM) || (time(NULL) > when + 20*60);
+}
+
+/* Lines logged within the same second share a timestamp, so each log keeps
+ * the last one it rendered and only asks again when the second or show_date
+ * changes. That includes the answer of any "log-timestamp" handler, which is
+ * given nothing else to go on. The string belongs to the log. */
+static const char *
+log_get_timestamp(PurpleLog *log, TimestampCache *cache, time_t when, gboolean show_date)
+{
+	char *date;
+	struct tm tm;
+
+	if (cache->time == (gint64)when && cache->show_date == show_date)
+		return cache->str->str;
+
+	cache->time = when;
+	cache->show_date = show_date;
+
+	date = purple_signal_emit_return_1(purple_log_get_handle(),
+	                          "log-timestamp",
+	                          log, when, show_date);
+	if (date != NULL) {
+		g_string_assign(cache->str, date);
+		g_free(date);
+		return cache->str->str;
+	}
+
+	localtime_r(&when, &tm);
+	if (show_date)
+		g_string_assign(cache->str, purple_date_format_long(&tm));
+	else
+		g_string_assign(cache->str, purple_time_format(&tm));
+	return cache->str->str;
+}
+
+/* Line templates.
+ * Every kind of message has a printf-style format with only %s conversions,
+ * and the fields that fill them in. compile_templates() splits the formats
+ * into literal runs once, so a line is rendered by appending the runs and
+ * fields to a reused buffer; the output matches what fprintf used to write
+ * byte for byte. */
+typedef enum {
+	FIELD_DATE,
+	FIELD_MESSAGE,
+	FIELD_NICK,
+	FIELD_COLOR
+} LineField;
+
+#define TEMPLATE_MAX_FIELDS 4
+
+typedef struct {
+	const char *format;
+	guint n_fields;
+	LineField fields[TEMPLATE_MAX_FIELDS];
+	const char *default_color;  /* for FIELD_COLOR when the nick has no color */
+
+	/* Filled in by compile_templates() */
+	const char *literals[TEMPLATE_MAX_FIELDS + 1];
+	gsize literal_lens[TEMPLATE_MAX_FIELDS + 1];
+} LineTemplate;
+
+enum {
+	TEMPLATE_SYSTEM_LOG,
+	TEMPLATE_SYSTEM,
+	TEMPLATE_RAW,
+	TEMPLATE_ERROR,
+	TEMPLATE_WHISPER_SEND,
+	TEMPLATE_WHISPER_RECV,
+	TEMPLATE_AUTO_RESP_SEND,
+	TEMPLATE_AUTO_RESP_RECV,
+	TEMPLATE_RECV_ME,
+	TEMPLATE_RECV,
+	TEMPLATE_SEND_ME,
+	TEMPLATE_SEND,
+	TEMPLATE_UNHANDLED,
+	TEMPLATE_COUNT
+};
+
+static LineTemplate templates[TEMPLATE_COUNT] = {
+	{ "---- %s @ %s ----<br/>\n",
+	  2, { FIELD_MESSAGE, FIELD_DATE }, NULL },
+	{ "<font size=\"2\">(%s)</font><b> %s</b><br/>\n",
+	  2, { FIELD_DATE, FIELD_MESSAGE }, NULL },
+	{ "<font size=\"2\">(%s)</font> %s<br/>\n",
+	  2, { FIELD_DATE, FIELD_MESSAGE }, NULL },
+	{ "<font color=\"#FF0000\"><font size=\"2\">(%s)</font><b> %s</b></font><br/>\n",
+	  2, { FIELD_DATE, FIELD_MESSAGE }, NULL },
+	{ "<font color=\"#6C2585\"><font size=\"2\">(%s)</font><b> %s &lt;whisper&gt;:</b></font> %s<br/>\n",
+	  3, { FIELD_DATE, FIELD_NICK, FIELD_MESSAGE }, NULL },
+	{ "<font color=\"%s\"><font size=\"2\">(%s)</font><b> %s &lt;whisper&gt;:</b></font> %s<br/>\n",
+	  4, { FIELD_COLOR, FIELD_DATE, FIELD_NICK, FIELD_MESSAGE }, "#6C2585" },
+	{ N_("<font color=\"#16569E\"><font size=\"2\">(%s)</font> <b>%s &lt;AUTO-REPLY&gt;:</b></font> %s<br/>\n"),
+	  3, { FIELD_DATE, FIELD_NICK, FIELD_MESSAGE }, NULL },
+	{ N_("<font color=\"%s\"><font size=\"2\">(%s)</font> <b>%s &lt;AUTO-REPLY&gt;:</b></font> %s<br/>\n"),
+	  4, { FIELD_COLOR, FIELD_DATE, FIELD_NICK, FIELD_MESSAGE }, "#A82F2F" },
+	{ "<font color=\"%s\"><font size=\"2\">(%s)</font> <b>***%s</b></font> %s<br/>\n",
+	  4, { FIELD_COLOR, FIELD_DATE, FIELD_NICK, FIELD_MESSAGE }, "#062585" },
+	{ "<font color=\"%s\"><font size=\"2\">(%s)</font> <b>%s:</b></font> %s<br/>\n",
+	  4, { FIELD_COLOR, FIELD_DATE, FIELD_NICK, FIELD_MESSAGE }, "#A82F2F" },
+	{ "<font color=\"#062585\"><font size=\"2\">(%s)</font> <b>***%s</b></font> %s<br/>\n",
+	  3, { FIELD_DATE, FIELD_NICK, FIELD_MESSAGE }, NULL },
+	{ "<font color=\"#16569E\"><font size=\"2\">(%s)</font> <b>%s:</b></font> %s<br/>\n",
+	  3, { FIELD_DATE, FIELD_NICK, FIELD_MESSAGE }, NULL },
+	{ "<font size=\"2\">(%s)</font><b> %s:</b></font> %s<br/>\n",
+	  3, { FIELD_DATE, FIELD_NICK, FIELD_MESSAGE }, NULL },
+};
+
+/* Splits format into the literal runs of tpl. Returns FALSE if it does not
+ * have a conversion for every field. */
+static gboolean
+template_split(LineTemplate *tpl, const char *format)
+{
+	const char *run = format;
+	guint n = 0;
+
+	for (;;) {
+		const char *conv = strstr(run, "%s");
+
+		if (conv == NULL || n == tpl->n_fields)
+			break;
+
+		tpl->literals[n] = run;
+		tpl->literal_lens[n] = conv - run;
+		run = conv + 2;
+		n++;
+	}
+
+	if (n != tpl->n_fields)
+		return FALSE;
+
+	tpl->literals[n] = run;
+	tpl->literal_lens[n] = strlen(run);
+	return TRUE;
+}
+
+static void
+compile_templates(void)
+{
+	int i;
+
+	for (i = 0; i < TEMPLATE_COUNT; i++) {
+		LineTemplate *tpl = &templates[i];
+
+		/* A translation that dropped a conversion would shift every field. */
+		if (!template_split(tpl, _(tpl->format))) {
+			purple_debug_warning("colornicks", "Ignoring broken translation of \"%s\"\n",
+			                     tpl->format);
+			template_split(tpl, tpl->format);
+		}
+	}
+}
+
+static gboolean
+template_has_field(const LineTemplate *tpl, LineField field)
+{
+	guint i;
+
+	for (i = 0; i < tpl->n_fields; i++)
+		if (tpl->fields[i] == field)
+			return TRUE;
+	return FALSE;
+}
+
+static void
+render_template(GString *line, const LineTemplate *tpl, const char *date,
+                const char *message, const char *nick, const char *color)
+{
+	const char *values[TEMPLATE_MAX_FIELDS];
+	guint i;
+
+	values[FIELD_DATE] = date;
+	values[FIELD_MESSAGE] = message;
+	values[FIELD_NICK] = nick;
+	values[FIELD_COLOR] = color ? color : tpl->default_color;
+
+	for (i = 0; i < tpl->n_fields; i++) {
+		g_string_append_len(line, tpl->literals[i], tpl->literal_lens[i]);
+		g_string_append(line, values[tpl->fields[i]]);
+	}
+	g_string_append_len(line, tpl->literals[i], tpl->literal_lens[i]);
+}
+
+/* Picks the template for a message. NOTE: This may strip a leading "/me "
+ * from msg_fixed, and returns NULL for messages that are not logged. */
+static const LineTemplate *
+select_template(PurpleLog *log, PurpleMessageFlags type, char *msg_fixed)
+{
+	if (log->type == PURPLE_LOG_SYSTEM)
+		return &templates[TEMPLATE_SYSTEM_LOG];
+
+	if (type & PURPLE_MESSAGE_SYSTEM)
+		return &templates[TEMPLATE_SYSTEM];
+	else if (type & PURPLE_MESSAGE_RAW)
+		return &templates[TEMPLATE_RAW];
+	else if (type & PURPLE_MESSAGE_ERROR)
+		return &templates[TEMPLATE_ERROR];
+	else if (type & PURPLE_MESSAGE_WHISPER) {
+		if (type & PURPLE_MESSAGE_SEND)
+			return &templates[TEMPLATE_WHISPER_SEND];
+		else
+			return &templates[TEMPLATE_WHISPER_RECV];
+	} else if (type & PURPLE_MESSAGE_AUTO_RESP) {
+		if (type & PURPLE_MESSAGE_SEND)
+			return &templates[TEMPLATE_AUTO_RESP_SEND];
+		else if (type & PURPLE_MESSAGE_RECV)
+			return &templates[TEMPLATE_AUTO_RESP_RECV];
+		return NULL;
+	} else if (type & PURPLE_MESSAGE_RECV) {
+		if (purple_message_meify(msg_fixed, -1))
+			return &templates[TEMPLATE_RECV_ME];
+		else
+			return &templates[TEMPLATE_RECV];
+	} else if (type & PURPLE_MESSAGE_SEND) {
+		if (purple_message_meify(msg_fixed, -1))
+			return &templates[TEMPLATE_SEND_ME];
+		else
+			return &templates[TEMPLATE_SEND];
+	}
+
+	purple_debug_error("log", "Unhandled message type.\n");
+	return &templates[TEMPLATE_UNHANDLED];
+}
+
+/* Same output as g_markup_escape_text(), without allocating for the
+ * common case of a nick with nothing that needs a numeric reference. */
+static void
+append_escaped(GString *str, const char *text)
+{
+	const guchar *p;
+
+	for (p = (const guchar *)text; *p; p++) {
+		if ((*p < 0x20 && *p != '\t' && *p != '\n' && *p != '\r') || *p == 0x7f ||
+		    (*p == 0xc2 && p[1] >= 0x80 && p[1] <= 0x9f)) {
+			char *escaped = g_markup_escape_text(text, -1);
+			g_string_append(str, escaped);
+			g_free(escaped);
+			return;
+		}
+	}
+
+	for (p = (const guchar *)text; *p; p++) {
+		switch (*p) {
+		case '&':
+			g_string_append_len(str, "&amp;", 5);
+			break;
+		case '<':
+			g_string_append_len(str, "&lt;", 4);
+			break;
+		case '>':
+			g_string_append_len(str, "&gt;", 4);
+			break;
+		case '\'':
+			g_string_append_len(str, "&#39;", 5);
+			break;
+		case '"':
+			g_string_append_len(str, "&quot;", 6);
+			break;
+		default:
+			g_string_append_c(str, *p);
+			break;
+		}
+	}
+}
+
+/* Returns whether text has no '<' or '&', and so nothing that
+ * convert_image_tags() or purple_markup_html_to_xhtml() would change. */
+static gboolean
+text_is_plain(const char *text)
+{
+	const char *p = text;
+	/* AddressSanitizer cannot tell that reading past the terminator is safe. */
+#if defined(__SSE2__) && !defined(__SANITIZE_ADDRESS__)
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i nul = _mm_setzero_si128();
+
+	/* Aligned loads never cross into the next page, so reading the rest of
+	 * the block holding the terminator is safe. */
+	for (; ((guintptr)p & 15) != 0; p++) {
+		if (*p == '\0')
+			return TRUE;
+		if (*p == '<' || *p == '&')
+			return FALSE;
+	}
+
+	for (;; p += 16) {
+		__m128i block = _mm_load_si128((const __m128i *)p);
+		int special = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, lt),
+		                                             _mm_cmpeq_epi8(block, amp)));
+		int end = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nul));
+
+		if (end) {
+			/* Only what comes before the terminator counts. */
+			return (special & ((end & -end) - 1)) == 0;
+		}
+		if (special)
+			return FALSE;
+	}
+#else
+	for (; *p; p++)
+		if (*p == '<' || *p == '&')
+			return FALSE;
+	return TRUE;
+#endif
+}
+
+/* Whether message can be logged as it is, skipping the markup passes. The
+ * output is the same either way. A message that may start with "/me " goes
+ * the long way, since select_template() rewrites those. */
+static gboolean
+message_is_plain(const char *message)
+{
+	const char *p = message;
+
+	while (g_ascii_isspace(*p))
+		p++;
+	if (*p == '/')
+		return FALSE;
+
+	return text_is_plain(p);
+}
+
+/* Returns message as XHTML with its images in the image store.
+ * NOTE: This returns message itself when there is nothing to change, and
+ * otherwise a newly allocated string which you MUST g_free(). */
+static char *
+prepare_message(const char *message, LoggerStats *stats)
+{
+	char *image_corrected_msg;
+	char *msg_fixed;
+	guint images = 0;
+	STATS_DECLARE(start)
+
+	/* select_template() leaves messages without "/me " alone. */
+	if (message_is_plain(message))
+		return (char *)message;
+
+	STATS_START(start);
+	image_corrected_msg = convert_image_tags(message, &images);
+	STATS_STOP(stats, STAGE_IMAGES, start);
+	STATS_ADD(stats, images, images);
+
+	STATS_START(start);
+	purple_markup_html_to_xhtml(image_corrected_msg, &msg_fixed, NULL);
+	STATS_STOP(stats, STAGE_XHTML, start);
+
+	/* Yes, this breaks encapsulation.  But it's a static function and
+	 * this saves a needless strdup(). */
+	if (image_corrected_msg != message)
+		g_free(image_corrected_msg);
+
+	return msg_fixed;
+}
+
+/* Binary logs; see BINARY_MAGIC. */
+
+static gboolean
+log_is_binary(const char *path)
+{
+	return g_str_has_suffix(path, BINARY_EXT);
+}
+
+/* Appends a record of kind to line, with head and tail as its payload. */
+static void
+binary_append_record(GString *line, guint32 kind, const void *head, gsize head_len,
+                     const char *tail, gsize tail_len)
+{
+	BinaryRecord record;
+
+	record.length = GUINT32_TO_LE(head_len + tail_len);
+	record.kind = GUINT32_TO_LE(kind);
+	g_string_append_len(line, (const char *)&record, sizeof(record));
+	g_string_append_len(line, head, head_len);
+	g_string_append_len(line, tail, tail_len);
+}
+
+static void
+binary_append_message(GString *line, time_t when, PurpleMessageFlags type, gboolean show_date,
+                      guint32 nick, const char *body)
+{
+	BinaryMessage msg;
+
+	msg.time = GINT64_TO_LE((gint64)when);
+	msg.flags = GUINT32_TO_LE((guint32)type | (show_date ? LOG_FLAG_SHOW_DATE : 0));
+	msg.nick = GUINT32_TO_LE(nick);
+	binary_append_record(line, BINARY_MESSAGE, &msg, sizeof(msg), body, strlen(body));
+}
+
+/* Returns the dictionary entry of the nick in extra->nick. The first time a
+ * nick speaks in a log, its color is worked out and a record of it goes to
+ * line ahead of the message. */
+static const BinaryNick *
+binary_nick_get(ColorNicksLogData *extra, PurpleConversation *conv, GString *line)
+{
+	BinaryNick *nick = g_hash_table_lookup(extra->nick_ids, extra->nick->str);
+	BinaryNick record;
+	const char *color;
+
+	if (nick)
+		return nick;
+
+	nick = g_new0(BinaryNick, 1);
+	nick->id = g_hash_table_size(extra->nick_ids) + 1;
+	if ((color = get_nick_color(conv, extra->nick->str)) != NULL)
+		g_strlcpy(nick->color, color, sizeof(nick->color));
+	g_hash_table_insert(extra->nick_ids, g_strdup(extra->nick->str), nick);
+
+	record = *nick;
+	record.id = GUINT32_TO_LE(nick->id);
+	binary_append_record(line, BINARY_NICK, &record, sizeof(record),
+	                     extra->nick->str, extra->nick->len);
+	return nick;
+}
+
+/* Returns the payload of the record at *pos in a binary log, along with its
+ * kind and length, and moves *pos past it. Returns NULL at the end of the
+ * log or at a record cut short by a crash. */
+static const char *
+binary_log_next(const char *contents, gsize len, gsize *pos, guint32 *kind, guint32 *length)
+{
+	BinaryRecord record;
+	const char *payload;
+
+	if (len - *pos < sizeof(record))
+		return NULL;
+
+	memcpy(&record, contents + *pos, sizeof(record));
+	*kind = GUINT32_FROM_LE(record.kind);
+	*length = GUINT32_FROM_LE(record.length);
+	if (len - *pos - sizeof(record) < *length)
+		return NULL;
+
+	payload = contents + *pos + sizeof(record);
+	*pos += sizeof(record) + *length;
+	return payload;
+}
+
+/* Reads a nick record in host order, with its color NUL-terminated. */
+static gboolean
+binary_nick_parse(const char *payload, guint32 length, BinaryNick *nick,
+                  const char **name, gsize *name_len)
+{
+	if (length < sizeof(*nick))
+		return FALSE;
+
+	memcpy(nick, payload, sizeof(*nick));
+	nick->id = GUINT32_FROM_LE(nick->id);
+	nick->color[sizeof(nick->color) - 1] = '\0';
+	*name = payload + sizeof(*nick);
+	*name_len = length - sizeof(*nick);
+	return TRUE;
+}
+
+/* Fills the dictionary of a binary log that is being appended to with the
+ * nicks it already has. */
+static void
+binary_nicks_load(ColorNicksLogData *extra, const char *path)
+{
+	GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+	const char *contents, *payload, *name;
+	gsize len, pos = BINARY_MAGIC_LEN, name_len;
+	guint32 kind, length;
+	BinaryNick nick, *copy;
+
+	if (mapped == NULL)
+		return;
+
+	contents = g_mapped_file_get_contents(mapped);
+	len = g_mapped_file_get_length(mapped);
+	if (len >= BINARY_MAGIC_LEN) {
+		while ((payload = binary_log_next(contents, len, &pos, &kind, &length)) != NULL) {
+			if (kind == BINARY_NICK && binary_nick_parse(payload, length, &nick, &name, &name_len)) {
+				copy = g_new(BinaryNick, 1);
+				*copy = nick;
+				g_hash_table_replace(extra->nick_ids, g_strndup(name, name_len), copy);
+			}
+		}
+	}
+
+	g_mapped_file_unref(mapped);
+}
+
+/* A binary log being read a message at a time. */
+typedef struct {
+	const char *contents;
+	gsize len;
+	gsize pos;
+	GHashTable *nicks;  /* id -> BinaryNickName */
+} BinaryReader;
+
+typedef struct {
+	char *name;         /* escaped */
+	char color[8];
+} BinaryNickName;
+
+static void
+binary_nick_name_free(gpointer data)
+{
+	BinaryNickName *nick = data;
+
+	g_free(nick->name);
+	g_free(nick);
+}
+
+/* Returns FALSE if contents is not a binary log. */
+static gboolean
+binary_reader_init(BinaryReader *reader, const char *contents, gsize len)
+{
+	if (len < BINARY_MAGIC_LEN || memcmp(contents, BINARY_MAGIC, BINARY_MAGIC_LEN) != 0)
+		return FALSE;
+
+	reader->contents = contents;
+	reader->len = len;
+	reader->pos = BINARY_MAGIC_LEN;
+	reader->nicks = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+	                                      NULL, binary_nick_name_free);
+	return TRUE;
+}
+
+static void
+binary_reader_clear(BinaryReader *reader)
+{
+	g_hash_table_destroy(reader->nicks);
+}
+
+/* Reads the next message, in host order, and where its record starts. body
+ * is not NUL-terminated, and nick is NULL for messages without a sender.
+ * Returns FALSE at the end of the log. */
+static gboolean
+binary_reader_next(BinaryReader *reader, gsize *offset, BinaryMessage *msg,
+                   const char **body, gsize *body_len, const BinaryNickName **nick)
+{
+	const char *payload, *name;
+	guint32 kind, length;
+	gsize start, name_len;
+	BinaryNick record;
+
+	for (;;) {
+		start = reader->pos;
+		payload = binary_log_next(reader->contents, reader->len, &reader->pos, &kind, &length);
+		if (payload == NULL)
+			return FALSE;
+
+		if (kind == BINARY_NICK && binary_nick_parse(payload, length, &record, &name, &name_len)) {
+			BinaryNickName *entry = g_new0(BinaryNickName, 1);
+
+			entry->name = g_strndup(name, name_len);
+			memcpy(entry->color, record.color, sizeof(entry->color));
+			g_hash_table_replace(reader->nicks, GUINT_TO_POINTER(record.id), entry);
+		} else if (kind == BINARY_MESSAGE && length >= sizeof(*msg)) {
+			memcpy(msg, payload, sizeof(*msg));
+			msg->time = GINT64_FROM_LE(msg->time);
+			msg->flags = GUINT32_FROM_LE(msg->flags);
+			msg->nick = GUINT32_FROM_LE(msg->nick);
+
+			*offset = start;
+			*body = payload + sizeof(*msg);
+			*body_len = length - sizeof(*msg);
+			*nick = msg->nick ? g_hash_table_lookup(reader->nicks, GUINT_TO_POINTER(msg->nick)) : NULL;
+			return TRUE;
+		}
+		/* Anything else is from a later version, and skipped. */
+	}
+}
+
+/* Renders a binary log as the lines colornicks_logger_write() would have
+ * written for it. Returns NULL if contents is not a binary log. */
+static char *
+binary_log_render(PurpleLog *log, const char *contents, gsize len)
+{
+	TimestampCache stamp = { NULL, G_MININT64, FALSE };
+	const BinaryNickName *nick;
+	BinaryReader reader;
+	BinaryMessage msg;
+	const char *body;
+	gsize body_len, offset;
+	GString *out;
+
+	if (!binary_reader_init(&reader, contents, len))
+		return NULL;
+
+	stamp.str = g_string_sized_new(32);
+	out = g_string_sized_new(len);
+
+	while (binary_reader_next(&reader, &offset, &msg, &body, &body_len, &nick)) {
+		char *text = g_strndup(body, body_len);
+		const LineTemplate *tpl = select_template(log, msg.flags & ~LOG_FLAG_SHOW_DATE, text);
+		gboolean show_date = (msg.flags & LOG_FLAG_SHOW_DATE) || log->type == PURPLE_LOG_SYSTEM;
+
+		if (tpl)
+			render_template(out, tpl, log_get_timestamp(log, &stamp, msg.time, show_date), text,
+			                nick ? nick->name : "",
+			                nick && *nick->color ? nick->color : NULL);
+		g_free(text);
+	}
+
+	binary_reader_clear(&reader);
+	g_string_free(stamp.str, TRUE);
+
+	return g_string_free(out, FALSE);
+}
+
+/* Log summaries.
+ * Next to every log.htm we keep log.htm.summary, a key file with what a log
+ * listing wants to show without reading the log: how many messages it has,
+ * when the first and last were logged, who spoke (and in what color, for
+ * received lines) and its size. colornicks_logger_write() keeps the counts
+ * as it goes and finalize saves them. A summary is only trusted while its
+ * size matches the log's; any other summary, or a missing one after a
+ * crash, is rebuilt from the log the first time it is asked for. */
+
+#define SUMMARY_SUFFIX ".summary"
+
+/* What the "summary-get" IPC call hands back. Free both lists with
+ * g_strfreev() and the summary with g_free(). */
+typedef struct _ColorNicksLogSummary {
+	guint messages;
+	time_t first;        /* 0 if there are no messages */
+	time_t last;
+	guint64 size;        /* of the HTML, also for compressed logs */
+	char **speakers;     /* NULL-terminated, sorted */
+	char **colors;       /* "#rrggbb" per speaker, or "" for sent lines */
+} ColorNicksLogSummary;
+
+static void
+log_summary_free(ColorNicksLogSummary *summary)
+{
+	g_strfreev(summary->speakers);
+	g_strfreev(summary->colors);
+	g_free(summary);
+}
+
+/* The current size of the HTML in the log at path, or -1. */
+static gint64
+log_html_size(const char *path)
+{
+	struct stat st;
+
+	if (g_str_has_suffix(path, COMPRESSED_EXT))
+		return log_logical_size(path);
+	if (g_stat(path, &st) != 0)
+		return -1;
+	return st.st_size;
+}
+
+static void
+log_summary_save(const char *path, const ColorNicksLogSummary *summary)
+{
+	GKeyFile *keyfile = g_key_file_new();
+	char *summary_path = g_strconcat(path, SUMMARY_SUFFIX, NULL);
+	char *contents;
+	gsize len;
+
+	g_key_file_set_integer(keyfile, "summary", "messages", summary->messages);
+	g_key_file_set_int64(keyfile, "summary", "first", summary->first);
+	g_key_file_set_int64(keyfile, "summary", "last", summary->last);
+	g_key_file_set_uint64(keyfile, "summary", "size", summary->size);
+	g_key_file_set_string_list(keyfile, "summary", "speakers",
+	                           (const gchar * const *)summary->speakers,
+	                           g_strv_length(summary->speakers));
+	g_key_file_set_string_list(keyfile, "summary", "colors",
+	                           (const gchar * const *)summary->colors,
+	                           g_strv_length(summary->colors));
+
+	contents = g_key_file_to_data(keyfile, &len, NULL);
+	if (!g_file_set_contents(summary_path, contents, len, NULL))
+		thread_debug_error("Unable to write summary %s\n", summary_path);
+
+	g_free(contents);
+	g_free(summary_path);
+	g_key_file_free(keyfile);
+}
+
+/* Returns the saved summary of the log at path, or NULL if there is none
+ * or it no longer matches the log. */
+static ColorNicksLogSummary *
+log_summary_load(const char *path)
+{
+	GKeyFile *keyfile = g_key_file_new();
+	char *summary_path = g_strconcat(path, SUMMARY_SUFFIX, NULL);
+	ColorNicksLogSummary *summary = NULL;
+	gsize n_speakers, n_colors;
+
+	if (g_key_file_load_from_file(keyfile, summary_path, G_KEY_FILE_NONE, NULL) &&
+	    (gint64)g_key_file_get_uint64(keyfile, "summary", "size", NULL) == log_html_size(path)) {
+		summary = g_new0(ColorNicksLogSummary, 1);
+		summary->messages = g_key_file_get_integer(keyfile, "summary", "messages", NULL);
+		summary->first = g_key_file_get_int64(keyfile, "summary", "first", NULL);
+		summary->last = g_key_file_get_int64(keyfile, "summary", "last", NULL);
+		summary->size = g_key_file_get_uint64(keyfile, "summary", "size", NULL);
+		summary->speakers = g_key_file_get_string_list(keyfile, "summary", "speakers",
+		                                               &n_speakers, NULL);
+		summary->colors = g_key_file_get_string_list(keyfile, "summary", "colors",
+		                                             &n_colors, NULL);
+		if (summary->speakers == NULL || summary->colors == NULL || n_speakers != n_colors) {
+			log_summary_free(summary);
+			summary = NULL;
+		}
+	}
+
+	g_free(summary_path);
+	g_key_file_free(keyfile);
+
+	return summary;
+}
+
+/* Builds a summary from a speakers table (nick -> color). */
+static ColorNicksLogSummary *
+log_summary_new(guint messages, gint64 first, gint64 last, guint64 size, GHashTable *speakers)
+{
+	ColorNicksLogSummary *summary = g_new0(ColorNicksLogSummary, 1);
+	GList *nicks = g_list_sort(g_hash_table_get_keys(speakers), (GCompareFunc)g_utf8_collate);
+	GList *l;
+	guint i = 0;
+
+	summary->messages = messages;
+	summary->first = first;
+	summary->last = last;
+	summary->size = size;
+	summary->speakers = g_new0(char *, g_list_length(nicks) + 1);
+	summary->colors = g_new0(char *, g_list_length(nicks) + 1);
+	for (l = nicks; l; l = l->next, i++) {
+		summary->speakers[i] = g_strdup(l->data);
+		summary->colors[i] = g_strdup(g_hash_table_lookup(speakers, l->data));
+	}
+	g_list_free(nicks);
+
+	return summary;
+}
+
+/* Notes a speaker, and their color if this line shows one. */
+static void
+summary_speakers_add(GHashTable *speakers, const char *nick, const char *color)
+{
+	const char *known = g_hash_table_lookup(speakers, nick);
+
+	if (known == NULL || (*known == '\0' && color != NULL))
+		g_hash_table_insert(speakers, g_strdup(nick), g_strdup(color ? color : ""));
+}
+
+static GHashTable *
+summary_speakers_new(void)
+{
+	return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+/* Starts the summary of a log being opened at path. A log we are appending
+ * to carries on from its summary, if it has a good one. */
+static void
+log_summary_start(ColorNicksLogData *extra, const char *path)
+{
+	ColorNicksLogSummary *summary;
+	char **nick, **color;
+
+	extra->speakers = summary_speakers_new();
+	if (extra->offset == 0)
+		return;
+
+	if ((summary = log_summary_load(path)) == NULL) {
+		extra->summary_partial = TRUE;
+		return;
+	}
+
+	extra->messages = summary->messages;
+	extra->first_time = summary->first;
+	extra->last_time = summary->last;
+	for (nick = summary->speakers, color = summary->colors; *nick; nick++, color++)
+		summary_speakers_add(extra->speakers, *nick, **color ? *color : NULL);
+	log_summary_free(summary);
+}
+
+static void
+log_summary_add(ColorNicksLogData *extra, time_t when, const char *from, const char *color)
+{
+	if (extra->messages++ == 0)
+		extra->first_time = when;
+	extra->last_time = when;
+
+	if (from)
+		summary_speakers_add(extra->speakers, from, color);
+}
+
+/* Builds the summary of a log that is being finalized. Main loop only; it
+ * is saved by log_file_close(), after the last lines are written. */
+static void
+log_summary_finish(PurpleLogCommonLoggerData *data)
+{
+	ColorNicksLogData *extra = data->extra;
+
+	if (extra->summary_partial) {
+		/* Whatever is there describes less than the log; let it be rebuilt. */
+		char *summary_path = g_strconcat(data->path, SUMMARY_SUFFIX, NULL);
+		g_unlink(summary_path);
+		g_free(summary_path);
+	} else
+		extra->summary = log_summary_new(extra->messages, extra->first_time, extra->last_time,
+		                                 extra->offset + (extra->binary ? 0 : strlen(LOG_FOOTER)),
+		                                 extra->speakers);
+
+	g_hash_table_destroy(extra->speakers);
+	extra->speakers = NULL;
+}
+
+/* Log headers. */
+
+static GHashTable *prpl_icons = NULL;  /* PurpleAccount -> its protocol's list_icon() */
+
+/* The protocol name shown in log headers, looked up once per account. */
+static const char *
+log_prpl_icon(PurpleAccount *account)
+{
+	char *icon;
+
+	if (prpl_icons == NULL)
+		prpl_icons = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+	icon = g_hash_table_lookup(prpl_icons, account);
+	if (icon == NULL) {
+		PurplePlugin *plugin = purple_find_prpl(purple_account_get_protocol_id(account));
+
+		icon = g_strdup(PURPLE_PLUGIN_PROTOCOL_INFO(plugin)->list_icon(account, NULL));
+		g_hash_table_insert(prpl_icons, account, icon);
+	}
+
+	return icon;
+}
+
+static void
+prpl_icon_account_removed_cb(PurpleAccount *account)
+{
+	if (prpl_icons)
+		g_hash_table_remove(prpl_icons, account);
+}
+
+/* Appends the header a new html log starts with to line. */
+static void
+log_header_append(PurpleLog *log, GString *line)
+{
+	const char *prpl = log_prpl_icon(log->account);
+	const char *date = purple_date_format_full(localtime(&log->time));
+	char *header;
+
+	g_string_append(line, "<html><head>");
+	g_string_append(line, "<meta http-equiv=\"content-type\" content=\"text/html; charset=UTF-8\">");
+	g_string_append(line, "<title>");
+	if (log->type == PURPLE_LOG_SYSTEM)
+		header = g_strdup_printf("System log for account %s (%s) connected at %s",
+				purple_account_get_username(log->account), prpl, date);
+	else
+		header = g_strdup_printf("Conversation with %s at %s on %s (%s)",
+				log->name, date, purple_account_get_username(log->account), prpl);
+
+	g_string_append(line, header);
+	g_string_append(line, "</title></head><body>");
+	g_string_append_printf(line, "<h3>%s</h3>\n", header);
+	g_free(header);
+}
+
+/* Log precreation.
+ * libpurple makes a conversation's log as the conversation is created, but
+ * the file only once the first message is written, which would then wait
+ * on making directories and opening files. Instead the file is created by a
+ * worker as soon as the conversation is, with its header and its index
+ * sidecar, and the first write takes the open handles. Should that write
+ * come before the worker is done, it waits for it rather than race it.
+ * Logs that are closed before anything is written to them lose the files
+ * made for them, so opening a conversation leaves nothing behind. New files
+ * are made under a ".part" name, which neither libpurple nor the listings
+ * take for a log, and get their real name from the first write; whatever
+ * a crash leaves of them is removed the next time the worker makes a file
+ * in that directory. Files waiting to be taken count against
+ * max_open_logs along with the file pool; past it, logs are created by
+ * their first write as before. */
+
+typedef struct {
+	char *path;
+	char *part;           /* where a new file is made until the first write */
+	GString *header;      /* written by the worker if the file is new, or NULL */
+	gint64 dir_before;    /* mtime of the log directory before the file was made */
+	FILE *file;
+	FILE *index;
+	gboolean created;     /* the file was empty */
+	gboolean ready;
+	gboolean abandoned;
+} PrecreatedLog;
+
+static GThreadPool *precreate_pool = NULL;
+static GMutex precreate_lock;
+static GCond precreate_cond;
+static GHashTable *precreated = NULL;  /* PurpleLog -> PrecreatedLog */
+static GHashTable *precreate_swept = NULL;  /* directories, worker only */
+
+static void
+precreate_free(PrecreatedLog *pre)
+{
+	g_free(pre->path);
+	g_free(pre->part);
+	if (pre->header)
+		g_string_free(pre->header, TRUE);
+	g_free(pre);
+}
+
+/* Closes the files made for a log nothing was written to and removes them. */
+static void
+precreate_discard(PrecreatedLog *pre)
+{
+	if (pre->index)
+		fclose(pre->index);
+	if (pre->file)
+		fclose(pre->file);
+
+	if (pre->created) {
+		char *index_path = g_strconcat(pre->path, INDEX_SUFFIX, NULL);
+
+		g_unlink(pre->part);
+		g_unlink(index_path);
+		g_free(index_path);
+	}
+
+	precreate_free(pre);
+}
+
+/* Removes the files made for logs that a crash kept from being written to
+ * or discarded. Those in dir can only be left from an earlier session, as
+ * this runs before the worker first makes anything there. */
+static void
+precreate_sweep(const char *dir)
+{
+	GDir *d;
+	const char *name;
+
+	if (g_hash_table_contains(precreate_swept, dir))
+		return;
+	g_hash_table_add(precreate_swept, g_strdup(dir));
+
+	if ((d = g_dir_open(dir, 0, NULL)) == NULL)
+		return;
+
+	while ((name = g_dir_read_name(d)) != NULL) {
+		char *part, *path, *index_path;
+
+		if (!g_str_has_suffix(name, ".htm.part") &&
+		    !g_str_has_suffix(name, COMPRESSED_EXT ".part") &&
+		    !g_str_has_suffix(name, BINARY_EXT ".part"))
+			continue;
+
+		part = g_build_filename(dir, name, NULL);
+		path = g_strndup(part, strlen(part) - strlen(".part"));
+		index_path = g_strconcat(path, INDEX_SUFFIX, NULL);
+		g_unlink(part);
+		/* Otherwise the index is that log's own. */
+		if (!g_file_test(path, G_FILE_TEST_EXISTS))
+			g_unlink(index_path);
+		g_free(index_path);
+		g_free(path);
+		g_free(part);
+	}
+	g_dir_close(d);
+}
+
+static void
+precreate_func(gpointer data, gpointer unused)
+{
+	PrecreatedLog *pre = data;
+	char *dir, *index_path;
+	gint64 dir_before;
+	FILE *file, *index = NULL;
+	gboolean created = FALSE, abandoned;
+
+	/* Abandoned after it was ready. */
+	g_mutex_lock(&precreate_lock);
+	if (pre->ready) {
+		g_mutex_unlock(&precreate_lock);
+		precreate_discard(pre);
+		return;
+	}
+	g_mutex_unlock(&precreate_lock);
+
+	dir = g_path_get_dirname(pre->path);
+	dir_before = dir_mtime(dir);
+	if (g_mkdir_with_parents(dir, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		thread_debug_error("Unable to create directory %s: %s\n", dir, g_strerror(errno));
+	precreate_sweep(dir);
+
+	index_path = g_strconcat(pre->path, INDEX_SUFFIX, NULL);
+	/* Anything already there keeps its header and gets ours from the first
+	 * write, as it would without us. Its index is left to log_index_open(),
+	 * which checks it on the main loop. */
+	if (g_file_test(pre->path, G_FILE_TEST_EXISTS))
+		file = g_fopen(pre->path, "a");
+	else if ((file = g_fopen(pre->part, "w")) != NULL) {
+		created = TRUE;
+		index = g_fopen(index_path, "wb");
+	}
+	if (file) {
+		if (!created && pre->header) {
+			g_string_free(pre->header, TRUE);
+			pre->header = NULL;
+		}
+		if (pre->header && (fwrite(pre->header->str, pre->header->len, 1, file) != 1 ||
+		                    fflush(file) != 0)) {
+			thread_debug_error("Error writing %s: %s\n", pre->path, g_strerror(errno));
+
+			/* The first write makes it again. */
+			if (index)
+				fclose(index);
+			fclose(file);
+			index = file = NULL;
+			g_unlink(pre->part);
+			g_unlink(index_path);
+			created = FALSE;
+		}
+	}
+
+	g_mutex_lock(&precreate_lock);
+	pre->dir_before = dir_before;
+	pre->file = file;
+	pre->index = index;
+	pre->created = created;
+	pre->ready = TRUE;
+	abandoned = pre->abandoned;
+	g_cond_broadcast(&precreate_cond);
+	g_mutex_unlock(&precreate_lock);
+
+	if (abandoned)
+		precreate_discard(pre);
+	g_free(index_path);
+	g_free(dir);
+}
+
+/* Starts making the file of log, if it is one of ours and has none yet. */
+static void
+precreate_log(PurpleLog *log)
+{
+	PrecreatedLog *pre;
+	const char *ext, *tz, *date;
+	char *dir, *filename;
+	struct tm *tm;
+
+	if (precreate_pool == NULL || log->logger_data != NULL ||
+	    g_hash_table_contains(precreated, log))
+		return;
+
+	/* Auto-joining hundreds of rooms must not open hundreds of files. */
+	if (g_hash_table_size(precreated) + g_atomic_int_get(&pool_open) >=
+	    (guint)MAX(g_atomic_int_get(&max_open_logs), 1))
+		return;
+
+	if ((ext = log_file_ext(log->logger)) == NULL)
+		return;
+
+	if ((dir = purple_log_get_log_dir(log->type, log->name, log->account)) == NULL)
+		return;
+
+	/* Named the way purple_log_common_writer() names it. */
+	tm = localtime(&log->time);
+	tz = purple_escape_filename(purple_utf8_strftime("%Z", tm));
+	date = purple_utf8_strftime("%Y-%m-%d.%H%M%S%z", tm);
+	filename = g_strdup_printf("%s%s%s", date, tz, ext);
+
+	pre = g_new0(PrecreatedLog, 1);
+	pre->path = g_build_filename(dir, filename, NULL);
+	pre->part = g_strconcat(pre->path, ".part", NULL);
+	/* Compressed headers go through the log's compressor. */
+	if (log->logger == colornicks_bin_logger)
+		pre->header = g_string_new_len(BINARY_MAGIC, BINARY_MAGIC_LEN);
+	else if (log->logger == colornicks_logger) {
+		pre->header = g_string_sized_new(256);
+		log_header_append(log, pre->header);
+	}
+
+	g_hash_table_insert(precreated, log, pre);
+	g_thread_pool_push(precreate_pool, pre, NULL);
+
+	g_free(filename);
+	g_free(dir);
+}
+
+static void
+precreate_conv_created_cb(PurpleConversation *conv)
+{
+	GList *l;
+
+	for (l = conv->logs; l; l = l->next)
+		precreate_log(l->data);
+}
+
+/* Hands over the file made for log, waiting for it if need be. Returns NULL
+ * if there is none. */
+static PrecreatedLog *
+precreate_take(PurpleLog *log)
+{
+	PrecreatedLog *pre;
+
+	if (precreated == NULL || (pre = g_hash_table_lookup(precreated, log)) == NULL)
+		return NULL;
+	g_hash_table_steal(precreated, log);
+
+	g_mutex_lock(&precreate_lock);
+	while (!pre->ready)
+		g_cond_wait(&precreate_cond, &precreate_lock);
+	g_mutex_unlock(&precreate_lock);
+
+	if (pre->file == NULL) {
+		precreate_free(pre);
+		return NULL;
+	}
+
+	/* The listing hears of it under its real name, as log_listing_created()
+	 * has it by the time the main loop gets the event. */
+	if (pre->created && g_rename(pre->part, pre->path) != 0) {
+		purple_debug_error("log", "Unable to rename %s: %s\n", pre->part, g_strerror(errno));
+		precreate_discard(pre);
+		return NULL;
+	}
+
+	return pre;
+}
+
+/* Called when log is closed; nothing more will be written to it. */
+static void
+precreate_abandon(PurpleLog *log)
+{
+	PrecreatedLog *pre;
+	gboolean ready;
+
+	if (precreated == NULL || (pre = g_hash_table_lookup(precreated, log)) == NULL)
+		return;
+	g_hash_table_steal(precreated, log);
+
+	g_mutex_lock(&precreate_lock);
+	pre->abandoned = TRUE;
+	ready = pre->ready;
+	g_mutex_unlock(&precreate_lock);
+
+	/* Otherwise the worker discards it once it is done. */
+	if (ready)
+		g_thread_pool_push(precreate_pool, pre, NULL);
+}
+
+static void
+precreate_init(void)
+{
+	GList *convs;
+
+	precreated = g_hash_table_new(g_direct_hash, g_direct_equal);
+	precreate_swept = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	precreate_pool = g_thread_pool_new(precreate_func, NULL, 1, FALSE, NULL);
+
+	for (convs = purple_get_conversations(); convs; convs = convs->next)
+		precreate_conv_created_cb(convs->data);
+}
+
+/* Waits for the worker after discarding whatever it made. */
+static void
+precreate_shutdown(void)
+{
+	GHashTableIter iter;
+	gpointer log;
+
+	if (precreate_pool == NULL)
+		return;
+
+	while (g_hash_table_size(precreated) > 0) {
+		g_hash_table_iter_init(&iter, precreated);
+		g_hash_table_iter_next(&iter, &log, NULL);
+		precreate_abandon(log);
+	}
+
+	g_thread_pool_free(precreate_pool, FALSE, TRUE);
+	precreate_pool = NULL;
+	g_hash_table_destroy(precreated);
+	precreated = NULL;
+	g_hash_table_destroy(precreate_swept);
+	precreate_swept = NULL;
+
+	if (prpl_icons) {
+		g_hash_table_destroy(prpl_icons);
+		prpl_icons = NULL;
+	}
+}
+
+/* Log segments.
+ * A conversation that stays open for weeks would otherwise keep appending
+ * to one file until it is closed. Once a log passes segment_size MiB or
+ * segment_age hours, it is finished with its footer like any closed log and
+ * the next line starts a new file, named for the time it was started and
+ * with a header of its own. Each segment is thus an ordinary log that the
+ * lister picks up on its own; segment start times are kept strictly
+ * increasing so they never share a file and list in order. */
+
+/* Finishes the current segment of log if it is due, so the next write
+ * starts a new one. Returns whether it did. */
+static gboolean
+log_segment_end(PurpleLog *log)
+{
+	PurpleLogCommonLoggerData *data = log->logger_data;
+	ColorNicksLogData *extra;
+	time_t now = time(NULL);
+
+	if (data == NULL || (extra = data->extra) == NULL)
+		return FALSE;
+
+	if (!(segment_size > 0 && extra->offset >= (guint64)segment_size * 1024 * 1024) &&
+	    !(segment_age > 0 && now - log->time >= (time_t)segment_age * 60 * 60))
+		return FALSE;
+
+	colornicks_logger_finalize(log);
+	log->time = MAX(now, log->time + 1);
+	return TRUE;
+}
+
+/* Creates the file for log and leaves its header in the line buffer.
+ * Returns NULL if the file cannot be written. */
+static ColorNicksLogData *
+log_segment_open(PurpleLog *log)
+{
+	const char *ext = log->logger == colornicks_gz_logger ? COMPRESSED_EXT :
+	                  log->logger == colornicks_bin_logger ? BINARY_EXT : ".htm";
+	PrecreatedLog *pre = precreate_take(log);
+	PurpleLogCommonLoggerData *data;
+	ColorNicksLogData *extra;
+	gint64 dir_before;
+	char *dir;
+
+	if (pre) {
+		dir = g_path_get_dirname(pre->path);
+		dir_before = pre->dir_before;
+
+		data = g_slice_new0(PurpleLogCommonLoggerData);
+		data->path = g_strdup(pre->path);
+		data->file = pre->file;
+		log->logger_data = data;
+	} else {
+		dir = purple_log_get_log_dir(log->type, log->name, log->account);
+		dir_before = dir ? dir_mtime(dir) : -1;
+		purple_log_common_writer(log, ext);
+	}
+
+	data = log->logger_data;
+
+	/* if we can't write to the file, give up before we hurt ourselves */
+	if (!data || !data->file) {
+		g_free(dir);
+		return NULL;
+	}
+
+	extra = g_slice_new0(ColorNicksLogData);
+	extra->account = log->account;
+	extra->line = g_string_sized_new(256);
+	extra->nick = g_string_sized_new(32);
+	extra->stamp.str = g_string_sized_new(32);
+	extra->stamp.time = G_MININT64;
+#ifndef COLORNICKS_NO_STATS
+	extra->stats = stats_get(log->account);
+#endif
+	extra->index = pre && pre->index ? pre->index : log_index_open(data->path, data->file);
+	if (log->logger == colornicks_gz_logger) {
+		extra->frame = g_string_sized_new(FRAME_SIZE + 1024);
+		extra->frame_records = g_byte_array_new();
+		extra->compressor = G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+		extra->frames = log_frames_open(data->path, data->file, &extra->frame_end);
+		extra->offset = extra->frame_end.logical_end;
+	} else
+		extra->offset = log_file_size(data->file);
+	if (log->logger == colornicks_bin_logger) {
+		extra->binary = TRUE;
+		extra->nick_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		if (extra->offset > BINARY_MAGIC_LEN)
+			binary_nicks_load(extra, data->path);
+	}
+	extra->ledger = size_ledger_created(dir, ext, dir_before);
+	log_summary_start(extra, data->path);
+	data->extra = extra;
+	retention_log_opened(data->path);
+	log_listing_created(log, dir, ext, data->path);
+	search_log_created(extra, dir, data->path);
+	g_free(dir);
+
+	/* The worker wrote the header already; it only needs counting. */
+	if (pre && pre->header) {
+		if (extra->ledger)
+			extra->ledger->size += pre->header->len;
+		precreate_free(pre);
+		return extra;
+	}
+	if (pre)
+		precreate_free(pre);
+
+	/* Binary logs have only their magic for a header. */
+	if (extra->binary) {
+		if (extra->offset == 0)
+			g_string_append_len(extra->line, BINARY_MAGIC, BINARY_MAGIC_LEN);
+		return extra;
+	}
+
+	log_header_append(log, extra->line);
+	return extra;
+}
+
+/* Join and part floods.
+ * In a busy room most of the log is people coming and going, and a netsplit
+ * brings thousands of those lines in seconds. With flood_window set, joins
+ * and parts in chat logs are held back and logged as one line per run,
+ * "12 people entered the room: a, b, c". A run ends flood_window ms after
+ * it started, at flood_cap names, or at any other message, which is then
+ * logged after it so the order is kept. A run of one is logged as it came.
+ * Runs are logged through log_write_line(), which does not hold anything
+ * back again. Bytes logged by the timer are returned by the next write, so
+ * libpurple's size cache still counts them. */
+
+typedef enum {
+	FLOOD_JOIN,
+	FLOOD_PART
+} FloodKind;
+
+/* The lines libpurple logs for joins and parts. */
+static const struct {
+	FloodKind kind;
+	const char *format;
+} flood_patterns[] = {
+	{ FLOOD_JOIN, N_("%s [<I>%s</I>] entered the room.") },
+	{ FLOOD_JOIN, N_("%s entered the room.") },
+	{ FLOOD_PART, N_("%s left the room (%s).") },
+	{ FLOOD_PART, N_("%s left the room.") },
+};
+
+typedef struct {
+	FloodKind kind;
+	time_t first;        /* when the first line was logged */
+	gint64 started;      /* monotonic time of the same */
+	guint count;
+	char *message;       /* the first line, logged as it came if it stays alone */
+	GString *names;
+} FloodRun;
+
+static gint flood_window = 0;          /* ms, 0 to log every line as it comes */
+static gint flood_cap = 100;
+static GHashTable *flood_runs = NULL;  /* PurpleLog -> FloodRun, main loop only */
+static guint flood_timer = 0;
+
+static void
+flood_run_free(gpointer data)
+{
+	FloodRun *run = data;
+
+	g_free(run->message);
+	g_string_free(run->names, TRUE);
+	g_free(run);
+}
+
+/* If message is a join or part line, returns which, and the name in it. */
+static gboolean
+flood_match(const char *message, FloodKind *kind, char **name)
+{
+	gsize len = strlen(message);
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(flood_patterns); i++) {
+		const char *format = _(flood_patterns[i].format);
+		const char *conv = strstr(format, "%s");
+		const char *rest, *next, *tail, *name_start, *name_end;
+		gsize tail_len;
+
+		if (conv == NULL || strncmp(message, format, conv - format) != 0)
+			continue;
+
+		/* The name runs up to what follows it in the format, and the
+		 * message has to end the way the format does. */
+		rest = conv + 2;
+		next = strstr(rest, "%s");
+		tail = next ? next + 2 : rest;
+		tail_len = strlen(tail);
+		if (len < (gsize)(conv - format) + tail_len || strcmp(message + len - tail_len, tail) != 0)
+			continue;
+
+		name_start = message + (conv - format);
+		if (next) {
+			char *separator = g_strndup(rest, next - rest);
+			name_end = strstr(name_start, separator);
+			g_free(separator);
+		} else
+			name_end = message + len - tail_len;
+		if (name_end == NULL || name_end <= name_start || name_end > message + len - tail_len)
+			continue;
+
+		*kind = flood_patterns[i].kind;
+		*name = g_strndup(name_start, name_end - name_start);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Logs the run held back for log, if there is one. Returns the bytes
+ * written. rollover is FALSE when log is being finalized, which must not
+ * start finalizing it again by ending its segment. */
+static gsize
+flood_flush(PurpleLog *log, gboolean rollover)
+{
+	FloodRun *run;
+	gsize written;
+
+	if (flood_runs == NULL || (run = g_hash_table_lookup(flood_runs, log)) == NULL)
+		return 0;
+	g_hash_table_steal(flood_runs, log);
+
+	if (run->count == 1)
+		written = log_write_line(log, PURPLE_MESSAGE_SYSTEM, NULL, run->first, run->message,
+		                         rollover);
+	else {
+		char *line = g_strdup_printf(run->kind == FLOOD_JOIN ?
+			ngettext("%u person entered the room: %s", "%u people entered the room: %s", run->count) :
+			ngettext("%u person left the room: %s", "%u people left the room: %s", run->count),
+			run->count, run->names->str);
+
+		written = log_write_line(log, PURPLE_MESSAGE_SYSTEM, NULL, run->first, line, rollover);
+		g_free(line);
+	}
+	flood_run_free(run);
+
+	return written;
+}
+
+/* Logs the run held back for log outside of a write call. */
+static void
+flood_flush_unreported(PurpleLog *log)
+{
+	gsize written = flood_flush(log, TRUE);
+	PurpleLogCommonLoggerData *data = log->logger_data;
+
+	if (written > 0 && data && data->extra)
+		((ColorNicksLogData *)data->extra)->unreported += written;
+}
+
+static void
+flood_flush_all(void)
+{
+	GList *logs, *l;
+
+	if (flood_runs == NULL)
+		return;
+
+	logs = g_hash_table_get_keys(flood_runs);
+	for (l = logs; l; l = l->next)
+		flood_flush_unreported(l->data);
+	g_list_free(logs);
+}
+
+static gboolean
+flood_timeout_cb(gpointer unused)
+{
+	gint64 now = g_get_monotonic_time();
+	GList *due = NULL, *l;
+	GHashTableIter iter;
+	gpointer log, run;
+
+	g_hash_table_iter_init(&iter, flood_runs);
+	while (g_hash_table_iter_next(&iter, &log, &run))
+		if (now - ((FloodRun *)run)->started >= (gint64)flood_window * 1000)
+			due = g_list_prepend(due, log);
+
+	for (l = due; l; l = l->next)
+		flood_flush_unreported(l->data);
+	g_list_free(due);
+
+	if (g_hash_table_size(flood_runs) == 0) {
+		flood_timer = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Holds message back if it is a join or part, ending the run held back for
+ * log first if this one does not belong to it. Adds the bytes logged for
+ * ended runs to flushed. Returns FALSE if message has to be logged now. */
+static gboolean
+flood_hold(PurpleLog *log, time_t when, const char *message, gsize *flushed)
+{
+	FloodRun *run;
+	FloodKind kind;
+	char *name;
+
+	if (!flood_match(message, &kind, &name))
+		return FALSE;
+
+	run = flood_runs ? g_hash_table_lookup(flood_runs, log) : NULL;
+	if (run && (run->kind != kind ||
+	            g_get_monotonic_time() - run->started >= (gint64)flood_window * 1000)) {
+		*flushed += flood_flush(log, TRUE);
+		run = NULL;
+	}
+
+	if (run == NULL) {
+		run = g_new0(FloodRun, 1);
+		run->kind = kind;
+		run->first = when;
+		run->started = g_get_monotonic_time();
+		run->message = g_strdup(message);
+		run->names = g_string_new(NULL);
+
+		if (flood_runs == NULL)
+			flood_runs = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			                                   NULL, flood_run_free);
+		g_hash_table_insert(flood_runs, log, run);
+
+		/* Runs are ended within a quarter window of being due. */
+		if (flood_timer == 0)
+			flood_timer = purple_timeout_add(MAX(flood_window / 4, 10), flood_timeout_cb, NULL);
+	} else
+		g_string_append(run->names, ", ");
+
+	g_string_append(run->names, name);
+	g_free(name);
+
+	if (++run->count >= (guint)MAX(flood_cap, 1))
+		*flushed += flood_flush(log, TRUE);
+	return TRUE;
+}
+
+static void
+flood_prefs_cb(const char *name, PurplePrefType type, gconstpointer val, gpointer data)
+{
+	flood_window = purple_prefs_get_int("/plugins/gtk/colornicks_logger/flood_window");
+	flood_cap = purple_prefs_get_int("/plugins/gtk/colornicks_logger/flood_cap");
+
+	/* Whatever is held back goes out now, and the next run starts a timer
+	 * for the new window. */
+	flood_flush_all();
+	if (flood_timer) {
+		purple_timeout_remove(flood_timer);
+		flood_timer = 0;
+	}
+}
+
+/* Call once every log has been finalized. */
+static void
+flood_shutdown(void)
+{
+	flood_flush_all();
+	if (flood_timer) {
+		purple_timeout_remove(flood_timer);
+		flood_timer = 0;
+	}
+	if (flood_runs) {
+		g_hash_table_destroy(flood_runs);
+		flood_runs = NULL;
+	}
+}
+
+static gsize colornicks_logger_write(PurpleLog *log, PurpleMessageFlags type,
+							  const char *from, time_t time, const char *message)
+{
+	PurpleLogCommonLoggerData *data = log->logger_data;
+	gsize flushed = 0;
+
+	if (data && data->extra) {
+		ColorNicksLogData *extra = data->extra;
+
+		flushed = extra->unreported;
+		extra->unreported = 0;
+	}
+
+	if (flood_window > 0 && log->type == PURPLE_LOG_CHAT) {
+		if ((type & PURPLE_MESSAGE_SYSTEM) && flood_hold(log, time, message, &flushed))
+			return flushed;
+		flushed += flood_flush(log, TRUE);
+	}
+
+	return log_write_line(log, type, from, time, message, TRUE) + flushed;
+}
+
+/* Writes one line to log as it is, past the join and part coalescing,
+ * first ending the log's segment if it is due and rollover is set.
+ * Returns the bytes written. */
+static gsize
+log_write_line(PurpleLog *log, PurpleMessageFlags type,
+               const char *from, time_t time, const char *message, gboolean rollover)
+{
+	char *msg_fixed;
+	const char *date = NULL;
+	const char *nick_color;
+	const BinaryNick *nick = NULL;
+	const LineTemplate *tpl;
+	GString *line;
+	gsize line_start;
+	LogIndexRecord record;
+	PurpleLogCommonLoggerData *data;
+	ColorNicksLogData *extra;
+	STATS_DECLARE(start)
+
+	data = log->logger_data;
+	if (rollover && log_segment_end(log))
+		data = NULL;
+
+	if (!data) {
+		if ((extra = log_segment_open(log)) == NULL)
+			return 0;
+		data = log->logger_data;
+		line = extra->line;
+	} else {
+		/* if we can't write to the file, give up before we hurt ourselves.
+		 * The file itself may be closed by the pool; extra says it opened. */
+		if (!data->extra)
+			return 0;
+
+		extra = data->extra;
+		line = extra->line;
+		g_string_truncate(line, 0);
+	}
+
+	g_string_truncate(extra->nick, 0);
+	if (from)
+		append_escaped(extra->nick, from);
+	STATS_START(start);
+	if (extra->binary) {
+		nick = from ? binary_nick_get(extra, log->conv, line) : NULL;
+		nick_color = nick && *nick->color ? nick->color : NULL;
+	} else
+		nick_color = get_nick_color(log->conv, extra->nick->str);
+	STATS_STOP(extra->stats, STAGE_NICK_COLOR, start);
+
+	msg_fixed = prepare_message(message, extra->stats);
+
+	if (!extra->binary) {
+		STATS_START(start);
+		date = log_get_timestamp(log, &extra->stamp, time, log_show_date(log, time));
+		STATS_STOP(extra->stats, STAGE_TIMESTAMP, start);
+	}
+
+	line_start = line->len;
+	STATS_START(start);
+	if (extra->binary) {
+		/* The body goes in before select_template() can strip its "/me ";
+		 * it is rendered when the log is read. */
+		binary_append_message(line, time, type, log_show_date(log, time),
+		                      nick ? nick->id : 0, msg_fixed);
+		if ((tpl = select_template(log, type, msg_fixed)) == NULL)
+			g_string_truncate(line, line_start);
+	} else {
+		tpl = select_template(log, type, msg_fixed);
+		if (tpl)
+			render_template(line, tpl, date, msg_fixed, extra->nick->str, nick_color);
+	}
+	STATS_STOP(extra->stats, STAGE_FORMAT, start);
+
+	if (tpl) {
+		record.offset = GUINT64_TO_LE(extra->offset + line_start);
+		record.time = GINT64_TO_LE((gint64)time);
+		record.flags = GUINT32_TO_LE((guint32)type);
+		record.nick_id = GUINT32_TO_LE(template_has_field(tpl, FIELD_NICK) ?
+		                               g_str_hash(extra->nick->str) : 0);
+
+		search_log_message(extra, extra->offset + line_start,
+		                   template_has_field(tpl, FIELD_NICK) ? from : NULL, msg_fixed);
+
+		log_summary_add(extra, time, template_has_field(tpl, FIELD_NICK) ? from : NULL,
+		                !template_has_field(tpl, FIELD_COLOR) ? NULL :
+		                nick_color ? nick_color : tpl->default_color);
+	}
+
+	if (msg_fixed != message)
+		g_free(msg_fixed);
+
+	if (line->len > 0)
+		log_emit(data, line->str, line->len, tpl ? &record : NULL);
+
+	STATS_ADD(extra->stats, messages, 1);
+	STATS_ADD(extra->stats, bytes, line->len);
+
+	return line->len;
+}
+
+static void colornicks_logger_finalize(PurpleLog *log)
+{
+	PurpleLogCommonLoggerData *data;
+
+	/* The run goes into the segment being finished. */
+	flood_flush(log, FALSE);
+	precreate_abandon(log);
+
+	data = log->logger_data;
+	if (data) {
+		ColorNicksLogData *extra = data->extra;
+
+		if (extra && extra->ledger && !extra->binary)
+			extra->ledger->size += strlen(LOG_FOOTER);
+		if (extra)
+			log_summary_finish(data);
+
+		/* The writer thread closes the file once everything queued
+		 * before it has been written. */
+		if (async_write && extra)
+			writer_push(WRITER_JOB_CLOSE, data, NULL, NULL, 0, NULL);
+		else
+			log_file_close(data);
+		log->logger_data = NULL;
+	}
+}
+
+static GList *colornicks_logger_list(PurpleLogType type, const char *sn, PurpleAccount *account)
+{
+	return log_listing_get(type, sn, account, ".htm", colornicks_logger);
+}
+
+static GList *colornicks_logger_list_syslog(PurpleAccount *account)
+{
+	return log_listing_get(PURPLE_LOG_SYSTEM, ".system", account, ".htm", colornicks_logger);
+}
+
+static GList *colornicks_gz_logger_list(PurpleLogType type, const char *sn, PurpleAccount *account)
+{
+	return log_listing_get(type, sn, account, COMPRESSED_EXT, colornicks_gz_logger);
+}
+
+static GList *colornicks_gz_logger_list_syslog(PurpleAccount *account)
+{
+	return log_listing_get(PURPLE_LOG_SYSTEM, ".system", account, COMPRESSED_EXT, colornicks_gz_logger);
+}
+
+/* Returns the frames of the compressed log at path in host order, or NULL if
+ * it has no frame index. Free with g_array_free(). */
+static GArray *
+log_frames_load(const char *path)
+{
+	char *frames_path = g_strconcat(path, FRAMES_SUFFIX, NULL);
+	GArray *frames = NULL;
+	char *contents;
+	gsize len;
+	guint i;
+
+	if (g_file_get_contents(frames_path, &contents, &len, NULL)) {
+		guint n = len / sizeof(FrameRecord);
+
+		frames = g_array_sized_new(FALSE, FALSE, sizeof(FrameRecord), n);
+		g_array_append_vals(frames, contents, n);
+		g_free(contents);
+
+		for (i = 0; i < frames->len; i++) {
+			FrameRecord *frame = &g_array_index(frames, FrameRecord, i);
+			frame->end = GUINT64_FROM_LE(frame->end);
+			frame->logical_end = GUINT64_FROM_LE(frame->logical_end);
+		}
+	}
+	g_free(frames_path);
+
+	return frames;
+}
+
+/* Returns up to len bytes of the compressed log at path, starting at offset
+ * in the uncompressed log, or NULL if it cannot be read. Decompression
+ * starts at the frame holding offset and stops once len bytes are out. */
+static GString *
+compressed_log_read(const char *path, guint64 offset, gsize len)
+{
+	GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+	GArray *frames;
+	GConverter *decompressor;
+	GString *out;
+	const char *contents;
+	char buf[64 * 1024];
+	guint64 in = 0, logical = 0, limit, size;
+	guint i;
+
+	if (mapped == NULL)
+		return NULL;
+
+	contents = g_mapped_file_get_contents(mapped);
+	size = g_mapped_file_get_length(mapped);
+	limit = len > G_MAXUINT64 - offset ? G_MAXUINT64 : offset + len;
+
+	/* Skip the frames that end before offset. */
+	if ((frames = log_frames_load(path)) != NULL) {
+		for (i = 0; i < frames->len; i++) {
+			FrameRecord *frame = &g_array_index(frames, FrameRecord, i);
+			if (frame->logical_end > offset || frame->end > size)
+				break;
+			in = frame->end;
+			logical = frame->logical_end;
+		}
+		g_array_free(frames, TRUE);
+	}
+
+	decompressor = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+	out = g_string_new(NULL);
+
+	while (in < size && logical < limit) {
+		GConverterResult result;
+		GError *error = NULL;
+		gsize read, written;
+
+		result = g_converter_convert(decompressor, contents + in, size - in,
+		                             buf, sizeof(buf), G_CONVERTER_INPUT_AT_END,
+		                             &read, &written, &error);
+		if (result == G_CONVERTER_ERROR) {
+			/* Most likely a frame cut short by a crash, which ends the log. */
+			thread_debug_error("Error decompressing %s: %s\n", path, error->message);
+			g_error_free(error);
+			break;
+		}
+		in += read;
+
+		if (logical + written > offset) {
+			guint64 from = MAX(offset, logical) - logical;
+			guint64 to = MIN(limit, logical + written) - logical;
+			g_string_append_len(out, buf + from, to - from);
+		}
+		logical += written;
+
+		/* Each frame is a gzip member of its own. */
+		if (result == G_CONVERTER_FINISHED)
+			g_converter_reset(decompressor);
+	}
+
+	g_object_unref(decompressor);
+	g_mapped_file_unref(mapped);
+
+	return out;
+}
+
+static gboolean
+log_is_compressed(const char *path)
+{
+	return g_str_has_suffix(path, COMPRESSED_EXT);
+}
+
+/* g_file_get_contents() for logs of either kind. */
+static gboolean
+log_get_contents(const char *path, char **contents, gsize *len)
+{
+	GString *read;
+
+	if (!log_is_compressed(path))
+		return g_file_get_contents(path, contents, len, NULL);
+
+	if ((read = compressed_log_read(path, 0, G_MAXSIZE)) == NULL)
+		return FALSE;
+	*len = read->len;
+	*contents = g_string_free(read, FALSE);
+	return TRUE;
+}
+
+/* Returns everything after the header line of the log at path, or NULL.
+ * The file is mapped rather than read, so the string handed back is the only
+ * copy and peak memory stays around the size of the log, not twice that.
+ * Logs are only ever appended to, so a log that is still being written is
+ * simply read up to its size at the time it was mapped. Files that cannot
+ * be mapped (empty ones, or filesystems without mmap) are read into a
+ * buffer and trimmed in place instead. */
+static char *
+read_log_body(const char *path)
+{
+	GMappedFile *mapped;
+	char *read;
+	char *minus_header;
+	gsize len;
+
+	if (log_is_compressed(path)) {
+		GString *body = compressed_log_read(path, 0, G_MAXSIZE);
+
+		if (body == NULL)
+			return NULL;
+		if ((minus_header = memchr(body->str, '\n', body->len)) != NULL)
+			g_string_erase(body, 0, minus_header + 1 - body->str);
+		return g_string_free(body, FALSE);
+	}
+
+	if ((mapped = g_mapped_file_new(path, FALSE, NULL)) != NULL) {
+		const char *contents = g_mapped_file_get_contents(mapped);
+		len = g_mapped_file_get_length(mapped);
+
+		if (contents != NULL && len > 0) {
+			const char *body = memchr(contents, '\n', len);
+
+			body = body ? body + 1 : contents;
+			read = g_strndup(body, len - (body - contents));
+			g_mapped_file_unref(mapped);
+			return read;
+		}
+		g_mapped_file_unref(mapped);
+	}
+
+	if (!g_file_get_contents(path, &read, &len, NULL))
+		return NULL;
+
+	if ((minus_header = strchr(read, '\n')) != NULL) {
+		minus_header++;
+		memmove(read, minus_header, strlen(minus_header) + 1);
+	}
+
+	return read;
+}
+
+static gboolean
+line_has_prefix(const char *line, gsize len, const char *prefix)
+{
+	gsize n = strlen(prefix);
+	return len >= n && memcmp(line, prefix, n) == 0;
+}
+
+static int
+parse_number(const char **p, const char *end, int max_digits)
+{
+	int value = 0, n = 0;
+
+	while (*p < end && n < max_digits && g_ascii_isdigit(**p)) {
+		value = value * 10 + (**p - '0');
+		(*p)++;
+		n++;
+	}
+
+	return n ? value : -1;
+}
+
+/* Finds the first h:mm[:ss][ AM|PM] in [start, end) and returns it as
+ * seconds since midnight. */
+static gboolean
+parse_time_of_day(const char *start, const char *end, int *secs)
+{
+	const char *p;
+
+	for (p = start; p < end; p++) {
+		const char *q = p;
+		int h, m, sec = 0;
+
+		if (!g_ascii_isdigit(*p) || (p > start && g_ascii_isdigit(p[-1])))
+			continue;
+
+		if ((h = parse_number(&q, end, 2)) < 0 || q >= end || *q != ':')
+			continue;
+		q++;
+		if ((m = parse_number(&q, end, 2)) < 0)
+			continue;
+		if (q < end && *q == ':') {
+			q++;
+			if ((sec = parse_number(&q, end, 2)) < 0)
+				sec = 0;
+		}
+
+		while (q < end && *q == ' ')
+			q++;
+		if (q + 1 < end && (q[1] == 'M' || q[1] == 'm')) {
+			if ((*q == 'P' || *q == 'p') && h < 12)
+				h += 12;
+			else if ((*q == 'A' || *q == 'a') && h == 12)
+				h = 0;
+		}
+
+		*secs = h * 3600 + m * 60 + sec;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Works out the flags and sender of a line written by colornicks_logger_write
+ * from its markup. Colors that are shared between sent and received lines
+ * are taken to be sent ones. If nick_start is not NULL, it and nick_length
+ * are set to where the (escaped) sender is in line, or to NULL and 0. */
+static guint32
+guess_line_flags(const char *line, gsize len, gboolean system_log, guint32 *nick_id,
+                 const char **nick_start, gsize *nick_length)
+{
+	const char *end = line + len;
+	const char *nick, *nick_end;
+	guint32 flags;
+	char *escaped;
+
+	*nick_id = 0;
+	if (nick_start) {
+		*nick_start = NULL;
+		*nick_length = 0;
+	}
+
+	if (system_log)
+		return PURPLE_MESSAGE_SYSTEM;
+
+	if (line_has_prefix(line, len, "<font size=\"2\">(")) {
+		if (g_strstr_len(line, len, ")</font> ") != NULL)
+			return PURPLE_MESSAGE_RAW;
+		if (len >= 10 && memcmp(end - 10, "</b><br/>\n", 10) == 0)
+			return PURPLE_MESSAGE_SYSTEM;
+		return 0;
+	}
+
+	if (line_has_prefix(line, len, "<font color=\"#FF0000\">"))
+		return PURPLE_MESSAGE_ERROR;
+
+	if (g_strstr_len(line, len, " &lt;whisper&gt;:</b>") != NULL)
+		flags = PURPLE_MESSAGE_WHISPER |
+			(line_has_prefix(line, len, "<font color=\"#6C2585\">") ?
+			 PURPLE_MESSAGE_SEND : PURPLE_MESSAGE_RECV);
+	else if (g_strstr_len(line, len, " &lt;AUTO-REPLY&gt;:</b>") != NULL)
+		flags = PURPLE_MESSAGE_AUTO_RESP |
+			(line_has_prefix(line, len, "<font color=\"#16569E\">") ?
+			 PURPLE_MESSAGE_SEND : PURPLE_MESSAGE_RECV);
+	else if (line_has_prefix(line, len, "<font color=\"#16569E\">") ||
+	         line_has_prefix(line, len, "<font color=\"#062585\">"))
+		flags = PURPLE_MESSAGE_SEND;
+	else
+		flags = PURPLE_MESSAGE_RECV;
+
+	/* The sender sits in the first <b></b> after the timestamp. */
+	if ((nick = g_strstr_len(line, len, ")</font>")) == NULL ||
+	    (nick = g_strstr_len(nick, end - nick, "<b>")) == NULL ||
+	    (nick_end = g_strstr_len(nick, end - nick, "</b>")) == NULL)
+		return flags;
+
+	nick += 3;
+	if (*nick == ' ')
+		nick++;
+	if (nick_end - nick >= 3 && strncmp(nick, "***", 3) == 0)
+		nick += 3;
+	else if (flags & PURPLE_MESSAGE_WHISPER)
+		nick_end -= strlen(" &lt;whisper&gt;:");
+	else if (flags & PURPLE_MESSAGE_AUTO_RESP)
+		nick_end -= strlen(" &lt;AUTO-REPLY&gt;:");
+	else if (nick_end > nick && nick_end[-1] == ':')
+		nick_end--;
+
+	if (nick_end > nick) {
+		escaped = g_strndup(nick, nick_end - nick);
+		*nick_id = g_str_hash(escaped);
+		g_free(escaped);
+		if (nick_start) {
+			*nick_start = nick;
+			*nick_length = nick_end - nick;
+		}
+	}
+
+	return flags;
+}
+
+/* Works out when the lines of a log were written. Most lines only carry the
+ * time of day, so that is combined with the day the log started on, moving
+ * on to the next day whenever the clock goes back by more than an hour. */
+typedef struct {
+	time_t day_start;
+	int prev_secs;
+	time_t last;
+} LineClock;
+
+static void
+line_clock_init(LineClock *lc, const char *path)
+{
+	char *basename = g_path_get_basename(path);
+	time_t start = purple_str_to_time(basename, FALSE, NULL, NULL, NULL);
+	struct tm tm;
+
+	g_free(basename);
+
+	localtime_r(&start, &tm);
+	lc->prev_secs = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+	lc->day_start = start - lc->prev_secs;
+	lc->last = start;
+}
+
+/* Returns the time of line, or that of the line before if it has none. */
+static time_t
+line_clock_advance(LineClock *lc, const char *line, gsize len, gboolean system_log)
+{
+	const char *stamp, *stamp_end;
+	int secs;
+
+	if (system_log) {
+		stamp = g_strrstr_len(line, len, " @ ");
+		stamp_end = line + len;
+	} else {
+		stamp = g_strstr_len(line, len, "<font size=\"2\">(");
+		stamp_end = stamp ? g_strstr_len(stamp, line + len - stamp, ")</font>") : NULL;
+	}
+
+	if (stamp && stamp_end && parse_time_of_day(stamp, stamp_end, &secs)) {
+		if (secs + 3600 < lc->prev_secs)
+			lc->day_start += 24 * 60 * 60;
+		lc->prev_secs = secs;
+		lc->last = lc->day_start + secs;
+	}
+
+	return lc->last;
+}
+
+static gboolean
+log_path_is_system(const char *path)
+{
+	return strstr(path, G_DIR_SEPARATOR_S ".system" G_DIR_SEPARATOR_S) != NULL;
+}
+
+/* The index of the HTML log at path with the given contents, in file
+ * (little-endian) order. */
+static GArray *
+html_log_index(const char *path, const char *contents, gsize len)
+{
+	GArray *records;
+	const char *line, *end;
+	gboolean system_log;
+	LineClock lc;
+
+	line_clock_init(&lc, path);
+	system_log = log_path_is_system(path);
+	records = g_array_new(FALSE, FALSE, sizeof(LogIndexRecord));
+
+	end = contents + len;
+	line = memchr(contents, '\n', len);
+	line = line ? line + 1 : end;
+
+	while (line < end) {
+		const char *next = memchr(line, '\n', end - line);
+		gsize line_len = (next ? next + 1 : end) - line;
+		LogIndexRecord record;
+		guint32 nick_id;
+
+		if (line_has_prefix(line, line_len, "</body></html>"))
+			break;
+
+		record.offset = GUINT64_TO_LE(line - contents);
+		record.time = GINT64_TO_LE((gint64)line_clock_advance(&lc, line, line_len, system_log));
+		record.flags = GUINT32_TO_LE(guess_line_flags(line, line_len, system_log, &nick_id, NULL, NULL));
+		record.nick_id = GUINT32_TO_LE(nick_id);
+		g_array_append_val(records, record);
+
+		line += line_len;
+	}
+
+	return records;
+}
+
+/* The index of a binary log, in file (little-endian) order. */
+static GArray *
+binary_log_index(const char *contents, gsize len)
+{
+	GArray *records = g_array_new(FALSE, FALSE, sizeof(LogIndexRecord));
+	const BinaryNickName *nick;
+	BinaryReader reader;
+	BinaryMessage msg;
+	const char *body;
+	gsize body_len, offset;
+
+	if (!binary_reader_init(&reader, contents, len))
+		return records;
+
+	while (binary_reader_next(&reader, &offset, &msg, &body, &body_len, &nick)) {
+		LogIndexRecord record;
+
+		record.offset = GUINT64_TO_LE(offset);
+		record.time = GINT64_TO_LE(msg.time);
+		record.flags = GUINT32_TO_LE(msg.flags & ~LOG_FLAG_SHOW_DATE);
+		record.nick_id = GUINT32_TO_LE(nick ? g_str_hash(nick->name) : 0);
+		g_array_append_val(records, record);
+	}
+	binary_reader_clear(&reader);
+
+	return records;
+}
+
+/* Counts up a binary log for log_summary_rebuild(). */
+static void
+binary_log_summarize(const char *contents, gsize len, GHashTable *speakers,
+                     guint *messages, gint64 *first, gint64 *last)
+{
+	const BinaryNickName *nick;
+	BinaryReader reader;
+	BinaryMessage msg;
+	const char *body;
+	gsize body_len, offset;
+
+	if (!binary_reader_init(&reader, contents, len))
+		return;
+
+	while (binary_reader_next(&reader, &offset, &msg, &body, &body_len, &nick)) {
+		if ((*messages)++ == 0)
+			*first = msg.time;
+		*last = msg.time;
+
+		if (nick) {
+			char *unescaped = purple_unescape_html(nick->name);
+
+			summary_speakers_add(speakers, unescaped,
+			                     (msg.flags & PURPLE_MESSAGE_RECV) && *nick->color ?
+			                     nick->color : NULL);
+			g_free(unescaped);
+		}
+	}
+	binary_reader_clear(&reader);
+}
+
+/* Rebuilds the index of a log, for logs written before they had one.
+ * Returns records in file (little-endian) order, or NULL if the log cannot
+ * be read. */
+static GArray *
+log_index_rebuild(const char *path)
+{
+	GArray *records;
+	char *contents;
+	char *index_path;
+	gsize len;
+
+	if (!log_get_contents(path, &contents, &len))
+		return NULL;
+
+	if (log_is_binary(path))
+		records = binary_log_index(contents, len);
+	else
+		records = html_log_index(path, contents, len);
+	g_free(contents);
+
+	index_path = g_strconcat(path, INDEX_SUFFIX, NULL);
+	if (!g_file_set_contents(index_path, records->data,
+	                         records->len * sizeof(LogIndexRecord), NULL))
+		purple_debug_error("log", "Unable to write index %s\n", index_path);
+	g_free(index_path);
+
+	return records;
+}
+
+/* Returns the index of the log at path with its records in host order,
+ * rebuilding it first if there is none. Free with g_array_free(). */
+static GArray *
+log_index_load(const char *path)
+{
+	char *index_path = g_strconcat(path, INDEX_SUFFIX, NULL);
+	GArray *records;
+	char *contents;
+	gsize len;
+	guint i;
+
+	if (g_file_get_contents(index_path, &contents, &len, NULL)) {
+		guint n = len / sizeof(LogIndexRecord);
+
+		records = g_array_sized_new(FALSE, FALSE, sizeof(LogIndexRecord), n);
+		g_array_append_vals(records, contents, n);
+		g_free(contents);
+	} else if ((records = log_index_rebuild(path)) == NULL) {
+		g_free(index_path);
+		return NULL;
+	}
+	g_free(index_path);
+
+	for (i = 0; i < records->len; i++) {
+		LogIndexRecord *record = &g_array_index(records, LogIndexRecord, i);
+		record->offset = GUINT64_FROM_LE(record->offset);
+		record->time = GINT64_FROM_LE(record->time);
+		record->flags = GUINT32_FROM_LE(record->flags);
+		record->nick_id = GUINT32_FROM_LE(record->nick_id);
+	}
+
+	return records;
+}
+
+/* IPC "index-get": gboolean (const char *path, GArray **records)
+ * Hands back the index of a log, which the caller frees. */
+static gboolean
+ipc_index_get(const char *path, GArray **records)
+{
+	g_return_val_if_fail(path != NULL && records != NULL, FALSE);
+
+	*records = log_index_load(path);
+	return *records != NULL;
+}
+
+/* IPC "index-find-time": gboolean (const char *path, const time_t *when, goffset *offset)
+ * Finds the byte offset of the first message logged at or after when.
+ * Times in a log do not always go up (offline messages carry the time they
+ * were sent, and clocks get changed), so this scans rather than bisects;
+ * loading the index is linear anyway. */
+static gboolean
+ipc_index_find_time(const char *path, const time_t *when, goffset *offset)
+{
+	GArray *records;
+	gboolean found = FALSE;
+	guint i;
+
+	g_return_val_if_fail(path != NULL && when != NULL && offset != NULL, FALSE);
+
+	if ((records = log_index_load(path)) == NULL)
+		return FALSE;
+
+	for (i = 0; i < records->len; i++) {
+		const LogIndexRecord *record = &g_array_index(records, LogIndexRecord, i);
+
+		if (record->time >= *when) {
+			*offset = record->offset;
+			found = TRUE;
+			break;
+		}
+	}
+	g_array_free(records, TRUE);
+
+	return found;
+}
+
+/* IPC "pool-stats": gboolean (int *open, int *hits, int *misses)
+ * How many logs have their files open, and how many writes found their log
+ * open or had to reopen it since the plugin was loaded. */
+static gboolean
+ipc_pool_stats(int *open, int *hits, int *misses)
+{
+	*open = g_atomic_int_get(&pool_open);
+	*hits = g_atomic_int_get(&pool_hits);
+	*misses = g_atomic_int_get(&pool_misses);
+	return TRUE;
+}
+
+/* Rebuilds the summary of the log at path from its contents and saves it.
+ * Returns NULL if the log cannot be read. */
+static ColorNicksLogSummary *
+log_summary_rebuild(const char *path)
+{
+	ColorNicksLogSummary *summary;
+	GHashTable *speakers;
+	char *contents;
+	const char *line, *end;
+	gboolean system_log = log_path_is_system(path);
+	gint64 first = 0, last = 0;
+	guint messages = 0;
+	LineClock lc;
+	gsize len;
+
+	if (!log_get_contents(path, &contents, &len))
+		return NULL;
+
+	line_clock_init(&lc, path);
+	speakers = summary_speakers_new();
+
+	end = contents + len;
+	if (log_is_binary(path)) {
+		binary_log_summarize(contents, len, speakers, &messages, &first, &last);
+		line = end;
+	} else {
+		line = memchr(contents, '\n', len);
+		line = line ? line + 1 : end;
+	}
+
+	while (line < end) {
+		const char *next = memchr(line, '\n', end - line);
+		gsize line_len = (next ? next + 1 : end) - line;
+		time_t when = line_clock_advance(&lc, line, line_len, system_log);
+		const char *nick;
+		gsize nick_len;
+		guint32 nick_id, flags;
+
+		if (line_has_prefix(line, line_len, "</body></html>"))
+			break;
+
+		if (messages++ == 0)
+			first = when;
+		last = when;
+
+		flags = guess_line_flags(line, line_len, system_log, &nick_id, &nick, &nick_len);
+		if (nick) {
+			char *escaped = g_strndup(nick, nick_len);
+			char *unescaped = purple_unescape_html(escaped);
+			char *color = NULL;
+
+			if ((flags & PURPLE_MESSAGE_RECV) &&
+			    line_has_prefix(line, line_len, "<font color=\"") && line_len > 20)
+				color = g_strndup(line + strlen("<font color=\""), 7);
+			summary_speakers_add(speakers, unescaped, color);
+
+			g_free(color);
+			g_free(unescaped);
+			g_free(escaped);
+		}
+
+		line += line_len;
+	}
+
+	summary = log_summary_new(messages, first, last, len, speakers);
+	log_summary_save(path, summary);
+
+	g_hash_table_destroy(speakers);
+	g_free(contents);
+
+	return summary;
+}
+
+/* IPC "summary-get": gboolean (const char *path, ColorNicksLogSummary **summary)
+ * Hands back the summary of a log, which the caller frees. Only logs without
+ * a good summary are read. */
+static gboolean
+ipc_summary_get(const char *path, ColorNicksLogSummary **summary)
+{
+	g_return_val_if_fail(path != NULL && summary != NULL, FALSE);
+
+	if ((*summary = log_summary_load(path)) == NULL)
+		*summary = log_summary_rebuild(path);
+	return *summary != NULL;
+}
+
+/* IPC: reads *len bytes of the log at path from *offset on into *text, which
+ * is NUL-terminated and freed with g_free(). Offsets are the ones the index
+ * hands out, so this works the same on compressed logs. */
+static gboolean
+ipc_read_range(const char *path, const goffset *offset, const gsize *len, char **text)
+{
+	GMappedFile *mapped;
+	gsize size;
+
+	*text = NULL;
+	if (path == NULL || *offset < 0)
+		return FALSE;
+
+	if (log_is_compressed(path)) {
+		GString *read = compressed_log_read(path, *offset, *len);
+
+		if (read == NULL)
+			return FALSE;
+		*text = g_string_free(read, FALSE);
+		return TRUE;
+	}
+
+	if ((mapped = g_mapped_file_new(path, FALSE, NULL)) == NULL)
+		return FALSE;
+
+	size = g_mapped_file_get_length(mapped);
+	if ((guint64)*offset < size)
+		*text = g_strndup(g_mapped_file_get_contents(mapped) + *offset,
+		                  MIN(*len, size - *offset));
+	else
+		*text = g_strdup("");
+	g_mapped_file_unref(mapped);
+
+	return TRUE;
+}
+
+/* Paginated reading.
+ * colornicks_logger_read() hands back a log whole, while a viewer mostly
+ * wants its end. log_read_page() hands back the whole lines just before an
+ * offset, the end of the log to begin with, going back no more than a number
+ * of messages or bytes. The offset of its first line then asks for the page
+ * before it. Lines end in "<br/>\n", and their boundaries are found by
+ * scanning backward from the end of the page, fetching the log a block at a
+ * time, so a page costs about its own size however long the log is. For
+ * compressed logs only the frames holding the page are decompressed. */
+
+#define PAGE_BLOCK (64 * 1024)
+#define LINE_END "<br/>\n"
+
+typedef struct {
+	const char *path;
+	GMappedFile *mapped;  /* plain logs only */
+	guint64 size;         /* of the log, uncompressed */
+} PageSource;
+
+/* The log from start on, as far back as it has been fetched. Plain logs are
+ * read in place from their mapping. Compressed ones are decompressed into
+ * mem, which is filled from the back so that blocks fetched going backward
+ * need no moving; it is doubled when they run out of room. */
+typedef struct {
+	char *mem;            /* compressed logs only */
+	gsize size;           /* of mem */
+	gsize room;           /* free bytes in mem before str */
+	const char *str;
+	gsize len;
+	guint64 start;
+} PageBuffer;
+
+static gboolean
+page_source_open(PageSource *src, const char *path)
+{
+	GArray *frames;
+	GString *tail;
+	GStatBuf st;
+	guint64 framed = 0;
+	guint i;
+
+	src->path = path;
+	src->mapped = NULL;
+
+	if (!log_is_compressed(path)) {
+		if ((src->mapped = g_mapped_file_new(path, FALSE, NULL)) == NULL)
+			return FALSE;
+		src->size = g_mapped_file_get_length(src->mapped);
+		return TRUE;
+	}
+
+	/* The frame index says how long the log is up to its last frame; only
+	 * what comes after that has to be decompressed to know the rest. */
+	if (g_stat(path, &st) != 0)
+		return FALSE;
+	if ((frames = log_frames_load(path)) != NULL) {
+		for (i = 0; i < frames->len; i++) {
+			FrameRecord *frame = &g_array_index(frames, FrameRecord, i);
+			if (frame->end > (guint64)st.st_size)
+				break;
+			framed = frame->logical_end;
+		}
+		g_array_free(frames, TRUE);
+	}
+
+	if ((tail = compressed_log_read(path, framed, G_MAXSIZE)) == NULL)
+		return FALSE;
+	src->size = framed + tail->len;
+	g_string_free(tail, TRUE);
+
+	return TRUE;
+}
+
+static void
+page_source_close(PageSource *src)
+{
+	if (src->mapped)
+		g_mapped_file_unref(src->mapped);
+}
+
+/* Empties buf, to be filled backward from start. */
+static void
+page_buffer_reset(PageBuffer *buf, guint64 start)
+{
+	buf->room = buf->size;
+	buf->str = "";
+	buf->len = 0;
+	buf->start = start;
+}
+
+/* Adds the block of the log before buf->start, down to no further than
+ * body, to the front of buf. */
+static gboolean
+page_extend(PageSource *src, PageBuffer *buf, guint64 body)
+{
+	guint64 from = buf->start - MIN(PAGE_BLOCK, buf->start - body);
+	gsize n = buf->start - from;
+	GString *block;
+
+	if (src->mapped) {
+		buf->str = g_mapped_file_get_contents(src->mapped) + from;
+		buf->len += n;
+		buf->start = from;
+		return TRUE;
+	}
+
+	block = compressed_log_read(src->path, from, n);
+	if (block == NULL || block->len != n) {
+		if (block)
+			g_string_free(block, TRUE);
+		return FALSE;
+	}
+
+	if (buf->room < n) {
+		gsize size = MAX(buf->size * 2, buf->len + n);
+		char *mem = g_malloc(size);
+
+		memcpy(mem + size - buf->len, buf->str, buf->len);
+		g_free(buf->mem);
+		buf->mem = mem;
+		buf->size = size;
+		buf->room = size - buf->len;
+	}
+	buf->room -= n;
+	memcpy(buf->mem + buf->room, block->str, n);
+	g_string_free(block, TRUE);
+
+	buf->str = buf->mem + buf->room;
+	buf->len += n;
+	buf->start = from;
+
+	return TRUE;
+}
+
+/* Returns the start of the last line that starts at or before pos: right
+ * after a LINE_END, or body if there is none. buf grows backward as needed.
+ * Returns G_MAXUINT64 if the log cannot be read. */
+static guint64
+page_line_start(PageSource *src, PageBuffer *buf, guint64 body, guint64 pos)
+{
+	const gsize n = strlen(LINE_END);
+
+	for (; pos >= body + n; pos--) {
+		const char *end;
+
+		if (pos - n < buf->start && !page_extend(src, buf, body))
+			return G_MAXUINT64;
+
+		end = buf->str + (pos - buf->start);
+		if (end[-1] == '\n' && memcmp(end - n, LINE_END, n) == 0)
+			return pos;
+	}
+
+	return body;
+}
+
+/* Returns the lines of the log at path that end at or before offset before
+ * (or the end of the log if it is negative): the last max_messages of them,
+ * and no more of them than fit in max_bytes, though always at least one.
+ * Either limit may be 0 for none. *start is set to where the first of them
+ * starts, which is the offset to pass for the page before. Anything after
+ * the last whole line (the footer, or a line still being written) is left
+ * out. Returns NULL if the log cannot be read, or is a binary log, which has
+ * no lines to page through. */
+static char *
+log_read_page(const char *path, goffset before, guint max_messages, gsize max_bytes,
+              goffset *start)
+{
+	PageSource src;
+	PageBuffer buf = { NULL, 0 };
+	guint64 body = 0, end, pos;
+	guint messages = 0;
+	char *page = NULL;
+
+	if (log_is_binary(path) || !page_source_open(&src, path))
+		return NULL;
+
+	/* Pages never take in the header line. */
+	page_buffer_reset(&buf, MIN(src.size, PAGE_BLOCK));
+	if (page_extend(&src, &buf, 0)) {
+		const char *header_end = memchr(buf.str, '\n', buf.len);
+		if (header_end)
+			body = header_end + 1 - buf.str;
+	}
+
+	end = before < 0 ? src.size : MIN((guint64)before, src.size);
+	end = MAX(end, body);
+	page_buffer_reset(&buf, end);
+
+	end = page_line_start(&src, &buf, body, end);
+	pos = end;
+	while (pos != G_MAXUINT64 && pos > body &&
+	       (max_messages == 0 || messages < max_messages)) {
+		guint64 prev = page_line_start(&src, &buf, body, pos - 1);
+
+		if (prev == G_MAXUINT64 ||
+		    (max_bytes > 0 && messages > 0 && end - prev > max_bytes))
+			break;
+		pos = prev;
+		messages++;
+	}
+
+	if (end != G_MAXUINT64) {
+		page = g_strndup(buf.str + (pos - buf.start), end - pos);
+		*start = pos;
+	}
+
+	g_free(buf.mem);
+	page_source_close(&src);
+
+	return page;
+}
+
+/* IPC "read-page": gboolean (const char *path, goffset *offset,
+ *                            const guint *max_messages, const gsize *max_bytes,
+ *                            char **text)
+ * Reads the page of the log at path that ends at *offset, -1 for the end of
+ * the log, into *text; see log_read_page(). *offset is moved to the start
+ * of the page, so calling again with it reads the page before. A page that
+ * starts at the first line of the log is the last one. */
+static gboolean
+ipc_read_page(const char *path, goffset *offset, const guint *max_messages,
+              const gsize *max_bytes, char **text)
+{
+	g_return_val_if_fail(path != NULL && offset != NULL && text != NULL, FALSE);
+
+	*text = log_read_page(path, *offset, max_messages ? *max_messages : 0,
+	                      max_bytes ? *max_bytes : 0, offset);
+	return *text != NULL;
+}
+
+/* Adds the store filenames the log at path shows to refs. */
+static void
+image_store_refs(const char *path, GHashTable *refs)
+{
+	static const char marker[] = IMAGE_STORE_DIR "/";
+	GMappedFile *mapped = NULL;
+	char *contents = NULL;
+	const char *p, *end;
+	gsize len;
+
+	if (log_is_compressed(path)) {
+		if (!log_get_contents(path, &contents, &len))
+			return;
+		p = contents;
+	} else {
+		if ((mapped = g_mapped_file_new(path, FALSE, NULL)) == NULL)
+			return;
+		p = g_mapped_file_get_contents(mapped);
+		len = g_mapped_file_get_length(mapped);
+	}
+
+	for (end = p + len; p && (p = memchr(p, marker[0], end - p)) != NULL; ) {
+		const char *name, *q;
+
+		if ((gsize)(end - p) <= sizeof(marker) - 1 ||
+		    memcmp(p, marker, sizeof(marker) - 1) != 0) {
+			p++;
+			continue;
+		}
+
+		name = q = p + sizeof(marker) - 1;
+		while (q < end && *q != '"' && *q != '\'' && *q != '>' && *q != '/' &&
+		       *q != '\\' && !g_ascii_isspace(*q))
+			q++;
+		/* Anything typed to look like one must not lead out of the store. */
+		if (q > name && *name != '.')
+			g_hash_table_add(refs, g_strndup(name, q - name));
+		p = q;
+	}
+
+	if (mapped)
+		g_mapped_file_unref(mapped);
+	g_free(contents);
+}
+
+/* Copies the images named in refs from the image store at src_dir into the
+ * one at dest_dir. */
+static void
+image_store_copy(const char *src_dir, const char *dest_dir, GHashTable *refs)
+{
+	GHashTableIter iter;
+	gpointer name;
+
+	if (g_hash_table_size(refs) > 0 &&
+	    g_mkdir_with_parents(dest_dir, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		thread_debug_error("Unable to create directory %s: %s\n", dest_dir, g_strerror(errno));
+
+	g_hash_table_iter_init(&iter, refs);
+	while (g_hash_table_iter_next(&iter, &name, NULL)) {
+		char *src_path = g_build_filename(src_dir, name, NULL);
+		char *dest_path = g_build_filename(dest_dir, name, NULL);
+		GFile *src = g_file_new_for_path(src_path);
+		GFile *dest = g_file_new_for_path(dest_path);
+
+		/* Images are named by content, so one already there is the same. */
+		if (!g_file_test(dest_path, G_FILE_TEST_EXISTS))
+			g_file_copy(src, dest, G_FILE_COPY_NONE, NULL, NULL, NULL, NULL);
+
+		g_object_unref(dest);
+		g_object_unref(src);
+		g_free(dest_path);
+		g_free(src_path);
+	}
+}
+
+/* Log conversion.
+ * Converts a tree of logs file by file, keeping their paths relative to the
+ * root: stock html and txt logs into colornicks logs, and colornicks logs
+ * back into html or txt, or into JSON lines with an object per message.
+ * Files are streamed a line at a time by a pool of one worker per core, and
+ * each is written under a temporary name that is renamed once complete. A
+ * journal in the destination lists the files that are done, so starting a
+ * stopped conversion again picks up where it left off. Received nicks get
+ * the colors get_nick_color() gives them in an open conversation, or the
+ * stock colors if there is no conversation to take the theme from. Html
+ * logs take the images they show along, into an image store at the root of
+ * the destination. */
+
+#define CONVERT_JOURNAL "colornicks-convert.done"
+#define CONVERT_QUEUE_MAX 1024  /* files waiting for a worker */
+
+typedef enum {
+	CONVERT_TO_COLORNICKS,
+	CONVERT_TO_HTML,
+	CONVERT_TO_TXT,
+	CONVERT_TO_JSONL,
+	CONVERT_FORMAT_COUNT
+} ConvertFormat;
+
+static const char * const convert_format_names[CONVERT_FORMAT_COUNT] = {
+	"colornicks", "html", "txt", "jsonl"
+};
+static const char * const convert_format_exts[CONVERT_FORMAT_COUNT] = {
+	".htm", ".html", ".txt", ".jsonl"
+};
+
+/* The nick colors of a conversation, copied so workers can use them. */
+typedef struct {
+	GArray *colors;      /* GdkColor */
+	float base_factor;
+	float white_lum;
+} NickPalette;
+
+typedef struct {
+	char *src;
+	char *dest;
+	ConvertFormat format;
+	NickPalette *palette;   /* NULL for the stock colors */
+	GHashTable *done;       /* relative paths already in the journal */
+
+	GMutex lock;            /* guards the rest */
+	FILE *journal;
+	guint converted;
+	guint failed;
+} Conversion;
+
+static Conversion *conversion = NULL;
+static GThread *conversion_thread = NULL;
+static volatile gint conversion_cancel = 0;
+static guint conversion_done_source = 0;
+
+/* Copies the nick colors of the first conversation window that has them.
+ * Returns NULL when no window is open. */
+static NickPalette *
+nick_palette_snapshot(void)
+{
+	GList *l;
+
+	for (l = purple_get_conversations(); l; l = l->next) {
+		PurpleConversation *conv = l->data;
+		PidginConversation *gtkconv;
+		NickColorCache *cache;
+		NickPalette *palette;
+
+		if (!PIDGIN_IS_PIDGIN_CONVERSATION(conv))
+			continue;
+		gtkconv = PIDGIN_CONVERSATION(conv);
+		if (gtkconv->nick_colors == NULL || gtkconv->nick_colors->len == 0)
+			continue;
+
+		if ((cache = nick_color_cache_get(conv, gtkconv)) == NULL)
+			continue;
+		palette = g_new(NickPalette, 1);
+		palette->colors = g_array_sized_new(FALSE, FALSE, sizeof(GdkColor), cache->palette_len);
+		g_array_append_vals(palette->colors, gtkconv->nick_colors->data, cache->palette_len);
+		palette->base_factor = cache->base_factor;
+		palette->white_lum = cache->white_lum;
+		return palette;
+	}
+
+	return NULL;
+}
+
+/* The color of the nick with nick_id (the g_str_hash() of the escaped nick),
+ * formatted into hex, or NULL for the stock colors. */
+static const char *
+convert_nick_color(const Conversion *c, guint32 nick_id, char hex[8])
+{
+	if (c->palette == NULL || nick_id == 0)
+		return NULL;
+
+	nick_color_format(g_array_index(c->palette->colors, GdkColor, nick_id % c->palette->colors->len),
+	                  c->palette->base_factor, c->palette->white_lum, hex);
+	return hex;
+}
+
+/* Appends line with the color of its leading <font color="..."> replaced. */
+static void
+convert_recolor(GString *out, const char *line, gsize len, const char *color)
+{
+	const char *rest = line + strlen("<font color=\"");
+	const char *quote = memchr(rest, '"', line + len - rest);
+
+	if (quote == NULL) {
+		g_string_append_len(out, line, len);
+		return;
+	}
+
+	g_string_append(out, "<font color=\"");
+	g_string_append(out, color);
+	g_string_append_len(out, quote, line + len - quote);
+}
+
+static void
+convert_html_header(GString *out, const char *header)
+{
+	char *escaped = g_markup_escape_text(header, -1);
+
+	g_string_append(out, "<html><head>");
+	g_string_append(out, "<meta http-equiv=\"content-type\" content=\"text/html; charset=UTF-8\">");
+	g_string_append_printf(out, "<title>%s</title></head><body><h3>%s</h3>\n", escaped, escaped);
+	g_free(escaped);
+}
+
+/* The ids of the nicks that sent plain lines in the html log at src_path. */
+static GHashTable *
+convert_own_nicks(const char *src_path)
+{
+	GHashTable *own = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GFile *file = g_file_new_for_path(src_path);
+	GFileInputStream *in = g_file_read(file, NULL, NULL);
+	GDataInputStream *lines;
+	guint32 nick_id;
+	char *read;
+	gsize len;
+
+	g_object_unref(file);
+	if (in == NULL)
+		return own;
+
+	lines = g_data_input_stream_new(G_INPUT_STREAM(in));
+	g_object_unref(in);
+	g_data_input_stream_set_newline_type(lines, G_DATA_STREAM_NEWLINE_TYPE_LF);
+
+	while ((read = g_data_input_stream_read_line(lines, &len, NULL, NULL)) != NULL) {
+		if (line_has_prefix(read, len, "<font color=\"#16569E\">") &&
+		    (guess_line_flags(read, len, FALSE, &nick_id, NULL, NULL) & PURPLE_MESSAGE_SEND) &&
+		    nick_id != 0)
+			g_hash_table_add(own, GUINT_TO_POINTER(nick_id));
+		g_free(read);
+	}
+
+	g_object_unref(lines);
+	return own;
+}
+
+/* Stock html to colornicks: received lines take their nick's color. /me
+ * lines are #062585 whichever way they went (and so are colornicks ones
+ * whose nick had no color), so those are taken to be received unless their
+ * nick is in own_nicks. */
+static void
+convert_line_from_html(const Conversion *c, GString *out, const char *line, gsize len,
+                       gboolean system_log, GHashTable *own_nicks)
+{
+	guint32 nick_id;
+	guint32 flags = guess_line_flags(line, len, system_log, &nick_id, NULL, NULL);
+	const char *color;
+	char hex[8];
+
+	if ((flags & PURPLE_MESSAGE_SEND) && nick_id != 0 &&
+	    line_has_prefix(line, len, "<font color=\"#062585\">") &&
+	    !g_hash_table_contains(own_nicks, GUINT_TO_POINTER(nick_id)))
+		flags = PURPLE_MESSAGE_RECV;
+
+	if ((flags & PURPLE_MESSAGE_RECV) && line_has_prefix(line, len, "<font color=\"") &&
+	    (color = convert_nick_color(c, nick_id, hex)) != NULL)
+		convert_recolor(out, line, len, color);
+	else
+		g_string_append_len(out, line, len);
+}
+
+/* Stock txt to colornicks. Plain text cannot tell sent lines from received
+ * ones, so every line with a sender is written as received. */
+static void
+convert_line_from_txt(const Conversion *c, GString *out, const char *line, gsize len)
+{
+	char *text = g_strndup(line, len), *escaped;
+	char *stamp, *rest, *nick = NULL, *msg, *sep;
+	const LineTemplate *tpl;
+	GString *escaped_nick;
+	char hex[8];
+
+	g_strchomp(text);
+
+	if (g_str_has_prefix(text, "---- ") || *text != '(' ||
+	    (sep = strstr(text, ") ")) == NULL) {
+		escaped = g_markup_escape_text(text, -1);
+		g_string_append_printf(out, "%s<br/>\n", escaped);
+		g_free(escaped);
+		g_free(text);
+		return;
+	}
+
+	*sep = '\0';
+	stamp = text + 1;
+	rest = sep + 2;
+
+	if (g_str_has_prefix(rest, "***") && (sep = strchr(rest, ' ')) != NULL) {
+		*sep = '\0';
+		nick = rest + 3;
+		msg = sep + 1;
+		tpl = &templates[TEMPLATE_RECV_ME];
+	} else if ((sep = strstr(rest, " <AUTO-REPLY>: ")) != NULL) {
+		*sep = '\0';
+		nick = rest;
+		msg = sep + strlen(" <AUTO-REPLY>: ");
+		tpl = &templates[TEMPLATE_AUTO_RESP_RECV];
+	} else if ((sep = strstr(rest, ": ")) != NULL && sep - rest <= 64) {
+		*sep = '\0';
+		nick = rest;
+		msg = sep + 2;
+		tpl = &templates[TEMPLATE_RECV];
+	} else {
+		msg = rest;
+		tpl = &templates[TEMPLATE_SYSTEM];
+	}
+
+	escaped_nick = g_string_new(NULL);
+	if (nick)
+		append_escaped(escaped_nick, nick);
+	escaped = g_markup_escape_text(msg, -1);
+	render_template(out, tpl, stamp, escaped, escaped_nick->str,
+	                nick ? convert_nick_color(c, g_str_hash(escaped_nick->str), hex) : NULL);
+
+	g_free(escaped);
+	g_string_free(escaped_nick, TRUE);
+	g_free(text);
+}
+
+/* Colornicks to stock html: received lines go back to the stock colors. */
+static void
+convert_line_to_html(GString *out, const char *line, gsize len, gboolean system_log)
+{
+	guint32 nick_id;
+	guint32 flags = guess_line_flags(line, len, system_log, &nick_id, NULL, NULL);
+
+	if (!(flags & PURPLE_MESSAGE_RECV) || !line_has_prefix(line, len, "<font color=\""))
+		g_string_append_len(out, line, len);
+	else if (flags & PURPLE_MESSAGE_WHISPER)
+		convert_recolor(out, line, len, "#6C2585");
+	else if (g_strstr_len(line, len, "<b>***") != NULL)
+		convert_recolor(out, line, len, "#062585");
+	else
+		convert_recolor(out, line, len, "#A82F2F");
+}
+
+static void
+convert_line_to_txt(GString *out, const char *line, gsize len)
+{
+	char *text = g_strndup(line, len);
+	char *plain = purple_markup_strip_html(text);
+
+	g_string_append(out, g_strchomp(plain));
+	g_string_append_c(out, '\n');
+
+	g_free(plain);
+	g_free(text);
+}
+
+static void
+json_append_string(GString *out, const char *text)
+{
+	const guchar *p;
+
+	g_string_append_c(out, '"');
+	for (p = (const guchar *)text; *p; p++) {
+		switch (*p) {
+		case '"':
+			g_string_append(out, "\\\"");
+			break;
+		case '\\':
+			g_string_append(out, "\\\\");
+			break;
+		case '\n':
+			g_string_append(out, "\\n");
+			break;
+		case '\r':
+			g_string_append(out, "\\r");
+			break;
+		case '\t':
+			g_string_append(out, "\\t");
+			break;
+		default:
+			if (*p < 0x20)
+				g_string_append_printf(out, "\\u%04x", *p);
+			else
+				g_string_append_c(out, *p);
+			break;
+		}
+	}
+	g_string_append_c(out, '"');
+}
+
+/* {"time":..., "flags":..., "nick":..., "text":...}, with nick null for
+ * lines without a sender, and text the message without its markup. */
+static void
+convert_line_to_jsonl(GString *out, const char *line, gsize len, gboolean system_log,
+                      LineClock *lc)
+{
+	time_t when = line_clock_advance(lc, line, len, system_log);
+	const char *end = line + len, *nick, *body = line;
+	guint32 nick_id, flags;
+	gsize nick_len;
+	char *text, *plain;
+
+	flags = guess_line_flags(line, len, system_log, &nick_id, &nick, &nick_len);
+
+	/* The message follows the sender, or else the timestamp. */
+	if (nick && (body = g_strstr_len(nick + nick_len, end - (nick + nick_len), "</b>")) != NULL)
+		body += strlen("</b>");
+	else if (!system_log && (body = g_strstr_len(line, len, ")</font>")) != NULL)
+		body += strlen(")</font>");
+	else
+		body = line;
+	if (end - body >= 7 && strncmp(body, "</font>", 7) == 0)
+		body += 7;
+
+	g_string_append_printf(out, "{\"time\":%" G_GINT64_FORMAT ",\"flags\":%u,\"nick\":",
+	                       (gint64)when, flags);
+	if (nick) {
+		char *escaped = g_strndup(nick, nick_len);
+		char *unescaped = purple_unescape_html(escaped);
+		json_append_string(out, unescaped);
+		g_free(unescaped);
+		g_free(escaped);
+	} else
+		g_string_append(out, "null");
+
+	text = g_strndup(body, end - body);
+	plain = purple_markup_strip_html(text);
+	g_string_append(out, ",\"text\":");
+	json_append_string(out, g_strstrip(plain));
+	g_string_append(out, "}\n");
+
+	g_free(plain);
+	g_free(text);
+}
+
+/* The header of a colornicks or stock html log, as text. */
+static void
+convert_header_to_txt(GString *out, const char *line, gsize len)
+{
+	const char *start = g_strstr_len(line, len, "<h3>");
+	const char *end = start ? g_strstr_len(start, line + len - start, "</h3>") : NULL;
+
+	if (start && end)
+		convert_line_to_txt(out, start + 4, end - start - 4);
+	else
+		convert_line_to_txt(out, line, len);
+}
+
+/* Makes the image store references in buf relative to images instead. */
+static void
+convert_rebase_images(GString *buf, const char *images)
+{
+	const gsize n = strlen(IMAGE_STORE_RELATIVE);
+	gsize pos = 0;
+	const char *ref;
+
+	while ((ref = g_strstr_len(buf->str + pos, buf->len - pos, IMAGE_STORE_RELATIVE)) != NULL) {
+		pos = ref - buf->str;
+		g_string_erase(buf, pos, n);
+		g_string_insert(buf, pos, images);
+		pos += strlen(images);
+	}
+}
+
+/* Converts the log at src_path into out, a line at a time. images, if not
+ * NULL, is where the converted log finds the image store, when that is not
+ * IMAGE_STORE_RELATIVE. */
+static gboolean
+convert_stream(const Conversion *c, const char *src_path, FILE *out, const char *images)
+{
+	GFile *file = g_file_new_for_path(src_path);
+	GFileInputStream *in = g_file_read(file, NULL, NULL);
+	GDataInputStream *lines;
+	gboolean system_log = log_path_is_system(src_path);
+	gboolean from_txt = g_str_has_suffix(src_path, ".txt");
+	gboolean header = TRUE, ok = TRUE;
+	GHashTable *own_nicks = NULL;
+	GString *line, *buf;
+	LineClock lc;
+	char *read;
+	gsize len;
+
+	g_object_unref(file);
+	if (in == NULL)
+		return FALSE;
+
+	lines = g_data_input_stream_new(G_INPUT_STREAM(in));
+	g_object_unref(in);
+	g_data_input_stream_set_newline_type(lines, G_DATA_STREAM_NEWLINE_TYPE_LF);
+
+	if (c->format == CONVERT_TO_COLORNICKS && !from_txt && !system_log)
+		own_nicks = convert_own_nicks(src_path);
+
+	line_clock_init(&lc, src_path);
+	line = g_string_sized_new(256);
+	buf = g_string_sized_new(256);
+
+	while ((read = g_data_input_stream_read_line(lines, &len, NULL, NULL)) != NULL) {
+		g_string_truncate(line, 0);
+		g_string_append_len(line, read, len);
+		g_string_append_c(line, '\n');
+		g_free(read);
+		g_string_truncate(buf, 0);
+
+		if (header) {
+			header = FALSE;
+			if (c->format == CONVERT_TO_TXT)
+				convert_header_to_txt(buf, line->str, line->len);
+			else if (c->format == CONVERT_TO_COLORNICKS && from_txt)
+				convert_html_header(buf, g_strchomp(line->str));
+			else if (c->format != CONVERT_TO_JSONL)
+				g_string_append_len(buf, line->str, line->len);
+		} else if (line_has_prefix(line->str, line->len, "</body></html>")) {
+			if (c->format == CONVERT_TO_COLORNICKS || c->format == CONVERT_TO_HTML)
+				g_string_append_len(buf, line->str, line->len);
+		} else if (c->format == CONVERT_TO_COLORNICKS) {
+			if (from_txt)
+				convert_line_from_txt(c, buf, line->str, line->len);
+			else
+				convert_line_from_html(c, buf, line->str, line->len, system_log, own_nicks);
+		} else if (c->format == CONVERT_TO_HTML) {
+			convert_line_to_html(buf, line->str, line->len, system_log);
+			if (images)
+				convert_rebase_images(buf, images);
+		} else if (c->format == CONVERT_TO_TXT)
+			convert_line_to_txt(buf, line->str, line->len);
+		else
+			convert_line_to_jsonl(buf, line->str, line->len, system_log, &lc);
+
+		if (buf->len > 0 && fwrite(buf->str, 1, buf->len, out) != buf->len) {
+			ok = FALSE;
+			break;
+		}
+	}
+
+	/* Stock txt logs have no footer of their own. */
+	if (ok && c->format == CONVERT_TO_COLORNICKS && from_txt && !header)
+		ok = fputs(LOG_FOOTER, out) >= 0;
+
+	if (own_nicks)
+		g_hash_table_destroy(own_nicks);
+	g_string_free(buf, TRUE);
+	g_string_free(line, TRUE);
+	g_object_unref(lines);
+
+	return ok;
+}
+
+/* Whether a file named name is something the conversion reads. */
+static gboolean
+convert_is_source(const Conversion *c, const char *name)
+{
+	if (c->format == CONVERT_TO_COLORNICKS)
+		return g_str_has_suffix(name, ".html") || g_str_has_suffix(name, ".txt");
+	return g_str_has_suffix(name, ".htm");
+}
+
+static void
+convert_worker_func(gpointer data, gpointer user_data)
+{
+	Conversion *c = user_data;
+	char *relpath = data;
+	char *src, *dest, *tmp, *dir, *dot, *images = NULL;
+	gboolean ok = FALSE;
+	FILE *out;
+
+	if (g_atomic_int_get(&conversion_cancel)) {
+		g_free(relpath);
+		return;
+	}
+
+	src = g_build_filename(c->src, relpath, NULL);
+	dest = g_build_filename(c->dest, relpath, NULL);
+	if ((dot = strrchr(dest, '.')) != NULL)
+		*dot = '\0';
+	tmp = g_strconcat(dest, convert_format_exts[c->format], NULL);
+	g_free(dest);
+	dest = tmp;
+	tmp = g_strconcat(dest, ".part", NULL);
+
+	dir = g_path_get_dirname(dest);
+	if (g_mkdir_with_parents(dir, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		thread_debug_error("Unable to create %s\n", dir);
+	g_free(dir);
+
+	/* Html keeps the images. The log finds them IMAGE_STORE_RELATIVE, so
+	 * the destination gets a store of its own at its root, which is there
+	 * too unless the logs sit at another depth below it. */
+	if (c->format == CONVERT_TO_HTML) {
+		GString *up = g_string_new(NULL);
+		const char *p;
+
+		for (p = relpath; (p = strchr(p, G_DIR_SEPARATOR)) != NULL; p++)
+			g_string_append(up, "../");
+		g_string_append(up, IMAGE_STORE_DIR "/");
+		if (strcmp(up->str, IMAGE_STORE_RELATIVE) != 0)
+			images = g_string_free(up, FALSE);
+		else
+			g_string_free(up, TRUE);
+	}
+
+	if ((out = g_fopen(tmp, "wb")) != NULL) {
+		ok = convert_stream(c, src, out, images);
+		if (fclose(out) != 0)
+			ok = FALSE;
+		if (ok && g_rename(tmp, dest) != 0)
+			ok = FALSE;
+		if (!ok)
+			g_unlink(tmp);
+	}
+
+	if (ok && c->format == CONVERT_TO_HTML) {
+		GHashTable *refs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		char *src_dir = g_path_get_dirname(src);
+		char *src_store = g_build_filename(src_dir, "..", "..", "..", IMAGE_STORE_DIR, NULL);
+		char *dest_store = g_build_filename(c->dest, IMAGE_STORE_DIR, NULL);
+
+		image_store_refs(dest, refs);
+		image_store_copy(src_store, dest_store, refs);
+
+		g_free(dest_store);
+		g_free(src_store);
+		g_free(src_dir);
+		g_hash_table_destroy(refs);
+	}
+
+	if (!ok)
+		thread_debug_error("Unable to convert %s to %s\n", src, dest);
+
+	g_mutex_lock(&c->lock);
+	if (ok) {
+		c->converted++;
+		if (c->journal) {
+			fprintf(c->journal, "%s\n", relpath);
+			fflush(c->journal);
+		}
+	} else
+		c->failed++;
+	g_mutex_unlock(&c->lock);
+
+	g_free(images);
+	g_free(tmp);
+	g_free(dest);
+	g_free(src);
+	g_free(relpath);
+}
+
+static void
+convert_walk(Conversion *c, GThreadPool *pool, const char *relpath)
+{
+	char *path = relpath ? g_build_filename(c->src, relpath, NULL) : g_strdup(c->src);
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const char *name;
+
+	if (dir == NULL) {
+		g_free(path);
+		return;
+	}
+
+	while ((name = g_dir_read_name(dir)) != NULL && !g_atomic_int_get(&conversion_cancel)) {
+		char *child = relpath ? g_build_filename(relpath, name, NULL) : g_strdup(name);
+		char *child_path = g_build_filename(path, name, NULL);
+
+		if (g_file_test(child_path, G_FILE_TEST_IS_DIR)) {
+			/* Do not descend into our own output. */
+			if (strcmp(child_path, c->dest) != 0)
+				convert_walk(c, pool, child);
+			g_free(child);
+		} else if (!convert_is_source(c, name) || g_hash_table_contains(c->done, child)) {
+			g_free(child);
+		} else {
+			/* Millions of logs should not all wait in memory at once. */
+			while (g_thread_pool_unprocessed(pool) >= CONVERT_QUEUE_MAX &&
+			       !g_atomic_int_get(&conversion_cancel))
+				g_usleep(10 * 1000);
+			g_thread_pool_push(pool, child, NULL);
+		}
+		g_free(child_path);
+	}
+
+	g_dir_close(dir);
+	g_free(path);
+}
+
+/* Reports on the conversion that just ended and frees it. */
+static void
+conversion_finish(void)
+{
+	purple_debug_info("colornicks", "Converted %u logs from %s into %s (%s), %u failed\n",
+	                  conversion->converted, conversion->src, conversion->dest,
+	                  convert_format_names[conversion->format], conversion->failed);
+
+	if (conversion->journal)
+		fclose(conversion->journal);
+	if (conversion->palette) {
+		g_array_free(conversion->palette->colors, TRUE);
+		g_free(conversion->palette);
+	}
+	g_hash_table_destroy(conversion->done);
+	g_mutex_clear(&conversion->lock);
+	g_free(conversion->src);
+	g_free(conversion->dest);
+	g_free(conversion);
+	conversion = NULL;
+}
+
+static gboolean
+conversion_done_cb(gpointer unused)
+{
+	g_thread_join(conversion_thread);
+	conversion_thread = NULL;
+	conversion_done_source = 0;
+	conversion_finish();
+
+	return FALSE;
+}
+
+static gpointer
+conversion_thread_func(gpointer data)
+{
+	Conversion *c = data;
+	GThreadPool *pool = g_thread_pool_new(convert_worker_func, c,
+	                                      MAX(g_get_num_processors(), 1), TRUE, NULL);
+
+	convert_walk(c, pool, NULL);
+
+	/* Waits for the workers to finish what was queued. */
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	conversion_done_source = g_idle_add(conversion_done_cb, NULL);
+	return NULL;
+}
+
+/* Starts converting the logs under src into dest. Returns FALSE if a
+ * conversion is already running or format is not one we know, or if format
+ * is colornicks and no conversation window is open to take nick colors
+ * from: the palette is built by gtkconv against the window's background. */
+static gboolean
+conversion_start(const char *src, const char *dest, const char *format)
+{
+	NickPalette *palette = NULL;
+	Conversion *c;
+	char *journal_path, *contents;
+	int i;
+
+	if (conversion != NULL || src == NULL || dest == NULL || format == NULL)
+		return FALSE;
+
+	for (i = 0; i < CONVERT_FORMAT_COUNT; i++)
+		if (g_ascii_strcasecmp(format, convert_format_names[i]) == 0)
+			break;
+	if (i == CONVERT_FORMAT_COUNT)
+		return FALSE;
+
+	if (i == CONVERT_TO_COLORNICKS && (palette = nick_palette_snapshot()) == NULL) {
+		purple_debug_error("colornicks", "Converting to colornicks needs an open conversation "
+		                   "window to take the nick colors from\n");
+		return FALSE;
+	}
+
+	if (purple_build_dir(dest, S_IRUSR | S_IWUSR | S_IXUSR) != 0) {
+		purple_debug_error("colornicks", "Unable to create %s\n", dest);
+		if (palette) {
+			g_array_free(palette->colors, TRUE);
+			g_free(palette);
+		}
+		return FALSE;
+	}
+
+	c = g_new0(Conversion, 1);
+	c->src = g_strdup(src);
+	c->dest = g_strdup(dest);
+	c->format = i;
+	c->palette = palette;
+	c->done = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_mutex_init(&c->lock);
+
+	journal_path = g_build_filename(dest, CONVERT_JOURNAL, NULL);
+	if (g_file_get_contents(journal_path, &contents, NULL, NULL)) {
+		char **lines = g_strsplit(contents, "\n", -1), **l;
+
+		for (l = lines; *l; l++)
+			if (**l)
+				g_hash_table_add(c->done, g_strdup(*l));
+		g_strfreev(lines);
+		g_free(contents);
+	}
+	c->journal = g_fopen(journal_path, "a");
+	if (c->journal == NULL)
+		purple_debug_error("colornicks", "Unable to open %s; the conversion cannot be resumed\n",
+		                   journal_path);
+	g_free(journal_path);
+
+	conversion = c;
+	g_atomic_int_set(&conversion_cancel, 0);
+	conversion_thread = g_thread_new("colornicks-convert", conversion_thread_func, c);
+
+	return TRUE;
+}
+
+/* Stops a running conversion; starting it again resumes it. */
+static void
+conversion_stop(void)
+{
+	if (conversion_thread == NULL)
+		return;
+
+	g_atomic_int_set(&conversion_cancel, 1);
+	g_thread_join(conversion_thread);
+	conversion_thread = NULL;
+
+	if (conversion_done_source) {
+		g_source_remove(conversion_done_source);
+		conversion_done_source = 0;
+	}
+	conversion_finish();
+}
+
+/* IPC "convert": gboolean (const char *src_dir, const char *dest_dir, const char *format)
+ * Converts the logs under src_dir into dest_dir in the background. format is
+ * "colornicks" (from stock html and txt logs), or "html", "txt" or "jsonl"
+ * (from colornicks logs). */
+static gboolean
+ipc_convert(const char *src_dir, const char *dest_dir, const char *format)
+{
+	return conversion_start(src_dir, dest_dir, format);
+}
+
+static char *colornicks_logger_read(PurpleLog *log, PurpleLogReadFlags *flags)
+{
+	char *read;
+	PurpleLogCommonLoggerData *data = log->logger_data;
+	*flags = PURPLE_LOG_READ_NO_NEWLINE;
+	if (!data || !data->path)
+		return g_strdup(_("<font color=\"red\"><b>Unable to find log path!</b></font>"));
+	if ((read = read_log_body(data->path)) != NULL)
+		return read;
+	return g_strdup_printf(_("<font color=\"red\"><b>Could not read file: %s</b></font>"), data->path);
+}
+
+static int colornicks_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account)
+{
+	return size_ledger_total(type, name, account, ".htm");
+}
+
+static GList *colornicks_bin_logger_list(PurpleLogType type, const char *sn, PurpleAccount *account)
+{
+	return log_listing_get(type, sn, account, BINARY_EXT, colornicks_bin_logger);
+}
+
+static GList *colornicks_bin_logger_list_syslog(PurpleAccount *account)
+{
+	return log_listing_get(PURPLE_LOG_SYSTEM, ".system", account, BINARY_EXT, colornicks_bin_logger);
+}
+
+static char *colornicks_bin_logger_read(PurpleLog *log, PurpleLogReadFlags *flags)
+{
+	PurpleLogCommonLoggerData *data = log->logger_data;
+	GMappedFile *mapped;
+	char *read = NULL;
+
+	*flags = PURPLE_LOG_READ_NO_NEWLINE;
+	if (!data || !data->path)
+		return g_strdup(_("<font color=\"red\"><b>Unable to find log path!</b></font>"));
+
+	if ((mapped = g_mapped_file_new(data->path, FALSE, NULL)) != NULL) {
+		read = binary_log_render(log, g_mapped_file_get_contents(mapped),
+		                         g_mapped_file_get_length(mapped));
+		g_mapped_file_unref(mapped);
+	}
+	if (read != NULL)
+		return read;
+	return g_strdup_printf(_("<font color=\"red\"><b>Could not read file: %s</b></font>"), data->path);
+}
+
+static int colornicks_bin_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account)
+{
+	return size_ledger_total(type, name, account, BINARY_EXT);
+}
+
+/* Compressed logs report the size of the HTML they hold, like every other
+ * logger does, rather than what they take on disk. */
+static int colornicks_gz_logger_size(PurpleLog *log)
+{
+	PurpleLogCommonLoggerData *data = log->logger_data;
+	gint64 size;
+
+	if (data && data->path && (size = log_logical_size(data->path)) >= 0)
+		return size;
+	return purple_log_common_sizer(log);
+}
+
+static int colornicks_gz_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account)
+{
+	return size_ledger_total(type, name, account, COMPRESSED_EXT);
+}
+
+#ifdef COLORNICKS_SQLITE
+/* SQLite storage.
+ * The "colornicks-db" logger keeps every message as a row of a single
+ * database, logs/colornicks.db, instead of writing a file per log. A row
+ * holds the message as colornicks_logger_write() would render it, minus the
+ * markup around it: time, flags (with LOG_FLAG_SHOW_DATE), sender, nick
+ * color and XHTML body, and reading a log renders the same lines from them. Rows go in through
+ * prepared statements, in transactions that commit the way the commit
+ * policy flushes files, and WAL mode keeps those commits short and out of
+ * the way of readers. Listing, sizing and reading a log are indexed queries.
+ * Build with -DCOLORNICKS_SQLITE and link against sqlite3 to get it. */
+
+#define DB_FILE "colornicks.db"
+
+enum {
+	DB_INSERT_LOG,
+	DB_INSERT_MESSAGE,
+	DB_ADD_SIZE,
+	DB_LIST_LOGS,
+	DB_READ_MESSAGES,
+	DB_LOG_SIZE,
+	DB_TOTAL_SIZE,
+	DB_STATEMENT_COUNT
+};
+
+static const char * const db_statement_sql[DB_STATEMENT_COUNT] = {
+	"INSERT INTO logs (type, protocol, account, name, started) VALUES (?, ?, ?, ?, ?)",
+	"INSERT INTO messages (log, time, flags, nick, color, body) VALUES (?, ?, ?, ?, ?, ?)",
+	"UPDATE logs SET size = size + ? WHERE id = ?",
+	"SELECT id, started FROM logs WHERE type = ? AND protocol = ? AND account = ? AND name = ?",
+	"SELECT time, flags, nick, color, body FROM messages WHERE log = ? ORDER BY rowid",
+	"SELECT size FROM logs WHERE id = ?",
+	"SELECT COALESCE(SUM(size), 0) FROM logs WHERE type = ? AND protocol = ? AND account = ? AND name = ?",
+};
+
+static const char db_schema[] =
+	"PRAGMA journal_mode = WAL;"
+	"PRAGMA synchronous = NORMAL;"
+	"CREATE TABLE IF NOT EXISTS logs ("
+	"  id INTEGER PRIMARY KEY,"
+	"  type INTEGER NOT NULL,"
+	"  protocol TEXT NOT NULL,"
+	"  account TEXT NOT NULL,"
+	"  name TEXT NOT NULL,"
+	"  started INTEGER NOT NULL,"
+	"  size INTEGER NOT NULL DEFAULT 0);"
+	"CREATE INDEX IF NOT EXISTS logs_by_conversation"
+	"  ON logs (type, protocol, account, name, started);"
+	"CREATE TABLE IF NOT EXISTS messages ("
+	"  log INTEGER NOT NULL REFERENCES logs (id),"
+	"  time INTEGER NOT NULL,"
+	"  flags INTEGER NOT NULL,"
+	"  nick TEXT,"
+	"  color TEXT,"
+	"  body TEXT NOT NULL);"
+	"CREATE INDEX IF NOT EXISTS messages_by_log ON messages (log, time);";
+
+/* logger_data of colornicks-db logs */
+typedef struct {
+	gint64 id;
+} DbLogData;
+
+static PurpleLogLogger *colornicks_db_logger;
+static sqlite3 *db = NULL;
+static sqlite3_stmt *db_statements[DB_STATEMENT_COUNT];
+static gboolean db_broken = FALSE;   /* do not retry opening every message */
+static gboolean db_in_transaction = FALSE;
+static gsize db_pending = 0;         /* bytes inserted since the last commit */
+static GString *db_nick = NULL;
+
+static void
+db_error(const char *what)
+{
+	purple_debug_error("log", "%s: %s\n", what, db ? sqlite3_errmsg(db) : "no database");
+}
+
+static void
+db_close(void)
+{
+	int i;
+
+	if (db == NULL)
+		return;
+
+	db_commit();
+	for (i = 0; i < DB_STATEMENT_COUNT; i++) {
+		sqlite3_finalize(db_statements[i]);
+		db_statements[i] = NULL;
+	}
+	sqlite3_close(db);
+	db = NULL;
+
+	g_string_free(db_nick, TRUE);
+	db_nick = NULL;
+}
+
+static gboolean
+db_open(void)
+{
+	char *dir, *path;
+	int i;
+
+	if (db != NULL)
+		return TRUE;
+	if (db_broken)
+		return FALSE;
+
+	dir = g_build_filename(purple_user_dir(), "logs", NULL);
+	purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+	path = g_build_filename(dir, DB_FILE, NULL);
+	g_free(dir);
+
+	if (sqlite3_open(path, &db) != SQLITE_OK ||
+	    sqlite3_exec(db, db_schema, NULL, NULL, NULL) != SQLITE_OK) {
+		db_error(path);
+		sqlite3_close(db);
+		db = NULL;
+		db_broken = TRUE;
+		g_free(path);
+		return FALSE;
+	}
+	g_free(path);
+
+	for (i = 0; i < DB_STATEMENT_COUNT; i++) {
+		if (sqlite3_prepare_v2(db, db_statement_sql[i], -1, &db_statements[i], NULL) != SQLITE_OK) {
+			db_error(db_statement_sql[i]);
+			db_close();
+			db_broken = TRUE;
+			return FALSE;
+		}
+	}
+
+	db_nick = g_string_sized_new(32);
+	return TRUE;
+}
+
+static void
+db_commit(void)
+{
+	if (!db_in_transaction)
+		return;
+
+	if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+		db_error("Unable to commit log messages");
+	db_in_transaction = FALSE;
+	db_pending = 0;
+}
+
+/* Binds type, protocol, account and name from parameter first on. */
+static void
+db_bind_conversation(sqlite3_stmt *stmt, int first, PurpleLogType type, const char *name,
+                     PurpleAccount *account)
+{
+	sqlite3_bind_int(stmt, first, type);
+	sqlite3_bind_text(stmt, first + 1, purple_account_get_protocol_id(account), -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(stmt, first + 2, purple_normalize(account, purple_account_get_username(account)),
+	                  -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(stmt, first + 3, purple_normalize(account, name), -1, SQLITE_TRANSIENT);
+}
+
+/* Runs a statement that returns nothing and resets it. */
+static gboolean
+db_step_done(sqlite3_stmt *stmt)
+{
+	gboolean ok = sqlite3_step(stmt) == SQLITE_DONE;
+
+	if (!ok)
+		db_error("Unable to write log");
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return ok;
+}
+
+/* Sizes count the text stored for each message. */
+static gsize colornicks_db_logger_write(PurpleLog *log, PurpleMessageFlags type,
+							  const char *from, time_t time, const char *message)
+{
+	DbLogData *data = log->logger_data;
+	const char *nick_color = NULL;
+	sqlite3_stmt *stmt;
+	char *msg_fixed;
+	gsize size;
+	gint policy;
+
+	if (!db_open())
+		return 0;
+
+	if (!db_in_transaction) {
+		if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+			db_error("Unable to start a transaction");
+			return 0;
+		}
+		db_in_transaction = TRUE;
+	}
+
+	if (data == NULL) {
+		stmt = db_statements[DB_INSERT_LOG];
+		db_bind_conversation(stmt, 1, log->type, log->name, log->account);
+		sqlite3_bind_int64(stmt, 5, log->time);
+		if (!db_step_done(stmt)) {
+			/* Nothing else would end the transaction until the next
+			 * write; rows of other logs in it still go in. */
+			db_commit();
+			return 0;
+		}
+
+		data = g_new0(DbLogData, 1);
+		data->id = sqlite3_last_insert_rowid(db);
+		log->logger_data = data;
+	}
+
+	if (from) {
+		g_string_truncate(db_nick, 0);
+		append_escaped(db_nick, from);
+		nick_color = get_nick_color(log->conv, db_nick->str);
+	}
+
+	/* The body keeps any "/me ", so reading picks the same template. */
+	msg_fixed = prepare_message(message, NULL);
+	size = strlen(msg_fixed) + (from ? strlen(from) : 0);
+
+	stmt = db_statements[DB_INSERT_MESSAGE];
+	sqlite3_bind_int64(stmt, 1, data->id);
+	sqlite3_bind_int64(stmt, 2, time);
+	sqlite3_bind_int64(stmt, 3, (guint32)type | (log_show_date(log, time) ? LOG_FLAG_SHOW_DATE : 0));
+	sqlite3_bind_text(stmt, 4, from, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 5, nick_color, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 6, msg_fixed, -1, SQLITE_STATIC);
+	if (!db_step_done(stmt))
+		size = 0;
+
+	if (msg_fixed != message)
+		g_free(msg_fixed);
+
+	if (size > 0) {
+		stmt = db_statements[DB_ADD_SIZE];
+		sqlite3_bind_int64(stmt, 1, size);
+		sqlite3_bind_int64(stmt, 2, data->id);
+		db_step_done(stmt);
+	}
+
+	db_pending += size;
+	policy = g_atomic_int_get(&commit_policy);
+	if (policy == COMMIT_EVERY_MESSAGE ||
+	    (policy == COMMIT_SIZE_THRESHOLD &&
+	     db_pending >= (gsize)g_atomic_int_get(&commit_size) * 1024))
+		db_commit();
+
+	return size;
+}
+
+static void colornicks_db_logger_finalize(PurpleLog *log)
+{
+	g_free(log->logger_data);
+	log->logger_data = NULL;
+}
+
+static GList *colornicks_db_logger_list(PurpleLogType type, const char *sn, PurpleAccount *account)
+{
+	sqlite3_stmt *stmt;
+	GList *logs = NULL;
+
+	if (!db_open())
+		return NULL;
+
+	stmt = db_statements[DB_LIST_LOGS];
+	db_bind_conversation(stmt, 1, type, sn, account);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		PurpleLog *log = purple_log_new(type, sn, account, NULL,
+		                                sqlite3_column_int64(stmt, 1), NULL);
+		DbLogData *data = g_new0(DbLogData, 1);
+
+		data->id = sqlite3_column_int64(stmt, 0);
+		log->logger = colornicks_db_logger;
+		log->logger_data = data;
+		logs = g_list_prepend(logs, log);
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return logs;
+}
+
+static GList *colornicks_db_logger_list_syslog(PurpleAccount *account)
+{
+	return colornicks_db_logger_list(PURPLE_LOG_SYSTEM, ".system", account);
+}
+
+static char *colornicks_db_logger_read(PurpleLog *log, PurpleLogReadFlags *flags)
+{
+	DbLogData *data = log->logger_data;
+	TimestampCache stamp = { NULL, G_MININT64, FALSE };
+	sqlite3_stmt *stmt;
+	GString *out, *nick;
+
+	*flags = PURPLE_LOG_READ_NO_NEWLINE;
+	if (!data || !db_open())
+		return g_strdup(_("<font color=\"red\"><b>Unable to find log!</b></font>"));
+
+	stamp.str = g_string_sized_new(32);
+	nick = g_string_sized_new(32);
+	out = g_string_new(NULL);
+
+	stmt = db_statements[DB_READ_MESSAGES];
+	sqlite3_bind_int64(stmt, 1, data->id);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *from = (const char *)sqlite3_column_text(stmt, 2);
+		const char *color = (const char *)sqlite3_column_text(stmt, 3);
+		char *body = g_strdup((const char *)sqlite3_column_text(stmt, 4));
+		time_t when = sqlite3_column_int64(stmt, 0);
+		guint32 type = (guint32)sqlite3_column_int64(stmt, 1);
+		const LineTemplate *tpl = select_template(log, type & ~LOG_FLAG_SHOW_DATE, body);
+		gboolean show_date = (type & LOG_FLAG_SHOW_DATE) || log->type == PURPLE_LOG_SYSTEM;
+
+		g_string_truncate(nick, 0);
+		if (from)
+			append_escaped(nick, from);
+		if (tpl)
+			render_template(out, tpl, log_get_timestamp(log, &stamp, when, show_date),
+			                body, nick->str, color);
+		g_free(body);
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	g_string_free(nick, TRUE);
+	g_string_free(stamp.str, TRUE);
+
+	return g_string_free(out, FALSE);
+}
+
+static int colornicks_db_logger_size(PurpleLog *log)
+{
+	DbLogData *data = log->logger_data;
+	sqlite3_stmt *stmt;
+	int size = 0;
+
+	if (!data || !db_open())
+		return 0;
+
+	stmt = db_statements[DB_LOG_SIZE];
+	sqlite3_bind_int64(stmt, 1, data->id);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		size = sqlite3_column_int(stmt, 0);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return size;
+}
+
+static int colornicks_db_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account)
+{
+	sqlite3_stmt *stmt;
+	int size = 0;
+
+	if (!db_open())
+		return 0;
+
+	stmt = db_statements[DB_TOTAL_SIZE];
+	db_bind_conversation(stmt, 1, type, name, account);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		size = sqlite3_column_int(stmt, 0);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return size;
+}
+#endif /* COLORNICKS_SQLITE */
+
+/* Retention.
+ * Left alone, log directories only grow, and listing or sizing them gets
+ * slower with every log. A retention pass, run every retention_interval
+ * hours or on demand, goes through the colornicks logs of every
+ * conversation on a background thread and removes what its policy does not
+ * keep: logs older than max_age days, the oldest logs beyond the newest
+ * keep, and the oldest logs beyond max_size MiB. The preferences set the
+ * default policy; colornicks-retention.conf in the user dir can override it
+ * in groups named for an account's log directory ("jabber/me@example.com")
+ * or a conversation's ("jabber/me@example.com/friend@example.com"). An
+ * account's group may also set total_size, in MiB, for all of its logs
+ * together. Logs are deleted with their sidecars, or moved to logs-archive
+ * along with the images they show. Logs being written, the newest log of
+ * every conversation and anything written to in the last hour are always
+ * kept, though they count towards total_size. Removals pause every
+ * RETENTION_BATCH files so the disk stays responsive, and removed logs are
+ * dropped from the search index. Afterwards, stored images that no log
+ * refers to any more are removed too. */
+
+#define RETENTION_CONFIG "colornicks-retention.conf"
+#define RETENTION_ARCHIVE_DIR "logs-archive"
+#define RETENTION_BATCH 16
+#define RETENTION_PAUSE (50 * 1000)    /* us */
+#define RETENTION_GRACE (60 * 60)      /* seconds a written log is left alone */
+#define IMAGE_GRACE (24 * 60 * 60)     /* seconds a new image may go unreferenced */
+
+typedef struct {
+	int max_age;    /* days, 0 for no limit */
+	int max_size;   /* MiB */
+	int keep;       /* logs */
+} RetentionPolicy;
+
+typedef struct {
+	char *logs_dir;
+	char *archive_dir;          /* NULL to delete */
+	RetentionPolicy defaults;
+	GKeyFile *overrides;
+	gint64 now;
+
+	guint removed;
+	guint64 freed;
+	guint images;
+	GPtrArray *removed_logs;    /* paths, for the search index */
+	GPtrArray *collected;       /* names of the images removed */
+} RetentionPass;
+
+typedef struct {
+	char *path;
+	gint64 mtime;
+	guint64 size;
+	gboolean protected;         /* counted, but never removed */
+} RetentionLog;
+
+static RetentionPass *retention = NULL;
+static GThread *retention_thread = NULL;
+static volatile gint retention_cancel = 0;
+static guint retention_done_source = 0;
+static guint retention_timer = 0;
+
+/* Logs being written, so that retention leaves them alone. */
+static GMutex active_logs_lock;
+static GHashTable *active_logs = NULL;  /* path -> number of logs writing it */
+
+static void
+retention_log_opened(const char *path)
+{
+	g_mutex_lock(&active_logs_lock);
+	if (active_logs == NULL)
+		active_logs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_hash_table_replace(active_logs, g_strdup(path),
+	                     GUINT_TO_POINTER(GPOINTER_TO_UINT(g_hash_table_lookup(active_logs, path)) + 1));
+	g_mutex_unlock(&active_logs_lock);
+}
+
+static void
+retention_log_closed(const char *path)
+{
+	guint count;
+
+	g_mutex_lock(&active_logs_lock);
+	if (active_logs && (count = GPOINTER_TO_UINT(g_hash_table_lookup(active_logs, path))) > 0) {
+		if (count == 1)
+			g_hash_table_remove(active_logs, path);
+		else
+			g_hash_table_replace(active_logs, g_strdup(path), GUINT_TO_POINTER(count - 1));
+	}
+	g_mutex_unlock(&active_logs_lock);
+}
+
+static gboolean
+retention_log_is_active(const char *path)
+{
+	gboolean active;
+
+	g_mutex_lock(&active_logs_lock);
+	active = active_logs && g_hash_table_contains(active_logs, path);
+	g_mutex_unlock(&active_logs_lock);
+
+	return active;
+}
+
+static const char * const retention_sidecars[] = {
+	"", INDEX_SUFFIX, FRAMES_SUFFIX, SUMMARY_SUFFIX
+};
+
+static void
+retention_log_free(gpointer data)
+{
+	RetentionLog *log = data;
+
+	g_free(log->path);
+	g_free(log);
+}
+
+static gint
+retention_log_name_cmp(gconstpointer a, gconstpointer b)
+{
+	return strcmp((*(RetentionLog * const *)a)->path, (*(RetentionLog * const *)b)->path);
+}
+
+static gint
+retention_log_mtime_cmp(gconstpointer a, gconstpointer b)
+{
+	gint64 x = (*(RetentionLog * const *)a)->mtime, y = (*(RetentionLog * const *)b)->mtime;
+
+	return x < y ? -1 : x > y;
+}
+
+static gboolean
+retention_is_log(const char *name)
+{
+	return g_str_has_suffix(name, ".htm") || g_str_has_suffix(name, COMPRESSED_EXT) ||
+	       g_str_has_suffix(name, BINARY_EXT);
+}
+
+/* Reads key from the most specific of the groups that sets it. */
+static int
+retention_policy_int(const RetentionPass *pass, const char *conv_group,
+                     const char *account_group, const char *key, int fallback)
+{
+	if (conv_group && g_key_file_has_key(pass->overrides, conv_group, key, NULL))
+		return g_key_file_get_integer(pass->overrides, conv_group, key, NULL);
+	if (g_key_file_has_key(pass->overrides, account_group, key, NULL))
+		return g_key_file_get_integer(pass->overrides, account_group, key, NULL);
+	return fallback;
+}
+
+/* Copies the images the log at path shows into the archive's image store,
+ * so the archived log still shows them. */
+static void
+retention_archive_images(const RetentionPass *pass, const char *path)
+{
+	GHashTable *refs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	char *src_dir = g_build_filename(pass->logs_dir, IMAGE_STORE_DIR, NULL);
+	char *dest_dir = g_build_filename(pass->archive_dir, IMAGE_STORE_DIR, NULL);
+
+	image_store_refs(path, refs);
+	image_store_copy(src_dir, dest_dir, refs);
+
+	g_free(dest_dir);
+	g_free(src_dir);
+	g_hash_table_destroy(refs);
+}
+
+/* Deletes or archives a log and its sidecars. Returns FALSE if the log has
+ * started being written since it was looked at. */
+static gboolean
+retention_remove(RetentionPass *pass, const RetentionLog *log)
+{
+	const char *relpath = log->path + strlen(pass->logs_dir) + 1;
+	guint i;
+
+	if (retention_log_is_active(log->path))
+		return FALSE;
+
+	if (pass->archive_dir)
+		retention_archive_images(pass, log->path);
+
+	for (i = 0; i < G_N_ELEMENTS(retention_sidecars); i++) {
+		char *path = g_strconcat(log->path, retention_sidecars[i], NULL);
+
+		if (pass->archive_dir) {
+			char *dest = g_strconcat(pass->archive_dir, G_DIR_SEPARATOR_S, relpath,
+			                         retention_sidecars[i], NULL);
+			char *dest_dir = g_path_get_dirname(dest);
+			GFile *src_file = g_file_new_for_path(path);
+			GFile *dest_file = g_file_new_for_path(dest);
+			GError *error = NULL;
+
+			if (g_mkdir_with_parents(dest_dir, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+				thread_debug_error("Unable to create directory %s: %s\n",
+				                   dest_dir, g_strerror(errno));
+			/* Moves across filesystems too. */
+			if (!g_file_move(src_file, dest_file, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &error)) {
+				if (i == 0 || !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+					thread_debug_error("Unable to archive %s: %s\n", path, error->message);
+				g_error_free(error);
+			}
+
+			g_object_unref(dest_file);
+			g_object_unref(src_file);
+			g_free(dest_dir);
+			g_free(dest);
+		} else if (g_unlink(path) != 0 && (i == 0 || errno != ENOENT))
+			thread_debug_error("Unable to delete %s: %s\n", path, g_strerror(errno));
+
+		g_free(path);
+	}
+
+	g_ptr_array_add(pass->removed_logs, g_strdup(log->path));
+	pass->freed += log->size;
+	if (++pass->removed % RETENTION_BATCH == 0)
+		g_usleep(RETENTION_PAUSE);
+
+	return TRUE;
+}
+
+/* Applies the policy of a conversation to its logs, and adds those that are
+ * kept to kept, protected ones included. */
+static void
+retention_conversation(RetentionPass *pass, const char *account_group, const char *name,
+                       GPtrArray *kept)
+{
+	char *group = g_build_path("/", account_group, name, NULL);
+	char *dir_path = g_build_filename(pass->logs_dir, account_group, name, NULL);
+	GPtrArray *logs = g_ptr_array_new();
+	RetentionPolicy policy;
+	guint64 total = 0;
+	const char *file;
+	GDir *dir;
+	guint i;
+
+	if ((dir = g_dir_open(dir_path, 0, NULL)) == NULL) {
+		g_ptr_array_free(logs, TRUE);
+		g_free(dir_path);
+		g_free(group);
+		return;
+	}
 
-static PurpleLogLogger *colornicks_logger;
+	while ((file = g_dir_read_name(dir)) != NULL) {
+		RetentionLog *log;
+		GStatBuf st;
+		char *path;
 
-static char *
-get_nick_color(PidginConversation *gtkconv, const char *name)
+		if (!retention_is_log(file))
+			continue;
+		path = g_build_filename(dir_path, file, NULL);
+		if (g_stat(path, &st) != 0) {
+			g_free(path);
+			continue;
+		}
+
+		log = g_new(RetentionLog, 1);
+		log->path = path;
+		log->mtime = st.st_mtime;
+		log->size = st.st_size;
+		log->protected = FALSE;
+		g_ptr_array_add(logs, log);
+		total += log->size;
+	}
+	g_dir_close(dir);
+
+	policy.max_age = retention_policy_int(pass, group, account_group, "max_age",
+	                                      pass->defaults.max_age);
+	policy.max_size = retention_policy_int(pass, group, account_group, "max_size",
+	                                       pass->defaults.max_size);
+	policy.keep = retention_policy_int(pass, group, account_group, "keep",
+	                                   pass->defaults.keep);
+
+	/* Log names start with the time they were started. */
+	g_ptr_array_sort(logs, retention_log_name_cmp);
+
+	for (i = 0; i < logs->len; i++) {
+		RetentionLog *log = g_ptr_array_index(logs, i);
+		gboolean expired =
+			(policy.keep > 0 && logs->len - i > (guint)policy.keep) ||
+			(policy.max_age > 0 && log->mtime < pass->now - (gint64)policy.max_age * 24 * 60 * 60) ||
+			(policy.max_size > 0 && total > (guint64)policy.max_size * 1024 * 1024);
+
+		log->protected = i == logs->len - 1 || log->mtime > pass->now - RETENTION_GRACE;
+		if (expired && !log->protected && !g_atomic_int_get(&retention_cancel) &&
+		    retention_remove(pass, log)) {
+			total -= log->size;
+			retention_log_free(log);
+		} else
+			g_ptr_array_add(kept, log);
+	}
+
+	g_ptr_array_free(logs, TRUE);
+	g_free(dir_path);
+	g_free(group);
+}
+
+static void
+retention_account(RetentionPass *pass, const char *account_group)
 {
-	static GdkColor col;
-	GtkStyle *style;
-	float scale;
+	char *dir_path = g_build_filename(pass->logs_dir, account_group, NULL);
+	GPtrArray *kept = g_ptr_array_new_with_free_func(retention_log_free);
+	GDir *dir = g_dir_open(dir_path, 0, NULL);
+	const char *name;
+	int total_size;
 
-	g_return_val_if_fail(name != NULL && gtkconv != NULL && gtkconv->nick_colors != NULL, NULL);
+	if (dir == NULL) {
+		g_ptr_array_free(kept, TRUE);
+		g_free(dir_path);
+		return;
+	}
 
-	style = gtk_widget_get_style(gtkconv->webview);
-	col = g_array_index(gtkconv->nick_colors, GdkColor, g_str_hash(name) % gtkconv->nick_colors->len);
-	scale = ((1-(LUMINANCE(style->base[GTK_STATE_NORMAL]) / LUMINANCE(style->white))) *
-		       (LUMINANCE(style->white)/MAX(MAX(col.red, col.blue), col.green)));
+	while ((name = g_dir_read_name(dir)) != NULL && !g_atomic_int_get(&retention_cancel))
+		retention_conversation(pass, account_group, name, kept);
+	g_dir_close(dir);
 
-	/* The colors are chosen to look fine on white; we should never have to darken */
-	if (scale > 1) {
-		col.red   *= scale;
-		col.green *= scale;
-		col.blue  *= scale;
+	/* Then the oldest logs of the whole account go, wherever they are. */
+	total_size = retention_policy_int(pass, NULL, account_group, "total_size", 0);
+	if (total_size > 0) {
+		guint64 total = 0;
+		guint i;
+
+		for (i = 0; i < kept->len; i++)
+			total += ((RetentionLog *)g_ptr_array_index(kept, i))->size;
+
+		g_ptr_array_sort(kept, retention_log_mtime_cmp);
+		for (i = 0; i < kept->len && total > (guint64)total_size * 1024 * 1024 &&
+		     !g_atomic_int_get(&retention_cancel); i++) {
+			RetentionLog *log = g_ptr_array_index(kept, i);
+
+			if (!log->protected && retention_remove(pass, log))
+				total -= log->size;
+		}
 	}
 
-	return g_strdup_printf("#%02x%02x%02x", (col.red >> 8), (col.green >> 8), (col.blue >> 8));
+	g_ptr_array_free(kept, TRUE);
+	g_free(dir_path);
 }
 
-/* NOTE: This can return msg (which you may or may not want to g_free())
- * NOTE: or a newly allocated string which you MUST g_free(). */
-static char *
-convert_image_tags(const PurpleLog *log, const char *msg)
+/* Adds the images shown by every log under dir_path to refs. */
+static void
+retention_walk_refs(const char *dir_path, GHashTable *refs)
 {
-	const char *tmp;
-	const char *start;
-	const char *end;
-	GData *attributes;
-	GString *newmsg = NULL;
+	GDir *dir = g_dir_open(dir_path, 0, NULL);
+	const char *name;
 
-	tmp = msg;
+	if (dir == NULL)
+		return;
 
-	while (purple_markup_find_tag("img", tmp, &start, &end, &attributes)) {
-		int imgid = 0;
-		char *idstr = NULL;
+	while ((name = g_dir_read_name(dir)) != NULL && !g_atomic_int_get(&retention_cancel)) {
+		char *path;
 
-		if (newmsg == NULL)
-			newmsg = g_string_new("");
+		if (strcmp(name, IMAGE_STORE_DIR) == 0)
+			continue;
 
-		/* copy any text before the img tag */
-		if (tmp < start)
-			g_string_append_len(newmsg, tmp, start - tmp);
+		path = g_build_filename(dir_path, name, NULL);
+		if (g_file_test(path, G_FILE_TEST_IS_DIR))
+			retention_walk_refs(path, refs);
+		else if (retention_is_log(name))
+			image_store_refs(path, refs);
+		g_free(path);
+	}
+	g_dir_close(dir);
+}
 
-		if ((idstr = g_datalist_get_data(&attributes, "id")) != NULL)
-			imgid = atoi(idstr);
+/* Removes stored images that no log shows any more. */
+static void
+retention_collect_images(RetentionPass *pass)
+{
+	GHashTable *refs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	char *images_dir = g_build_filename(pass->logs_dir, IMAGE_STORE_DIR, NULL);
+	const char *name;
+	GDir *dir;
 
-		if (imgid != 0)
-		{
-			FILE *image_file;
-			char *dir;
-			PurpleStoredImage *image;
-			gconstpointer image_data;
-			char *new_filename = NULL;
-			char *path = NULL;
-			size_t image_byte_count;
-
-			image = purple_imgstore_find_by_id(imgid);
-			if (image == NULL)
-			{
-				/* This should never happen. */
-				/* This *does* happen for failed Direct-IMs -DAA */
-				g_string_free(newmsg, TRUE);
-				g_return_val_if_reached((char *)msg);
-			}
+#ifdef COLORNICKS_SQLITE
+	/* The database shows images too, and it is not scanned. */
+	char *db_path = g_build_filename(pass->logs_dir, DB_FILE, NULL);
+	gboolean have_db = g_file_test(db_path, G_FILE_TEST_EXISTS);
 
-			image_data       = purple_imgstore_get_data(image);
-			image_byte_count = purple_imgstore_get_size(image);
-			dir              = purple_log_get_log_dir(log->type, log->name, log->account);
-			new_filename     = purple_util_get_image_filename(image_data, image_byte_count);
+	g_free(db_path);
+	if (have_db) {
+		g_hash_table_destroy(refs);
+		g_free(images_dir);
+		return;
+	}
+#endif
 
-			path = g_build_filename(dir, new_filename, NULL);
+	retention_walk_refs(pass->logs_dir, refs);
 
-			/* Only save unique files. */
-			if (!g_file_test(path, G_FILE_TEST_EXISTS))
-			{
-				if ((image_file = g_fopen(path, "wb")) != NULL)
-				{
-					if (!fwrite(image_data, image_byte_count, 1, image_file))
-					{
-						purple_debug_error("log", "Error writing %s: %s\n",
-						                   path, g_strerror(errno));
-						fclose(image_file);
-
-						/* Attempt to not leave half-written files around. */
-						if (g_unlink(path)) {
-							purple_debug_error("log", "Error deleting partial "
-									"file %s: %s\n", path, g_strerror(errno));
-						}
-					}
-					else
-					{
-						purple_debug_info("log", "Wrote image file: %s\n", path);
-						fclose(image_file);
-					}
-				}
-				else
-				{
-					purple_debug_error("log", "Unable to create file %s: %s\n",
-					                   path, g_strerror(errno));
-				}
-			}
+	/* Missing references would cost images that are still shown. */
+	if (!g_atomic_int_get(&retention_cancel) && (dir = g_dir_open(images_dir, 0, NULL)) != NULL) {
+		while ((name = g_dir_read_name(dir)) != NULL && !g_atomic_int_get(&retention_cancel)) {
+			char *path;
+			GStatBuf st;
 
-			/* Write the new image tag */
-			g_string_append_printf(newmsg, "<IMG SRC=\"%s\">", new_filename);
-			g_free(new_filename);
+			if (g_str_has_suffix(name, ".part") || g_hash_table_contains(refs, name))
+				continue;
+
+			/* A new image may be waiting for its line to be flushed. */
+			path = g_build_filename(images_dir, name, NULL);
+			if (g_stat(path, &st) == 0 && st.st_mtime < pass->now - IMAGE_GRACE &&
+			    g_unlink(path) == 0) {
+				/* So the next message showing it stores it again. */
+				g_mutex_lock(&image_store_lock);
+				if (image_store_known)
+					g_hash_table_remove(image_store_known, name);
+				g_mutex_unlock(&image_store_lock);
+
+				g_ptr_array_add(pass->collected, g_strdup(name));
+				pass->freed += st.st_size;
+				if (++pass->images % RETENTION_BATCH == 0)
+					g_usleep(RETENTION_PAUSE);
+			}
 			g_free(path);
 		}
-
-		/* Continue from the end of the tag */
-		tmp = end + 1;
+		g_dir_close(dir);
 	}
 
-	if (newmsg == NULL)
-	{
-		/* No images were found to change. */
-		return (char *)msg;
-	}
+	g_free(images_dir);
+	g_hash_table_destroy(refs);
+}
 
-	/* Append any remaining message data */
-	g_string_append(newmsg, tmp);
+static gboolean
+retention_image_collected(gpointer imgid, gpointer filename, gpointer data)
+{
+	GPtrArray *collected = data;
+	guint i;
 
-	return g_string_free(newmsg, FALSE);
+	for (i = 0; i < collected->len; i++)
+		if (strcmp(filename, g_ptr_array_index(collected, i)) == 0)
+			return TRUE;
+	return FALSE;
 }
 
-static char *log_get_timestamp(PurpleLog *log, time_t when)
+/* Reports on the pass that just ended and frees it. */
+static void
+retention_finish(void)
 {
-	gboolean show_date;
-	char *date;
-	struct tm tm;
+	char *freed = purple_str_size_to_units(retention->freed);
+	guint i;
 
-	show_date = (log->type == PURPLE_LOG_SYSTEM) || (time(NULL) > when + 20*60);
+	purple_debug_info("colornicks", "Retention %s %u logs and %u images, %s\n",
+	                  retention->archive_dir ? "archived" : "removed",
+	                  retention->removed, retention->images, freed);
 
-	date = purple_signal_emit_return_1(purple_log_get_handle(),
-	                          "log-timestamp",
-	                          log, when, show_date);
-	if (date != NULL)
-		return date;
+	for (i = 0; i < retention->removed_logs->len; i++)
+		search_log_removed(g_ptr_array_index(retention->removed_logs, i));
 
-	tm = *(localtime(&when));
-	if (show_date)
-		return g_strdup(purple_date_format_long(&tm));
-	else
-		return g_strdup(purple_time_format(&tm));
+	/* Images still in the imgstore are written again when next shown. */
+	if (image_store_ids && retention->collected->len > 0)
+		g_hash_table_foreach_remove(image_store_ids, retention_image_collected,
+		                            retention->collected);
+
+	g_free(freed);
+	g_ptr_array_free(retention->removed_logs, TRUE);
+	g_ptr_array_free(retention->collected, TRUE);
+	g_key_file_free(retention->overrides);
+	g_free(retention->archive_dir);
+	g_free(retention->logs_dir);
+	g_free(retention);
+	retention = NULL;
 }
 
-static gsize colornicks_logger_write(PurpleLog *log, PurpleMessageFlags type,
-							  const char *from, time_t time, const char *message)
+static gboolean
+retention_done_cb(gpointer unused)
 {
-	char *msg_fixed;
-	char *image_corrected_msg;
-	char *date;
-	char *header;
-	char *escaped_from;
-	char *nick_color;
-	PurplePlugin *plugin = purple_find_prpl(purple_account_get_protocol_id(log->account));
-	PurpleLogCommonLoggerData *data = log->logger_data;
-	gsize written = 0;
+	g_thread_join(retention_thread);
+	retention_thread = NULL;
+	retention_done_source = 0;
+	retention_finish();
 
-	if (!data) {
-		const char *prpl =
-			PURPLE_PLUGIN_PROTOCOL_INFO(plugin)->list_icon(log->account, NULL);
-		const char *date;
-		purple_log_common_writer(log, ".htm");
+	return FALSE;
+}
 
-		data = log->logger_data;
+static gpointer
+retention_thread_func(gpointer data)
+{
+	RetentionPass *pass = data;
+	GDir *protocols = g_dir_open(pass->logs_dir, 0, NULL);
+	const char *protocol;
 
-		/* if we can't write to the file, give up before we hurt ourselves */
-		if (!data->file)
-			return 0;
+	/* logs/<protocol>/<account>/<conversation>/<log> */
+	while (protocols && (protocol = g_dir_read_name(protocols)) != NULL &&
+	       !g_atomic_int_get(&retention_cancel)) {
+		char *protocol_path;
+		GDir *accounts;
+		const char *account;
 
-		date = purple_date_format_full(localtime(&log->time));
+		if (strcmp(protocol, IMAGE_STORE_DIR) == 0)
+			continue;
 
-		written += fprintf(data->file, "<html><head>");
-		written += fprintf(data->file, "<meta http-equiv=\"content-type\" content=\"text/html; charset=UTF-8\">");
-		written += fprintf(data->file, "<title>");
-		if (log->type == PURPLE_LOG_SYSTEM)
-			header = g_strdup_printf("System log for account %s (%s) connected at %s",
-					purple_account_get_username(log->account), prpl, date);
-		else
-			header = g_strdup_printf("Conversation with %s at %s on %s (%s)",
-					log->name, date, purple_account_get_username(log->account), prpl);
+		protocol_path = g_build_filename(pass->logs_dir, protocol, NULL);
+		accounts = g_dir_open(protocol_path, 0, NULL);
+
+		while (accounts && (account = g_dir_read_name(accounts)) != NULL &&
+		       !g_atomic_int_get(&retention_cancel)) {
+			char *account_group = g_build_path("/", protocol, account, NULL);
+			retention_account(pass, account_group);
+			g_free(account_group);
+		}
 
-		written += fprintf(data->file, "%s", header);
-		written += fprintf(data->file, "</title></head><body>");
-		written += fprintf(data->file, "<h3>%s</h3>\n", header);
-		g_free(header);
+		if (accounts)
+			g_dir_close(accounts);
+		g_free(protocol_path);
 	}
+	if (protocols)
+		g_dir_close(protocols);
 
-	/* if we can't write to the file, give up before we hurt ourselves */
-	if (!data->file)
-		return 0;
+	if (!g_atomic_int_get(&retention_cancel))
+		retention_collect_images(pass);
 
-	escaped_from = g_markup_escape_text(from, -1);
-	nick_color = get_nick_color(PIDGIN_CONVERSATION(log->conv), escaped_from);
+	retention_done_source = g_idle_add(retention_done_cb, NULL);
+	return NULL;
+}
 
-	image_corrected_msg = convert_image_tags(log, message);
-	purple_markup_html_to_xhtml(image_corrected_msg, &msg_fixed, NULL);
+/* Starts a retention pass, unless one is running already. */
+static gboolean
+retention_start(void)
+{
+	RetentionPass *pass;
+	char *config;
 
-	/* Yes, this breaks encapsulation.  But it's a static function and
-	 * this saves a needless strdup(). */
-	if (image_corrected_msg != message)
-		g_free(image_corrected_msg);
+	if (retention != NULL)
+		return FALSE;
 
-	date = log_get_timestamp(log, time);
+	pass = g_new0(RetentionPass, 1);
+	pass->logs_dir = g_build_filename(purple_user_dir(), "logs", NULL);
+	if (purple_prefs_get_bool("/plugins/gtk/colornicks_logger/retention_archive"))
+		pass->archive_dir = g_build_filename(purple_user_dir(), RETENTION_ARCHIVE_DIR, NULL);
+	pass->defaults.max_age = purple_prefs_get_int("/plugins/gtk/colornicks_logger/retention_max_age");
+	pass->defaults.max_size = purple_prefs_get_int("/plugins/gtk/colornicks_logger/retention_max_size");
+	pass->defaults.keep = purple_prefs_get_int("/plugins/gtk/colornicks_logger/retention_keep");
+	pass->now = time(NULL);
+	pass->removed_logs = g_ptr_array_new_with_free_func(g_free);
+	pass->collected = g_ptr_array_new_with_free_func(g_free);
 
-	if (log->type == PURPLE_LOG_SYSTEM){
-		written += fprintf(data->file, "---- %s @ %s ----<br/>\n", msg_fixed, date);
-	} else {
-		if (type & PURPLE_MESSAGE_SYSTEM)
-			written += fprintf(data->file, "<font size=\"2\">(%s)</font><b> %s</b><br/>\n", date, msg_fixed);
-		else if (type & PURPLE_MESSAGE_RAW)
-			written += fprintf(data->file, "<font size=\"2\">(%s)</font> %s<br/>\n", date, msg_fixed);
-		else if (type & PURPLE_MESSAGE_ERROR)
-			written += fprintf(data->file, "<font color=\"#FF0000\"><font size=\"2\">(%s)</font><b> %s</b></font><br/>\n", date, msg_fixed);
-		else if (type & PURPLE_MESSAGE_WHISPER) {
-			if (type & PURPLE_MESSAGE_SEND)
-				written += fprintf(data->file, "<font color=\"#6C2585\"><font size=\"2\">(%s)</font><b> %s &lt;whisper&gt;:</b></font> %s<br/>\n",
-						date, escaped_from, msg_fixed);
-			else
-				written += fprintf(data->file, "<font color=\"%s\"><font size=\"2\">(%s)</font><b> %s &lt;whisper&gt;:</b></font> %s<br/>\n",
-						(nick_color ? nick_color : "#6C2585"), date, escaped_from, msg_fixed);
-		} else if (type & PURPLE_MESSAGE_AUTO_RESP) {
-			if (type & PURPLE_MESSAGE_SEND)
-				written += fprintf(data->file, _("<font color=\"#16569E\"><font size=\"2\">(%s)</font> <b>%s &lt;AUTO-REPLY&gt;:</b></font> %s<br/>\n"),
-						date, escaped_from, msg_fixed);
-			else if (type & PURPLE_MESSAGE_RECV)
-				written += fprintf(data->file, _("<font color=\"%s\"><font size=\"2\">(%s)</font> <b>%s &lt;AUTO-REPLY&gt;:</b></font> %s<br/>\n"),
-						(nick_color ? nick_color : "#A82F2F"), date, escaped_from, msg_fixed);
-		} else if (type & PURPLE_MESSAGE_RECV) {
-			if (purple_message_meify(msg_fixed, -1))
-				written += fprintf(data->file, "<font color=\"%s\"><font size=\"2\">(%s)</font> <b>***%s</b></font> %s<br/>\n",
-						(nick_color ? nick_color : "#062585"), date, escaped_from, msg_fixed);
-			else
-				written += fprintf(data->file, "<font color=\"%s\"><font size=\"2\">(%s)</font> <b>%s:</b></font> %s<br/>\n",
-						(nick_color ? nick_color : "#A82F2F"), date, escaped_from, msg_fixed);
-		} else if (type & PURPLE_MESSAGE_SEND) {
-			if (purple_message_meify(msg_fixed, -1))
-				written += fprintf(data->file, "<font color=\"#062585\"><font size=\"2\">(%s)</font> <b>***%s</b></font> %s<br/>\n",
-						date, escaped_from, msg_fixed);
-			else
-				written += fprintf(data->file, "<font color=\"#16569E\"><font size=\"2\">(%s)</font> <b>%s:</b></font> %s<br/>\n",
-						date, escaped_from, msg_fixed);
-		} else {
-			purple_debug_error("log", "Unhandled message type.\n");
-			written += fprintf(data->file, "<font size=\"2\">(%s)</font><b> %s:</b></font> %s<br/>\n",
-						date, escaped_from, msg_fixed);
-		}
+	pass->overrides = g_key_file_new();
+	config = g_build_filename(purple_user_dir(), RETENTION_CONFIG, NULL);
+	g_key_file_load_from_file(pass->overrides, config, G_KEY_FILE_NONE, NULL);
+	g_free(config);
+
+	retention = pass;
+	g_atomic_int_set(&retention_cancel, 0);
+	retention_thread = g_thread_new("colornicks-retention", retention_thread_func, pass);
+
+	return TRUE;
+}
+
+/* Stops a running pass; the next one starts over. */
+static void
+retention_stop(void)
+{
+	if (retention_timer) {
+		purple_timeout_remove(retention_timer);
+		retention_timer = 0;
 	}
-	g_free(date);
-	g_free(msg_fixed);
-	g_free(escaped_from);
-	g_free(nick_color);
-	fflush(data->file);
 
-	return written;
+	if (retention_thread == NULL)
+		return;
+
+	g_atomic_int_set(&retention_cancel, 1);
+	g_thread_join(retention_thread);
+	retention_thread = NULL;
+
+	if (retention_done_source) {
+		g_source_remove(retention_done_source);
+		retention_done_source = 0;
+	}
+	retention_finish();
 }
 
-static void colornicks_logger_finalize(PurpleLog *log)
+static gboolean
+retention_timeout_cb(gpointer unused)
 {
-	PurpleLogCommonLoggerData *data = log->logger_data;
-	if (data) {
-		if (data->file) {
-			fprintf(data->file, "</body></html>\n");
-			fclose(data->file);
-		}
-		g_free(data->path);
+	retention_start();
+	return TRUE;
+}
+
+static void
+retention_prefs_cb(const char *name, PurplePrefType type, gconstpointer val, gpointer data)
+{
+	int interval = purple_prefs_get_int("/plugins/gtk/colornicks_logger/retention_interval");
 
-		g_slice_free(PurpleLogCommonLoggerData, data);
+	if (retention_timer) {
+		purple_timeout_remove(retention_timer);
+		retention_timer = 0;
 	}
+	if (interval > 0)
+		retention_timer = purple_timeout_add_seconds(interval * 60 * 60, retention_timeout_cb, NULL);
 }
 
-static GList *colornicks_logger_list(PurpleLogType type, const char *sn, PurpleAccount *account)
+static void
+retention_action_cb(PurplePluginAction *action)
 {
-	return purple_log_common_lister(type, sn, account, ".htm", colornicks_logger);
+	if (!retention_start())
+		purple_notify_info(action->plugin, _("Clean Up Logs"), _("Old logs are being cleaned up already."),
+		                   NULL);
 }
 
-static GList *colornicks_logger_list_syslog(PurpleAccount *account)
+static void
+async_config_cb(GtkWidget *widget, gpointer data)
 {
-	return purple_log_common_lister(PURPLE_LOG_SYSTEM, ".system", account, ".htm", colornicks_logger);
+	gboolean on = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+	purple_prefs_set_bool("/plugins/gtk/colornicks_logger/async_write", on);
+
+	/* Stopping the writer drains the queue first, so it is safe to switch
+	 * modes while logs are open. */
+	if (on)
+		writer_start();
+	else
+		writer_stop();
 }
 
-static char *colornicks_logger_read(PurpleLog *log, PurpleLogReadFlags *flags)
+static void
+search_config_cb(GtkWidget *widget, gpointer data)
 {
-	char *read;
-	PurpleLogCommonLoggerData *data = log->logger_data;
-	*flags = PURPLE_LOG_READ_NO_NEWLINE;
-	if (!data || !data->path)
-		return g_strdup(_("<font color=\"red\"><b>Unable to find log path!</b></font>"));
-	if (g_file_get_contents(data->path, &read, NULL, NULL)) {
-		char *minus_header = strchr(read, '\n');
+	search_enabled = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+	purple_prefs_set_bool("/plugins/gtk/colornicks_logger/search_index", search_enabled);
+}
 
-		if (!minus_header)
-			return read;
+static void
+commit_config_cb(GtkWidget *widget, gpointer data)
+{
+	gint option = GPOINTER_TO_INT(data);
+	g_return_if_fail(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget)));
 
-		minus_header = g_strdup(minus_header + 1);
-		g_free(read);
+	purple_prefs_set_int("/plugins/gtk/colornicks_logger/commit_policy", option);
+}
 
-		return minus_header;
-	}
-	return g_strdup_printf(_("<font color=\"red\"><b>Could not read file: %s</b></font>"), data->path);
+static void
+convert_request_cb(PurplePlugin *plugin, PurpleRequestFields *fields)
+{
+	if (!conversion_start(purple_request_fields_get_string(fields, "src"),
+	                      purple_request_fields_get_string(fields, "dest"),
+	                      purple_request_fields_get_string(fields, "format")))
+		purple_notify_error(plugin, _("Convert Logs"), _("Unable to start converting logs."),
+		                    _("Another conversion may still be running, or the format is not "
+		                      "one of colornicks, html, txt or jsonl. Converting to colornicks "
+		                      "takes the nick colors from a conversation window, so one must "
+		                      "be open."));
 }
 
-static int colornicks_logger_total_size(PurpleLogType type, const char *name, PurpleAccount *account)
+static void
+convert_action_cb(PurplePluginAction *action)
+{
+	PurpleRequestFields *fields = purple_request_fields_new();
+	PurpleRequestFieldGroup *group = purple_request_field_group_new(NULL);
+	char *src = g_build_filename(purple_user_dir(), "logs", NULL);
+	char *dest = g_build_filename(purple_user_dir(), "logs-converted", NULL);
+
+	purple_request_fields_add_group(fields, group);
+	purple_request_field_group_add_field(group,
+		purple_request_field_string_new("src", _("_Convert logs in:"), src, FALSE));
+	purple_request_field_group_add_field(group,
+		purple_request_field_string_new("dest", _("_Into:"), dest, FALSE));
+	purple_request_field_group_add_field(group,
+		purple_request_field_string_new("format", _("_Format:"), "colornicks", FALSE));
+
+	purple_request_fields(action->plugin, _("Convert Logs"), _("Convert logs to another format"),
+	                      _("Stock html and txt logs can be converted to colornicks, and colornicks "
+	                        "logs to html, txt or jsonl. Converting again into the same directory "
+	                        "resumes where the last conversion stopped."),
+	                      fields, _("_Convert"), G_CALLBACK(convert_request_cb),
+	                      _("_Cancel"), NULL, NULL, NULL, NULL, action->plugin);
+
+	g_free(dest);
+	g_free(src);
+}
+
+static GList *
+plugin_actions(PurplePlugin *plugin, gpointer context)
 {
-	return purple_log_common_total_sizer(type, name, account, ".htm");
+	GList *actions = g_list_append(NULL, purple_plugin_action_new(_("Convert Logs..."),
+	                                                              convert_action_cb));
+
+#ifndef COLORNICKS_NO_STATS
+	actions = g_list_append(actions, purple_plugin_action_new(_("Show Logging Statistics"),
+	                                                          stats_action_cb));
+#endif
+	actions = g_list_append(actions, purple_plugin_action_new(_("Clean Up Old Logs Now"),
+	                                                          retention_action_cb));
+	return actions;
 }
 
+static GtkWidget *
+get_config_frame(PurplePlugin *plugin)
+{
+	GtkWidget *ret = NULL, *frame = NULL;
+	GtkWidget *vbox = NULL, *toggle = NULL;
+
+	ret = gtk_box_new(GTK_ORIENTATION_VERTICAL, 18);
+	gtk_container_set_border_width(GTK_CONTAINER (ret), 12);
+
+	/* Writing */
+
+	frame = pidgin_make_frame(ret, _("Writing"));
+	vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+	gtk_container_add(GTK_CONTAINER(frame), vbox);
+
+	toggle = gtk_check_button_new_with_mnemonic(_("Write logs from a _background thread"));
+	gtk_box_pack_start(GTK_BOX(vbox), toggle, FALSE, FALSE, 0);
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(toggle),
+	                             purple_prefs_get_bool("/plugins/gtk/colornicks_logger/async_write"));
+	g_signal_connect(G_OBJECT(toggle), "toggled",
+	                 G_CALLBACK(async_config_cb), NULL);
+
+	toggle = gtk_check_button_new_with_mnemonic(_("_Index new logs for searching"));
+	gtk_box_pack_start(GTK_BOX(vbox), toggle, FALSE, FALSE, 0);
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(toggle),
+	                             purple_prefs_get_bool("/plugins/gtk/colornicks_logger/search_index"));
+	g_signal_connect(G_OBJECT(toggle), "toggled",
+	                 G_CALLBACK(search_config_cb), NULL);
+
+	pidgin_prefs_labeled_spin_button(vbox, _("Logs to keep open at most:"),
+	                                 "/plugins/gtk/colornicks_logger/max_open_logs",
+	                                 1, 65536, NULL);
+
+	/* Commit policy */
+
+	frame = pidgin_make_frame(ret, _("Flushing to Disk"));
+	vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+	gtk_container_add(GTK_CONTAINER(frame), vbox);
+
+	toggle = gtk_radio_button_new_with_mnemonic(NULL, _("Flush after _every message"));
+	gtk_box_pack_start(GTK_BOX(vbox), toggle, FALSE, FALSE, 0);
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(toggle),
+		purple_prefs_get_int("/plugins/gtk/colornicks_logger/commit_policy") == COMMIT_EVERY_MESSAGE);
+	g_signal_connect(G_OBJECT(toggle), "toggled",
+	                 G_CALLBACK(commit_config_cb), GUINT_TO_POINTER(COMMIT_EVERY_MESSAGE));
+
+	toggle = gtk_radio_button_new_with_mnemonic_from_widget(GTK_RADIO_BUTTON(toggle),
+	                                                        _("Flush all logs _periodically"));
+	gtk_box_pack_start(GTK_BOX(vbox), toggle, FALSE, FALSE, 0);
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(toggle),
+		purple_prefs_get_int("/plugins/gtk/colornicks_logger/commit_policy") == COMMIT_TIME_WINDOW);
+	g_signal_connect(G_OBJECT(toggle), "toggled",
+	                 G_CALLBACK(commit_config_cb), GUINT_TO_POINTER(COMMIT_TIME_WINDOW));
+
+	toggle = gtk_radio_button_new_with_mnemonic_from_widget(GTK_RADIO_BUTTON(toggle),
+	                                                        _("Flush a log once enough _data is buffered"));
+	gtk_box_pack_start(GTK_BOX(vbox), toggle, FALSE, FALSE, 0);
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(toggle),
+		purple_prefs_get_int("/plugins/gtk/colornicks_logger/commit_policy") == COMMIT_SIZE_THRESHOLD);
+	g_signal_connect(G_OBJECT(toggle), "toggled",
+	                 G_CALLBACK(commit_config_cb), GUINT_TO_POINTER(COMMIT_SIZE_THRESHOLD));
+
+	pidgin_prefs_labeled_spin_button(vbox, _("Flush interval (ms):"),
+	                                 "/plugins/gtk/colornicks_logger/commit_interval",
+	                                 10, 60000, NULL);
+	pidgin_prefs_labeled_spin_button(vbox, _("Flush threshold (KiB):"),
+	                                 "/plugins/gtk/colornicks_logger/commit_size",
+	                                 1, 65536, NULL);
+	pidgin_prefs_labeled_spin_button(vbox, _("Sync to disk every (seconds, 0 to disable):"),
+	                                 "/plugins/gtk/colornicks_logger/sync_interval",
+	                                 0, 3600, NULL);
+
+	/* Segments */
+
+	frame = pidgin_make_frame(ret, _("Splitting Long Logs"));
+	vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+	gtk_container_add(GTK_CONTAINER(frame), vbox);
+
+	pidgin_prefs_labeled_spin_button(vbox, _("Start a new log after (MiB, 0 to disable):"),
+	                                 "/plugins/gtk/colornicks_logger/segment_size",
+	                                 0, 4096, NULL);
+	pidgin_prefs_labeled_spin_button(vbox, _("Start a new log after (hours, 0 to disable):"),
+	                                 "/plugins/gtk/colornicks_logger/segment_age",
+	                                 0, 8760, NULL);
+
+	/* Floods */
+
+	frame = pidgin_make_frame(ret, _("Joins and Parts"));
+	vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+	gtk_container_add(GTK_CONTAINER(frame), vbox);
+
+	pidgin_prefs_labeled_spin_button(vbox, _("Log runs of them as one line for (ms, 0 to disable):"),
+	                                 "/plugins/gtk/colornicks_logger/flood_window",
+	                                 0, 60000, NULL);
+	pidgin_prefs_labeled_spin_button(vbox, _("Names per line at most:"),
+	                                 "/plugins/gtk/colornicks_logger/flood_cap",
+	                                 1, 10000, NULL);
+
+	/* Retention */
+
+	frame = pidgin_make_frame(ret, _("Cleaning Up Old Logs"));
+	vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+	gtk_container_add(GTK_CONTAINER(frame), vbox);
+
+	pidgin_prefs_labeled_spin_button(vbox, _("Clean up every (hours, 0 to disable):"),
+	                                 "/plugins/gtk/colornicks_logger/retention_interval",
+	                                 0, 8760, NULL);
+	pidgin_prefs_labeled_spin_button(vbox, _("Remove logs older than (days, 0 to disable):"),
+	                                 "/plugins/gtk/colornicks_logger/retention_max_age",
+	                                 0, 36500, NULL);
+	pidgin_prefs_labeled_spin_button(vbox, _("Keep per conversation at most (MiB, 0 to disable):"),
+	                                 "/plugins/gtk/colornicks_logger/retention_max_size",
+	                                 0, 1048576, NULL);
+	pidgin_prefs_labeled_spin_button(vbox, _("Keep per conversation at most (logs, 0 to disable):"),
+	                                 "/plugins/gtk/colornicks_logger/retention_keep",
+	                                 0, 1000000, NULL);
+	pidgin_prefs_checkbox(_("_Move old logs to logs-archive instead of deleting them"),
+	                      "/plugins/gtk/colornicks_logger/retention_archive", vbox);
+
+#ifndef COLORNICKS_NO_STATS
+	/* Statistics */
+
+	frame = pidgin_make_frame(ret, _("Statistics"));
+	vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+	gtk_container_add(GTK_CONTAINER(frame), vbox);
+
+	pidgin_prefs_labeled_spin_button(vbox, _("Write colornicks-stats.txt every (minutes, 0 to disable):"),
+	                                 "/plugins/gtk/colornicks_logger/stats_interval",
+	                                 0, 1440, NULL);
+#endif
+
+	gtk_widget_show_all(ret);
+	return ret;
+}
 
 static gboolean
 plugin_load(PurplePlugin *plugin)
@@ -366,6 +7852,157 @@ plugin_load(PurplePlugin *plugin)
 									  purple_log_common_is_deletable);
 	purple_log_logger_add(colornicks_logger);
 
+	colornicks_gz_logger = purple_log_logger_new("colornicks-gz", "Colored nicks (compressed)", 11,
+									  NULL,
+									  colornicks_logger_write,
+									  colornicks_logger_finalize,
+									  colornicks_gz_logger_list,
+									  colornicks_logger_read,
+									  colornicks_gz_logger_size,
+									  colornicks_gz_logger_total_size,
+									  colornicks_gz_logger_list_syslog,
+									  NULL,
+									  purple_log_common_deleter,
+									  purple_log_common_is_deletable);
+	purple_log_logger_add(colornicks_gz_logger);
+
+	colornicks_bin_logger = purple_log_logger_new("colornicks-bin", "Colored nicks (binary)", 11,
+									  NULL,
+									  colornicks_logger_write,
+									  colornicks_logger_finalize,
+									  colornicks_bin_logger_list,
+									  colornicks_bin_logger_read,
+									  purple_log_common_sizer,
+									  colornicks_bin_logger_total_size,
+									  colornicks_bin_logger_list_syslog,
+									  NULL,
+									  purple_log_common_deleter,
+									  purple_log_common_is_deletable);
+	purple_log_logger_add(colornicks_bin_logger);
+
+#ifdef COLORNICKS_SQLITE
+	colornicks_db_logger = purple_log_logger_new("colornicks-db", "Colored nicks (SQLite)", 11,
+									  NULL,
+									  colornicks_db_logger_write,
+									  colornicks_db_logger_finalize,
+									  colornicks_db_logger_list,
+									  colornicks_db_logger_read,
+									  colornicks_db_logger_size,
+									  colornicks_db_logger_total_size,
+									  colornicks_db_logger_list_syslog,
+									  NULL,
+									  NULL,
+									  NULL);
+	purple_log_logger_add(colornicks_db_logger);
+#endif
+
+	compile_templates();
+	size_ledger_load();
+	listings_init();
+	search_enabled = purple_prefs_get_bool("/plugins/gtk/colornicks_logger/search_index");
+	search_init();
+	precreate_init();
+
+	purple_plugin_ipc_register(plugin, "index-get", PURPLE_CALLBACK(ipc_index_get),
+	                           purple_marshal_BOOLEAN__POINTER_POINTER,
+	                           purple_value_new(PURPLE_TYPE_BOOLEAN), 2,
+	                           purple_value_new(PURPLE_TYPE_STRING),
+	                           purple_value_new(PURPLE_TYPE_POINTER));
+	purple_plugin_ipc_register(plugin, "index-find-time", PURPLE_CALLBACK(ipc_index_find_time),
+	                           purple_marshal_BOOLEAN__POINTER_POINTER_POINTER,
+	                           purple_value_new(PURPLE_TYPE_BOOLEAN), 3,
+	                           purple_value_new(PURPLE_TYPE_STRING),
+	                           purple_value_new(PURPLE_TYPE_POINTER),
+	                           purple_value_new(PURPLE_TYPE_POINTER));
+	purple_plugin_ipc_register(plugin, "summary-get", PURPLE_CALLBACK(ipc_summary_get),
+	                           purple_marshal_BOOLEAN__POINTER_POINTER,
+	                           purple_value_new(PURPLE_TYPE_BOOLEAN), 2,
+	                           purple_value_new(PURPLE_TYPE_STRING),
+	                           purple_value_new(PURPLE_TYPE_POINTER));
+	purple_plugin_ipc_register(plugin, "read-range", PURPLE_CALLBACK(ipc_read_range),
+	                           purple_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER,
+	                           purple_value_new(PURPLE_TYPE_BOOLEAN), 4,
+	                           purple_value_new(PURPLE_TYPE_STRING),
+	                           purple_value_new(PURPLE_TYPE_POINTER),
+	                           purple_value_new(PURPLE_TYPE_POINTER),
+	                           purple_value_new(PURPLE_TYPE_POINTER));
+	purple_plugin_ipc_register(plugin, "read-page", PURPLE_CALLBACK(ipc_read_page),
+	                           purple_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_POINTER,
+	                           purple_value_new(PURPLE_TYPE_BOOLEAN), 5,
+	                           purple_value_new(PURPLE_TYPE_STRING),
+	                           purple_value_new(PURPLE_TYPE_POINTER),
+	                           purple_value_new(PURPLE_TYPE_POINTER),
+	                           purple_value_new(PURPLE_TYPE_POINTER),
+	                           purple_value_new(PURPLE_TYPE_POINTER));
+	purple_plugin_ipc_register(plugin, "search", PURPLE_CALLBACK(ipc_search),
+	                           purple_marshal_BOOLEAN__POINTER_POINTER_POINTER,
+	                           purple_value_new(PURPLE_TYPE_BOOLEAN), 3,
+	                           purple_value_new(PURPLE_TYPE_POINTER),
+	                           purple_value_new(PURPLE_TYPE_STRING),
+	                           purple_value_new(PURPLE_TYPE_POINTER));
+	purple_plugin_ipc_register(plugin, "pool-stats", PURPLE_CALLBACK(ipc_pool_stats),
+	                           purple_marshal_BOOLEAN__POINTER_POINTER_POINTER,
+	                           purple_value_new(PURPLE_TYPE_BOOLEAN), 3,
+	                           purple_value_new(PURPLE_TYPE_POINTER),
+	                           purple_value_new(PURPLE_TYPE_POINTER),
+	                           purple_value_new(PURPLE_TYPE_POINTER));
+	purple_plugin_ipc_register(plugin, "convert", PURPLE_CALLBACK(ipc_convert),
+	                           purple_marshal_BOOLEAN__POINTER_POINTER_POINTER,
+	                           purple_value_new(PURPLE_TYPE_BOOLEAN), 3,
+	                           purple_value_new(PURPLE_TYPE_STRING),
+	                           purple_value_new(PURPLE_TYPE_STRING),
+	                           purple_value_new(PURPLE_TYPE_STRING));
+
+	if (purple_prefs_get_bool("/plugins/gtk/colornicks_logger/async_write"))
+		writer_start();
+
+	commit_prefs_cb(NULL, PURPLE_PREF_NONE, NULL, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/commit_policy",
+	                              commit_prefs_cb, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/commit_interval",
+	                              commit_prefs_cb, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/commit_size",
+	                              commit_prefs_cb, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/sync_interval",
+	                              commit_prefs_cb, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/max_open_logs",
+	                              commit_prefs_cb, NULL);
+
+	segment_prefs_cb(NULL, PURPLE_PREF_NONE, NULL, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/segment_size",
+	                              segment_prefs_cb, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/segment_age",
+	                              segment_prefs_cb, NULL);
+
+	flood_prefs_cb(NULL, PURPLE_PREF_NONE, NULL, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/flood_window",
+	                              flood_prefs_cb, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/flood_cap",
+	                              flood_prefs_cb, NULL);
+
+	retention_prefs_cb(NULL, PURPLE_PREF_NONE, NULL, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/retention_interval",
+	                              retention_prefs_cb, NULL);
+
+#ifndef COLORNICKS_NO_STATS
+	stats_prefs_cb(NULL, PURPLE_PREF_NONE, NULL, NULL);
+	purple_prefs_connect_callback(plugin, "/plugins/gtk/colornicks_logger/stats_interval",
+	                              stats_prefs_cb, NULL);
+#endif
+
+	purple_signal_connect(purple_connections_get_handle(), "signed-off", plugin,
+	                      PURPLE_CALLBACK(signed_off_cb), NULL);
+	purple_signal_connect(purple_conversations_get_handle(), "deleting-conversation", plugin,
+	                      PURPLE_CALLBACK(deleting_conv_cb), NULL);
+	purple_signal_connect(purple_conversations_get_handle(), "conversation-created", plugin,
+	                      PURPLE_CALLBACK(listing_conv_created_cb), NULL);
+	purple_signal_connect(purple_conversations_get_handle(), "conversation-created", plugin,
+	                      PURPLE_CALLBACK(precreate_conv_created_cb), NULL);
+	purple_signal_connect(purple_accounts_get_handle(), "account-removed", plugin,
+	                      PURPLE_CALLBACK(listing_account_removed_cb), NULL);
+	purple_signal_connect(purple_accounts_get_handle(), "account-removed", plugin,
+	                      PURPLE_CALLBACK(prpl_icon_account_removed_cb), NULL);
+
 	if (g_strcmp0(purple_prefs_get_string("/purple/logging/format"), "html") == 0)
 		purple_prefs_set_string("/purple/logging/format", "colornicks");
 	return TRUE;
@@ -384,17 +8021,66 @@ plugin_unload(PurplePlugin *plugin)
 		   pidgin crashes. Close the logs for all conversations so that they
 		   can start new logs on an existing logger. */
 		purple_conversation_close_logs(conv);
+		nick_color_cache_free(conv);
 		convs = convs->next;
 	}
 
-	if (g_strcmp0(purple_prefs_get_string("/purple/logging/format"), "colornicks") == 0)
+	listings_shutdown();
+	flood_shutdown();
+	precreate_shutdown();
+
+	/* Make sure every line queued by the logs closed above is on disk. */
+	writer_stop();
+	/* A pass being stopped still drops what it removed from the index. */
+	retention_stop();
+	search_shutdown();
+	conversion_stop();
+#ifndef COLORNICKS_NO_STATS
+	stats_shutdown();
+#endif
+	image_store_shutdown();
+	thread_errors_shutdown();
+	size_ledger_save();
+
+	if (commit_timer) {
+		purple_timeout_remove(commit_timer);
+		commit_timer = 0;
+	}
+	frames_pending = FALSE;
+
+	if (g_strcmp0(purple_prefs_get_string("/purple/logging/format"), "colornicks") == 0 ||
+	    g_strcmp0(purple_prefs_get_string("/purple/logging/format"), "colornicks-gz") == 0 ||
+	    g_strcmp0(purple_prefs_get_string("/purple/logging/format"), "colornicks-bin") == 0 ||
+	    g_strcmp0(purple_prefs_get_string("/purple/logging/format"), "colornicks-db") == 0)
 		purple_prefs_set_string("/purple/logging/format", "html");
 
+#ifdef COLORNICKS_SQLITE
+	db_close();
+	purple_log_logger_remove(colornicks_db_logger);
+	purple_log_logger_free(colornicks_db_logger);
+#endif
+
+	purple_log_logger_remove(colornicks_bin_logger);
+	purple_log_logger_free(colornicks_bin_logger);
+	purple_log_logger_remove(colornicks_gz_logger);
+	purple_log_logger_free(colornicks_gz_logger);
 	purple_log_logger_remove(colornicks_logger);
 	purple_log_logger_free(colornicks_logger);
 	return TRUE;
 }
 
+static PidginPluginUiInfo ui_info =
+{
+	get_config_frame,
+	0, /* page_num (Reserved) */
+
+	/* padding */
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
 static PurplePluginInfo info =
 {
 	PURPLE_PLUGIN_MAGIC,
@@ -422,10 +8108,10 @@ static PurplePluginInfo info =
 	plugin_unload,                                    /**< unload         */
 	NULL,                                             /**< destroy        */
 
-	NULL,                                             /**< ui_info        */
+	&ui_info,                                         /**< ui_info        */
 	NULL,                                             /**< extra_info     */
-	NULL,
-	NULL,
+	NULL,                                             /**< prefs_info     */
+	plugin_actions,                                   /**< actions        */
 	/* Padding */
 	NULL,
 	NULL,
@@ -436,6 +8122,25 @@ static PurplePluginInfo info =
 static void
 init_plugin(PurplePlugin *plugin)
 {
+	purple_prefs_add_none("/plugins/gtk");
+	purple_prefs_add_none("/plugins/gtk/colornicks_logger");
+	purple_prefs_add_bool("/plugins/gtk/colornicks_logger/async_write", FALSE);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/commit_policy", COMMIT_EVERY_MESSAGE);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/commit_interval", 1000);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/commit_size", 64);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/sync_interval", 0);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/max_open_logs", 256);
+	purple_prefs_add_bool("/plugins/gtk/colornicks_logger/search_index", TRUE);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/segment_size", 16);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/segment_age", 24);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/flood_window", 0);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/flood_cap", 100);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/stats_interval", 0);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/retention_interval", 0);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/retention_max_age", 0);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/retention_max_size", 0);
+	purple_prefs_add_int("/plugins/gtk/colornicks_logger/retention_keep", 0);
+	purple_prefs_add_bool("/plugins/gtk/colornicks_logger/retention_archive", FALSE);
 }
 
 PURPLE_INIT_PLUGIN(colornicks_logger, init_plugin, info)